@@ -0,0 +1,5 @@
+# generated by configure
+HAS_EPOLL ?= true
+PROCESS_MODEL ?= posix
+SYNTAX_ENABLE = false
+LSP_ENABLE = true
@@ -0,0 +1,8 @@
+/* Generated by configure */
+#ifndef _CONFIG_H
+#define _CONFIG_H
+#define HAS_EPOLL 1
+#define PROCESS_MODEL posix
+#undef SYNTAX_ENABLE
+#define LSP_ENABLE 1
+#endif
@@ -10,13 +10,18 @@ void frame_allocator_destroy(struct frame_allocator *alloc) {
   alloc->buf = NULL;
 }
 
+// alignment of every allocation, enough for any type stored in them
+#define FRAME_ALIGNMENT 8
+
 void *frame_allocator_alloc(struct frame_allocator *alloc, size_t sz) {
-  if (alloc->offset + sz > alloc->capacity) {
+  size_t offset =
+      (alloc->offset + FRAME_ALIGNMENT - 1) & ~(size_t)(FRAME_ALIGNMENT - 1);
+  if (offset + sz > alloc->capacity) {
     return NULL;
   }
 
-  void *mem = alloc->buf + alloc->offset;
-  alloc->offset += sz;
+  void *mem = alloc->buf + offset;
+  alloc->offset = offset + sz;
 
   return mem;
 }
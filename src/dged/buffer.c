@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -147,6 +148,16 @@ void buffer_static_init(void) {
   settings_set_default(
       "editor.show-whitespace",
       (struct setting_value){.type = Setting_Bool, .data.bool_value = true});
+
+  settings_set_default(
+      "editor.mmap-threshold",
+      (struct setting_value){.type = Setting_Number,
+                             .data.number_value = 64 * 1024 * 1024});
+
+  settings_set_default(
+      "editor.text-storage",
+      (struct setting_value){.type = Setting_String,
+                             .data.string_value = "lines"});
 }
 
 void buffer_static_teardown(void) {
@@ -194,11 +205,21 @@ static uint32_t visual_char_width(struct codepoint *codepoint,
   }
 }
 
+static enum text_storage text_storage(void) {
+  struct setting *ts = settings_get("editor.text-storage");
+  if (ts != NULL && ts->value.type == Setting_String &&
+      strcmp(ts->value.data.string_value, "piece-table") == 0) {
+    return TextStorage_PieceTable;
+  }
+
+  return TextStorage_Lines;
+}
+
 static struct buffer create_internal(const char *name, char *filename) {
   struct buffer b = (struct buffer){
       .filename = filename,
       .name = strdup(name),
-      .text = text_create(10),
+      .text = text_create(10, text_storage()),
       .modified = false,
       .readonly = false,
       .lazy_row_add = true,
@@ -227,45 +248,104 @@ static void strip_final_newline(struct buffer *b) {
   }
 }
 
-static void buffer_read_from_file(struct buffer *b) {
-  struct stat sb;
-  char *fullname = to_abspath(b->filename);
-  if (stat(fullname, &sb) == 0) {
-    FILE *file = fopen(fullname, "r");
-    free(fullname);
+static int64_t mmap_threshold(void) {
+  struct setting *mt = settings_get("editor.mmap-threshold");
+  if (mt != NULL && mt->value.type == Setting_Number) {
+    return mt->value.data.number_value;
+  }
+
+  return -1;
+}
+
+/* Serve large files directly from a mapping of the file. Returns false if
+ * the file should be read normally instead.
+ */
+static bool map_file(struct buffer *b, const char *fullname,
+                     const struct stat *sb) {
+  int64_t threshold = mmap_threshold();
+  if (threshold <= 0 || !S_ISREG(sb->st_mode) || sb->st_size < threshold) {
+    return false;
+  }
+
+  int fd = open(fullname, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  uint8_t *data =
+      (uint8_t *)mmap(NULL, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
 
-    if (file == NULL) {
-      minibuffer_echo("Error opening %s: %s", b->filename, strerror(errno));
-      return;
+  // if last line is empty, leave it out
+  uint64_t nbytes = sb->st_size;
+  if (data[nbytes - 1] == '\n') {
+    --nbytes;
+  }
+
+  text_load_mapped(b->text, data, sb->st_size, nbytes);
+  return true;
+}
+
+static bool read_file(struct buffer *b, const char *fullname,
+                      const struct stat *sb) {
+  FILE *file = fopen(fullname, "r");
+  if (file == NULL) {
+    minibuffer_echo("Error opening %s: %s", b->filename, strerror(errno));
+    return false;
+  }
+
+  // read everything in one go, the size from stat is only a hint since
+  // the file might change under us or not know its size (e.g. /proc)
+  size_t capacity = sb->st_size > 0 ? sb->st_size + 1 : 4096, nbytes = 0;
+  uint8_t *data = (uint8_t *)malloc(capacity);
+  while (true) {
+    if (nbytes == capacity) {
+      capacity *= 2;
+      data = (uint8_t *)realloc(data, capacity);
     }
 
-    while (true) {
-      uint8_t buff[4096];
-      int bytes = fread(buff, 1, 4096, file);
-      if (bytes > 0) {
-        uint32_t ignore;
-        text_append(b->text, buff, bytes, &ignore);
-      } else if (bytes == 0) {
-        break; // EOF
-      } else {
-        minibuffer_echo("error reading from %s: %s", b->filename,
-                        strerror(errno));
-        fclose(file);
-        return;
-      }
+    size_t bytes = fread(data + nbytes, 1, capacity - nbytes, file);
+    nbytes += bytes;
+    if (bytes == 0) {
+      break;
     }
+  }
 
+  if (ferror(file)) {
+    minibuffer_echo("error reading from %s: %s", b->filename, strerror(errno));
+    free(data);
     fclose(file);
+    return false;
+  }
 
-    // if last line is empty, remove it
-    strip_final_newline(b);
-  } else {
+  fclose(file);
+
+  // text takes ownership of data
+  text_load(b->text, data, nbytes);
+
+  // if last line is empty, remove it
+  strip_final_newline(b);
+  return true;
+}
+
+static void buffer_read_from_file(struct buffer *b) {
+  struct stat sb;
+  char *fullname = to_abspath(b->filename);
+  if (stat(fullname, &sb) != 0) {
     minibuffer_echo("Error opening %s: %s", b->filename, strerror(errno));
     free(fullname);
     return;
   }
 
-  undo_push_boundary(&b->undo, (struct undo_boundary){.save_point = true});
+  bool loaded = map_file(b, fullname, &sb) || read_file(b, fullname, &sb);
+  free(fullname);
+
+  if (loaded) {
+    undo_push_boundary(&b->undo, (struct undo_boundary){.save_point = true});
+  }
 }
 
 static void write_line(struct text_chunk *chunk, void *userdata) {
@@ -339,24 +419,37 @@ find_prev_in_line(struct buffer *buffer, struct location start,
       .found = found};
 }
 
+static void append_span(const uint8_t *bytes, uint32_t nbytes,
+                        void *userdata) {
+  struct text_chunk *chunk = (struct text_chunk *)userdata;
+  memcpy(chunk->text + chunk->nbytes, bytes, nbytes);
+  chunk->nbytes += nbytes;
+}
+
 static struct text_chunk *copy_region(struct buffer *buffer,
                                       struct region region) {
   struct text_chunk *curr = &g_kill_ring.buffer[g_kill_ring.curr_idx];
   g_kill_ring.curr_idx = (g_kill_ring.curr_idx + 1) % KILL_RING_SZ;
 
-  if (curr->allocated) {
-    free(curr->text);
-  }
-
   struct location begin_bytes =
       buffer_location_to_byte_coords(buffer, region.begin);
   struct location end_bytes =
       buffer_location_to_byte_coords(buffer, region.end);
 
-  struct text_chunk txt =
-      text_get_region(buffer->text, begin_bytes.line, begin_bytes.col,
-                      end_bytes.line, end_bytes.col);
-  *curr = txt;
+  // reuse the memory of the entry we are replacing
+  uint64_t nbytes =
+      text_region_size(buffer->text, begin_bytes.line, begin_bytes.col,
+                       end_bytes.line, end_bytes.col);
+  uint8_t *data = curr->allocated ? curr->text : NULL;
+  *curr = (struct text_chunk){
+      .text = (uint8_t *)realloc(data, nbytes > 0 ? nbytes : 1),
+      .nbytes = 0,
+      .line = 0,
+      .allocated = true,
+  };
+
+  text_for_each_span(buffer->text, begin_bytes.line, begin_bytes.col,
+                     end_bytes.line, end_bytes.col, append_span, curr);
   return curr;
 }
 
@@ -372,26 +465,18 @@ static struct location do_indent(struct buffer *buffer, struct location at,
 
 static uint64_t to_global_offset(struct buffer *buffer,
                                  struct location bytecoords) {
-  uint32_t line = bytecoords.line;
-  uint32_t col = bytecoords.col;
-  uint32_t byteoff = 0;
   uint32_t nlines = buffer_num_lines(buffer);
 
   if (nlines == 0) {
     return 0;
   }
 
-  for (uint32_t l = 0; l < line && l < nlines; ++l) {
-    // +1 for newline
-    byteoff += text_line_size(buffer->text, l) + 1;
-  }
-
-  // handle last line
-  uint32_t l = line < nlines ? line : nlines - 1;
+  uint32_t l = bytecoords.line < nlines ? bytecoords.line : nlines - 1;
   uint32_t nbytes = text_line_size(buffer->text, l);
-  byteoff += col <= nbytes ? col : nbytes + 1;
+  uint32_t col = bytecoords.col;
 
-  return byteoff;
+  // +1 for newline
+  return text_line_offset(buffer->text, l) + (col <= nbytes ? col : nbytes + 1);
 }
 
 /* --------------------- buffer methods -------------------- */
@@ -431,16 +516,39 @@ void buffer_to_file(struct buffer *buffer) {
     return;
   }
 
+  // write to a new file next to the old one and move it in place after, the
+  // text can still be reading from a mapping of the old one
   char *fullname = expanduser(buffer->filename);
-  FILE *file = fopen(fullname, "w");
-  free(fullname);
+  size_t namelen = strlen(fullname);
+  char *tmpname = malloc(namelen + 8);
+  memcpy(tmpname, fullname, namelen);
+  memcpy(tmpname + namelen, ".XXXXXX", 8);
+
+  int fd = mkstemp(tmpname);
+  FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
   if (file == NULL) {
     minibuffer_echo("failed to open file %s for writing: %s", buffer->filename,
                     strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmpname);
+    }
+    free(tmpname);
+    free(fullname);
     return;
   }
 
-  uint32_t nlines = text_num_lines(buffer->text);
+  // keep the permissions of the file that is replaced
+  struct stat sb;
+  if (stat(fullname, &sb) == 0) {
+    fchmod(fd, sb.st_mode & 07777);
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+
+  uint32_t nlines = text_wait_num_lines(buffer->text);
   uint32_t nlines_to_write = nlines;
   if (nlines > 0) {
     struct text_chunk lastline = text_get_line(buffer->text, nlines - 1);
@@ -448,9 +556,21 @@ void buffer_to_file(struct buffer *buffer) {
     text_for_each_line(buffer->text, 0, nlines_to_write, write_line, file);
   }
 
+  bool written = !ferror(file);
+  if (fclose(file) != 0 || !written || rename(tmpname, fullname) != 0) {
+    minibuffer_echo("failed to write file %s: %s", buffer->filename,
+                    strerror(errno));
+    unlink(tmpname);
+    free(tmpname);
+    free(fullname);
+    return;
+  }
+
+  free(tmpname);
+  free(fullname);
+
   minibuffer_echo_timeout(4, "wrote %d lines to %s", nlines_to_write,
                           buffer->filename);
-  fclose(file);
 
   clock_gettime(CLOCK_REALTIME, &buffer->last_write);
   buffer->modified = false;
@@ -783,7 +903,7 @@ struct location buffer_clamp(struct buffer *buffer, int64_t line, int64_t col) {
 }
 
 struct location buffer_end(struct buffer *buffer) {
-  uint32_t nlines = buffer_num_lines(buffer);
+  uint32_t nlines = text_wait_num_lines(buffer->text);
 
   if (buffer->lazy_row_add) {
     return (struct location){.line = nlines, .col = 0};
@@ -924,8 +1044,8 @@ void buffer_find(struct buffer *buffer, const char *pattern,
 
   struct search_data data = (struct search_data){.pattern = pattern};
   VEC_INIT(&data.matches, 16);
-  text_for_each_line(buffer->text, 0, text_num_lines(buffer->text), search_line,
-                     &data);
+  text_for_each_line(buffer->text, 0, text_wait_num_lines(buffer->text),
+                     search_line, &data);
 
   *matches = VEC_ENTRIES(&data.matches);
   *nmatches = VEC_SIZE(&data.matches);
@@ -1115,110 +1235,254 @@ struct cmdbuf {
   bool show_ws;
 
   struct buffer *buffer;
+  void *(*frame_alloc)(size_t);
 };
 
-static void apply_properties(struct command_list *cmds,
-                             struct text_property *properties[],
-                             uint32_t nproperties) {
+#define MAX_LINE_PROPERTIES 32
+
+/* A range of bytes on a line that is drawn with the same colors, ending at
+ * `end`.
+ */
+struct style_run {
+  uint32_t end;
+  struct text_property_colors colors;
+};
+
+static bool colors_eq(const struct text_property_colors *a,
+                      const struct text_property_colors *b) {
+  return a->set_fg == b->set_fg && a->set_bg == b->set_bg &&
+         (!a->set_fg || a->fg == b->fg) && (!a->set_bg || a->bg == b->bg);
+}
+
+static void apply_property_colors(struct text_property_colors *colors,
+                                  const struct text_property *property) {
+  if (property->type != TextProperty_Colors) {
+    return;
+  }
+
+  const struct text_property_colors *c = &property->data.colors;
+  if (c->set_bg) {
+    colors->set_bg = true;
+    colors->bg = c->bg;
+  }
+
+  if (c->set_fg) {
+    colors->set_fg = true;
+    colors->fg = c->fg;
+  }
+}
+
+static int compare_bounds(const void *a, const void *b) {
+  uint32_t ba = *(const uint32_t *)a, bb = *(const uint32_t *)b;
+  return ba < bb ? -1 : ba > bb;
+}
+
+/* Split a line into runs of bytes with the same colors. The line is cut where
+ * properties start and end, and each property then colors the pieces it
+ * covers. The last run extends past the end of the line.
+ *
+ * `runs` has room for the properties of a line with few of them, lines with
+ * more get theirs from the frame allocator.
+ */
+static uint32_t line_style_runs(struct text *text, uint32_t line,
+                                uint32_t nbytes, void *(*frame_alloc)(size_t),
+                                struct style_run **runs) {
+  struct text_line_property stack_properties[MAX_LINE_PROPERTIES];
+  struct text_line_property *properties = stack_properties;
+  uint32_t nproperties = 0;
+  uint32_t nfound = text_get_line_properties(
+      text, line, properties, MAX_LINE_PROPERTIES, &nproperties);
+  if (nfound > nproperties) {
+    properties = frame_alloc(sizeof(struct text_line_property) * nfound);
+    text_get_line_properties(text, line, properties, nfound, &nproperties);
+  }
+
+  // the ends of the runs, where properties start and end
+  uint32_t stack_bounds[MAX_LINE_PROPERTIES * 2 + 1];
+  uint32_t *bounds = stack_bounds;
+  if (nproperties > MAX_LINE_PROPERTIES) {
+    bounds = frame_alloc(sizeof(uint32_t) * (nproperties * 2 + 1));
+    *runs = frame_alloc(sizeof(struct style_run) * (nproperties * 2 + 1));
+  }
+  uint32_t nbounds = 0;
   for (uint32_t propi = 0; propi < nproperties; ++propi) {
-    struct text_property *prop = properties[propi];
+    struct text_line_property *prop = &properties[propi];
+    if (prop->start > 0 && prop->start < nbytes) {
+      bounds[nbounds++] = prop->start;
+    }
+
+    if (prop->end != UINT32_MAX && prop->end + 1 < nbytes) {
+      bounds[nbounds++] = prop->end + 1;
+    }
+  }
+
+  qsort(bounds, nbounds, sizeof(uint32_t), compare_bounds);
+  uint32_t nunique = 0;
+  for (uint32_t boundi = 0; boundi < nbounds; ++boundi) {
+    if (nunique == 0 || bounds[nunique - 1] != bounds[boundi]) {
+      bounds[nunique++] = bounds[boundi];
+    }
+  }
+  nbounds = nunique;
+  bounds[nbounds++] = UINT32_MAX;
+
+  struct style_run *r = *runs;
+  for (uint32_t boundi = 0; boundi < nbounds; ++boundi) {
+    r[boundi] = (struct style_run){.end = bounds[boundi]};
+  }
 
-    switch (prop->type) {
-    case TextProperty_Colors: {
-      struct text_property_colors *colors = &prop->data.colors;
-      if (colors->set_bg) {
-        command_list_set_index_color_bg(cmds, colors->bg);
+  // later properties override earlier ones
+  for (uint32_t propi = 0; propi < nproperties; ++propi) {
+    struct text_line_property *prop = &properties[propi];
+
+    // the run that the property starts in
+    uint32_t lo = 0, hi = nbounds - 1;
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (bounds[mid] <= prop->start) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+
+    // runs that start inside the property get its colors
+    for (uint32_t runi = lo; runi < nbounds; ++runi) {
+      uint32_t start = runi > 0 ? bounds[runi - 1] : 0;
+      if (start > prop->end) {
+        break;
       }
 
-      if (colors->set_fg) {
-        command_list_set_index_color_fg(cmds, colors->fg);
+      if (start >= prop->start) {
+        apply_property_colors(&r[runi].colors, prop->property);
       }
-      break;
     }
-    case TextProperty_Data:
-      break;
+  }
+
+  // join runs that ended up with the same colors
+  uint32_t nruns = 0;
+  for (uint32_t runi = 0; runi < nbounds; ++runi) {
+    if (nruns > 0 && colors_eq(&r[nruns - 1].colors, &r[runi].colors)) {
+      r[nruns - 1].end = r[runi].end;
+    } else {
+      r[nruns++] = r[runi];
     }
   }
+
+  return nruns;
 }
 
-static uint64_t properties_hash(struct text_property *properties[],
-                                uint32_t nproperties) {
-  uint64_t hash = 0;
-  for (uint32_t i = 0; i < nproperties; ++i) {
-    hash += (uint64_t)properties[i];
+static void apply_colors(struct command_list *cmds,
+                         const struct text_property_colors *colors) {
+  if (colors->set_bg) {
+    command_list_set_index_color_bg(cmds, colors->bg);
   }
 
-  return hash;
+  if (colors->set_fg) {
+    command_list_set_index_color_fg(cmds, colors->fg);
+  }
 }
 
-void render_line(struct text_chunk *line, void *userdata) {
-  struct cmdbuf *cmdbuf = (struct cmdbuf *)userdata;
-  uint32_t visual_line = line->line - cmdbuf->origin.line;
+/* State of drawing a line, which is read in one or more spans. */
+struct line_render {
+  struct cmdbuf *cmdbuf;
+  uint32_t visual_line;
+  uint32_t tab_width;
 
-  command_list_set_show_whitespace(cmdbuf->cmds, cmdbuf->show_ws);
+  struct style_run *runs;
+  uint32_t nruns;
+  uint32_t runi;
+  bool colored;
+
+  // visual columns scrolled past so far
+  uint32_t scrolled;
 
-  // calculate scroll offsets
-  struct text_property *properties[32] = {0};
-  uint64_t prev_properties_hash = 0;
+  // byte in the line and visual column of the next codepoint
+  uint32_t bytei;
+  uint32_t coli;
+
+  // visual column where the next text is drawn
+  uint32_t drawn_coli;
+};
 
-  uint32_t tab_width = get_tab_width(cmdbuf->buffer);
+static void render_span(const uint8_t *bytes, uint32_t nbytes,
+                        void *userdata) {
+  struct line_render *r = (struct line_render *)userdata;
+  struct cmdbuf *cmdbuf = r->cmdbuf;
 
-  // handle scroll column offset
-  uint32_t coli = 0, bytei = 0;
-  struct utf8_codepoint_iterator iter = text_chunk_codepoint_iterator(line);
+  struct utf8_codepoint_iterator iter =
+      create_utf8_codepoint_iterator((uint8_t *)bytes, nbytes, 0);
+  uint32_t drawn = 0, offset = 0;
   struct codepoint *codepoint;
-  while (coli < cmdbuf->origin.col &&
+  while (r->coli < cmdbuf->width &&
          (codepoint = utf8_next_codepoint(&iter)) != NULL) {
-    coli += visual_char_width(codepoint, tab_width);
-    bytei += codepoint->nbytes;
-  }
+    uint32_t width = visual_char_width(codepoint, r->tab_width);
+
+    // handle scroll column offset
+    if (r->scrolled < cmdbuf->origin.col) {
+      r->scrolled += width;
+      r->bytei += codepoint->nbytes;
+      offset = drawn = iter.offset;
+      continue;
+    }
 
-  // coli is the visual column [0..width-1]
-  coli = 0;
-  uint32_t drawn_bytei = bytei;
-  uint32_t drawn_coli = coli;
+    // at the end of a run, flush text up until now and apply the next one.
+    // The first visible byte starts with the run it is in.
+    if (!r->colored || r->bytei >= r->runs[r->runi].end) {
+      if (r->colored) {
+        command_list_draw_text(cmdbuf->cmds, r->drawn_coli, r->visual_line,
+                               (uint8_t *)bytes + drawn, offset - drawn);
+        command_list_reset_color(cmdbuf->cmds);
+      }
 
-  while (coli < cmdbuf->width &&
-         (codepoint = utf8_next_codepoint(&iter)) != NULL) {
-    // calculate character properties
-    uint32_t nproperties = 0;
-    text_get_properties(cmdbuf->buffer->text, line->line, bytei, properties, 32,
-                        &nproperties);
-
-    // if we have any new or lost props, flush text up until now, reset
-    // and re-apply current properties
-    uint64_t new_properties_hash = properties_hash(properties, nproperties);
-    if (new_properties_hash != prev_properties_hash) {
-      command_list_draw_text(cmdbuf->cmds, drawn_coli, visual_line,
-                             line->text + drawn_bytei, bytei - drawn_bytei);
-      command_list_reset_color(cmdbuf->cmds);
-
-      drawn_coli = coli;
-      drawn_bytei = bytei;
-
-      // apply new properties
-      apply_properties(cmdbuf->cmds, properties, nproperties);
+      r->drawn_coli = r->coli;
+      drawn = offset;
+
+      while (r->runi + 1 < r->nruns && r->runs[r->runi].end <= r->bytei) {
+        ++r->runi;
+      }
+      apply_colors(cmdbuf->cmds, &r->runs[r->runi].colors);
+      r->colored = true;
     }
 
-    prev_properties_hash = new_properties_hash;
-    bytei += codepoint->nbytes;
-    coli += visual_char_width(codepoint, tab_width);
+    r->bytei += codepoint->nbytes;
+    r->coli += width;
+    offset = iter.offset;
   }
 
-  // flush remaining
-  command_list_draw_text(cmdbuf->cmds, drawn_coli, visual_line,
-                         line->text + drawn_bytei, bytei - drawn_bytei);
+  // flush what is left of the span, the next one continues with the same run
+  if (offset > drawn) {
+    command_list_draw_text(cmdbuf->cmds, r->drawn_coli, r->visual_line,
+                           (uint8_t *)bytes + drawn, offset - drawn);
+    r->drawn_coli = r->coli;
+  }
+}
 
-  drawn_coli = coli;
-  drawn_bytei = bytei;
+static void render_line(struct cmdbuf *cmdbuf, uint32_t line,
+                        uint32_t nbytes) {
+  command_list_set_show_whitespace(cmdbuf->cmds, cmdbuf->show_ws);
+
+  struct style_run stack_runs[MAX_LINE_PROPERTIES * 2 + 1];
+  struct line_render r = {
+      .cmdbuf = cmdbuf,
+      .visual_line = line - cmdbuf->origin.line,
+      .tab_width = get_tab_width(cmdbuf->buffer),
+      .runs = stack_runs,
+  };
+  r.nruns = line_style_runs(cmdbuf->buffer->text, line, nbytes,
+                            cmdbuf->frame_alloc, &r.runs);
+
+  // read the line around the gap of a line being edited instead of closing it
+  text_for_each_span(cmdbuf->buffer->text, line, 0, line, nbytes, render_span,
+                     &r);
 
   command_list_reset_color(cmdbuf->cmds);
   command_list_set_show_whitespace(cmdbuf->cmds, false);
 
   // TODO: considering the whole screen is cleared, is this really needed?
-  if (drawn_coli < cmdbuf->width) {
-    command_list_draw_repeated(cmdbuf->cmds, drawn_coli, visual_line, ' ',
-                               cmdbuf->width - drawn_coli);
+  if (r.coli < cmdbuf->width) {
+    command_list_draw_repeated(cmdbuf->cmds, r.coli, r.visual_line, ' ',
+                               cmdbuf->width - r.coli);
   }
 }
 
@@ -1228,14 +1492,25 @@ void buffer_update(struct buffer *buffer) {
   }
 }
 
+void buffer_run_render_hooks(struct buffer *buffer, const struct region *shown,
+                             uint32_t nshown) {
+  VEC_FOR_EACH(&buffer->hooks->render_hooks, struct render_hook * h) {
+    h->callback(buffer, h->userdata, shown, nshown);
+  }
+}
+
 void buffer_render(struct buffer *buffer, struct buffer_render_params *params) {
   if (params->width == 0 || params->height == 0) {
     return;
   }
 
-  VEC_FOR_EACH(&buffer->hooks->render_hooks, struct render_hook * h) {
-    h->callback(buffer, h->userdata, params->origin, params->width,
-                params->height);
+  if (!params->skip_render_hooks) {
+    struct region shown = {
+        .begin = params->origin,
+        .end = {.line = params->origin.line + params->height,
+                .col = params->origin.col + params->width},
+    };
+    buffer_run_render_hooks(buffer, &shown, 1);
   }
 
   struct setting *show_ws = settings_get("editor.show-whitespace");
@@ -1248,9 +1523,19 @@ void buffer_render(struct buffer *buffer, struct buffer_render_params *params) {
       .show_ws = (show_ws != NULL ? show_ws->value.data.bool_value : true) &&
                  !buffer->force_show_ws_off,
       .buffer = buffer,
+      .frame_alloc = params->frame_alloc,
   };
-  text_for_each_line(buffer->text, params->origin.line, params->height,
-                     render_line, &cmdbuf);
+  command_list_set_tab_width(params->commands, get_tab_width(buffer));
+  for (uint32_t line = params->origin.line;
+       line < params->origin.line + params->height; ++line) {
+    // the size of a line of a mapped text waits for the line to be counted
+    uint32_t nbytes = text_line_size(buffer->text, line);
+    if (line >= text_num_lines(buffer->text)) {
+      break;
+    }
+
+    render_line(&cmdbuf, line, nbytes);
+  }
 
   // draw empty lines
   uint32_t nlines = text_num_lines(buffer->text);
@@ -1263,10 +1548,20 @@ void buffer_render(struct buffer *buffer, struct buffer_render_params *params) {
 void buffer_add_text_property(struct buffer *buffer, struct location start,
                               struct location end,
                               struct text_property property) {
+  buffer_add_layer_text_property(buffer, 0, start, end, property);
+}
+
+void buffer_add_layer_text_property(struct buffer *buffer, uint32_t layer,
+                                    struct location start, struct location end,
+                                    struct text_property property) {
   struct location bytestart = buffer_location_to_byte_coords(buffer, start);
   struct location byteend = buffer_location_to_byte_coords(buffer, end);
-  text_add_property(buffer->text, bytestart.line, bytestart.col, byteend.line,
-                    byteend.col, property);
+  text_add_layer_property(buffer->text, layer, bytestart.line, bytestart.col,
+                          byteend.line, byteend.col, property);
+}
+
+void buffer_clear_text_layer(struct buffer *buffer, uint32_t layer) {
+  text_clear_layer(buffer->text, layer);
 }
 
 void buffer_get_text_properties(struct buffer *buffer, struct location location,
@@ -1371,6 +1666,42 @@ struct location buffer_location_to_byte_coords(struct buffer *buffer,
                                   (codepoint != NULL ? codepoint->nbytes : 0)};
 }
 
+static struct location from_byte_coords(struct buffer *buffer,
+                                        struct location bytecoords) {
+  struct utf8_codepoint_iterator iter =
+      text_line_codepoint_iterator(buffer->text, bytecoords.line);
+  uint32_t byteoffset = 0, col = 0, tab_width = get_tab_width(buffer);
+  struct codepoint *codepoint;
+  while (byteoffset < bytecoords.col &&
+         (codepoint = utf8_next_codepoint(&iter)) != NULL) {
+    byteoffset += codepoint->nbytes;
+    col += visual_char_width(codepoint, tab_width);
+  }
+
+  return (struct location){.line = bytecoords.line, .col = col};
+}
+
+struct location buffer_goto_byte(struct buffer *buffer, uint64_t offset) {
+  return from_byte_coords(buffer, text_offset_location(buffer->text, offset));
+}
+
+struct marker *buffer_marker_create(struct buffer *buffer,
+                                    struct location location,
+                                    enum marker_gravity gravity) {
+  struct location bytecoords = buffer_location_to_byte_coords(buffer, location);
+  return text_add_marker(buffer->text, bytecoords.line, bytecoords.col,
+                         gravity);
+}
+
+struct location buffer_marker_location(struct buffer *buffer,
+                                       struct marker *marker) {
+  return from_byte_coords(buffer, text_marker_location(buffer->text, marker));
+}
+
+void buffer_marker_destroy(struct buffer *buffer, struct marker *marker) {
+  text_remove_marker(buffer->text, marker);
+}
+
 struct match_result
 buffer_find_prev_in_line(struct buffer *buffer, struct location start,
                          bool (*predicate)(const struct codepoint *c)) {
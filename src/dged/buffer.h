@@ -432,6 +432,32 @@ void buffer_add_text_property(struct buffer *buffer, struct location start,
                               struct location end,
                               struct text_property property);
 
+/**
+ * Add a text property to a region of the buffer, in a property layer.
+ *
+ * Unlike properties added with @ref buffer_add_text_property, which are
+ * cleared every frame, properties in a layer stay until the layer is cleared
+ * and move with the text when the buffer is edited.
+ *
+ * @param buffer The buffer to add a text property to.
+ * @param layer The layer to add the property to, from @ref
+ * text_property_layer.
+ * @param start The start of the region to set the property for.
+ * @param end The end of the region to set the property for.
+ * @param property The text property to set.
+ */
+void buffer_add_layer_text_property(struct buffer *buffer, uint32_t layer,
+                                    struct location start, struct location end,
+                                    struct text_property property);
+
+/**
+ * Clear the text properties in one layer of @p buffer.
+ *
+ * @param buffer The buffer to clear properties for.
+ * @param layer The layer to clear, from @ref text_property_layer.
+ */
+void buffer_clear_text_layer(struct buffer *buffer, uint32_t layer);
+
 /**
  * Get active text properties at @p location in @p buffer.
  *
@@ -491,14 +517,12 @@ void buffer_remove_update_hook(struct buffer *buffer, uint32_t hook_id,
  *
  * @param buffer The buffer.
  * @param userdata Userdata sent in when registering the hook.
- * @param origin The upper left corner of the region of the buffer
- *   currently rendering.
- * @param width The width of the rendered region.
- * @param height The height of the rendered region.
+ * @param shown The parts of the buffer currently rendering, excluding their
+ *   ends. They do not overlap and are sorted on their first line.
+ * @param nshown The number of parts in @p shown.
  */
 typedef void (*render_hook_cb)(struct buffer *buffer, void *userdata,
-                               struct location origin, uint32_t width,
-                               uint32_t height);
+                               const struct region *shown, uint32_t nshown);
 
 /**
  * Add a buffer render hook.
@@ -705,6 +729,13 @@ struct buffer_render_params {
 
   /** Window height for this buffer, -1 if it is not in a window */
   uint32_t height;
+
+  /** Allocator for memory that is only needed for this frame */
+  void *(*frame_alloc)(size_t);
+
+  /** Do not run the render hooks, they have already been run with
+   * @ref buffer_run_render_hooks */
+  bool skip_render_hooks;
 };
 
 /**
@@ -714,6 +745,19 @@ struct buffer_render_params {
  */
 void buffer_update(struct buffer *buffer);
 
+/**
+ * Run the render hooks of a buffer.
+ *
+ * This is done by @ref buffer_render, but a buffer that is rendered in several
+ * places can have them run once for all of them instead.
+ * @param [in] buffer The buffer to run the render hooks for.
+ * @param [in] shown The parts of the buffer to render, excluding their ends.
+ *   They must not overlap and be sorted on their first line.
+ * @param [in] nshown The number of parts in @p shown.
+ */
+void buffer_run_render_hooks(struct buffer *buffer, const struct region *shown,
+                             uint32_t nshown);
+
 /**
  * Render a buffer.
  * @param [in] buffer The buffer to render.
@@ -734,6 +778,54 @@ void buffer_sort_lines(struct buffer *buffer, uint32_t start_line,
 struct location buffer_location_to_byte_coords(struct buffer *buffer,
                                                struct location coords);
 
+/**
+ * Get the location of a byte offset in the buffer.
+ *
+ * The offset is counted from the start of the buffer with one byte for each
+ * newline, the same way as the global byte offsets passed to edit hooks.
+ *
+ * @param [in] buffer The buffer to use.
+ * @param [in] offset The byte offset.
+ * @returns The location (line and column) of @p offset, clamped to the end of
+ * the buffer.
+ */
+struct location buffer_goto_byte(struct buffer *buffer, uint64_t offset);
+
+/**
+ * Create a marker in the buffer.
+ *
+ * A marker is a location that is kept up to date when the buffer is edited,
+ * without having to adjust it by hand.
+ *
+ * @param [in] buffer The buffer to create the marker in.
+ * @param [in] location The location of the marker.
+ * @param [in] gravity If the marker stays before (@ref MarkerGravity_Left) or
+ * moves after (@ref MarkerGravity_Right) text inserted at it.
+ * @returns The new marker. It is valid until destroyed with
+ * @ref buffer_marker_destroy or until the buffer is destroyed.
+ */
+struct marker *buffer_marker_create(struct buffer *buffer,
+                                    struct location location,
+                                    enum marker_gravity gravity);
+
+/**
+ * Get the current location of a marker.
+ *
+ * @param [in] buffer The buffer the marker was created in.
+ * @param [in] marker The marker.
+ * @returns The location (line and column) of @p marker.
+ */
+struct location buffer_marker_location(struct buffer *buffer,
+                                       struct marker *marker);
+
+/**
+ * Destroy a marker.
+ *
+ * @param [in] buffer The buffer the marker was created in.
+ * @param [in] marker The marker to destroy.
+ */
+void buffer_marker_destroy(struct buffer *buffer, struct marker *marker);
+
 struct match_result {
   struct location at;
   bool found;
@@ -3,6 +3,7 @@
 #include "buffer.h"
 #include "buffer_view.h"
 #include "display.h"
+#include "settings.h"
 #include "timers.h"
 #include "utf8.h"
 
@@ -34,6 +35,7 @@ struct buffer_view buffer_view_create(struct buffer *buffer, bool modeline,
       .modeline = NULL,
       .line_numbers = line_numbers,
       .fringe_width = 0,
+      .region_layer = text_property_layer_new(),
   };
 
   if (modeline) {
@@ -55,6 +57,7 @@ struct buffer_view buffer_view_clone(const struct buffer_view *view) {
       .buffer = view->buffer,
       .modeline = NULL,
       .line_numbers = view->line_numbers,
+      .region_layer = text_property_layer_new(),
   };
 
   if (view->modeline) {
@@ -66,7 +69,16 @@ struct buffer_view buffer_view_clone(const struct buffer_view *view) {
   return c;
 }
 
+void buffer_view_hide(struct buffer_view *view) {
+  if (view->buffer != NULL && view->region_highlighted) {
+    buffer_clear_text_layer(view->buffer, view->region_layer);
+    view->region_highlighted = false;
+  }
+}
+
 void buffer_view_destroy(struct buffer_view *view) {
+  buffer_view_hide(view);
+
   if (view->modeline != NULL) {
     free(view->modeline->buffer);
     free(view->modeline);
@@ -312,24 +324,32 @@ static uint32_t longest_linenum(struct buffer_view *view) {
   return longest_nchars;
 }
 
-static uint32_t render_line_numbers(struct buffer_view *view,
-                                    struct command_list *commands,
-                                    uint32_t height) {
-  uint32_t longest_nchars = longest_linenum(view);
+static void render_line_number(struct buffer_view *view,
+                               struct command_list *commands, uint32_t line,
+                               uint32_t longest_nchars) {
   static char buf[16];
+  uint32_t relline = line - view->scroll.line;
+
+  command_list_set_index_color_bg(commands, Color_BrightBlack);
+  command_list_set_index_color_fg(
+      commands, line == view->dot.line ? Color_BrightWhite : Color_White);
+  uint32_t chars = snprintf(buf, 16, "%*d", longest_nchars + 1, line + 1);
+  command_list_draw_text_copy(commands, 0, relline, (uint8_t *)buf, chars);
+  command_list_reset_color(commands);
+  command_list_draw_repeated(commands, longest_nchars + 1, relline, ' ', 1);
+}
+
+static void render_line_numbers(struct buffer_view *view,
+                                struct command_list *commands,
+                                uint32_t height) {
+  uint32_t longest_nchars = longest_linenum(view);
 
   uint32_t nlines_buf = buffer_num_lines(view->buffer);
   uint32_t line = view->scroll.line;
   uint32_t relline = 0;
 
   for (; relline < height && line < nlines_buf; ++line, ++relline) {
-    command_list_set_index_color_bg(commands, Color_BrightBlack);
-    command_list_set_index_color_fg(
-        commands, line == view->dot.line ? Color_BrightWhite : Color_White);
-    uint32_t chars = snprintf(buf, 16, "%*d", longest_nchars + 1, line + 1);
-    command_list_draw_text_copy(commands, 0, relline, (uint8_t *)buf, chars);
-    command_list_reset_color(commands);
-    command_list_draw_repeated(commands, longest_nchars + 1, relline, ' ', 1);
+    render_line_number(view, commands, line, longest_nchars);
   }
 
   for (; relline < height; ++relline) {
@@ -339,8 +359,6 @@ static uint32_t render_line_numbers(struct buffer_view *view,
     command_list_reset_color(commands);
     command_list_draw_repeated(commands, longest_nchars + 1, relline, ' ', 1);
   }
-
-  return longest_nchars + 2;
 }
 
 static void render_modeline(struct modeline *modeline, struct buffer_view *view,
@@ -374,6 +392,8 @@ static void render_modeline(struct modeline *modeline, struct buffer_view *view,
     modeline->buffer[len] = '\0';
   }
 
+  // the text can be shorter than the width if it is not all ascii
+  command_list_clear(commands, 0, height - 1, width, 1);
   command_list_set_index_color_bg(commands, Color_BrightBlack);
   command_list_set_index_color_fg(commands, Color_White);
   command_list_draw_text(commands, 0, height - 1, modeline->buffer,
@@ -381,95 +401,202 @@ static void render_modeline(struct modeline *modeline, struct buffer_view *view,
   command_list_reset_color(commands);
 }
 
-void buffer_view_update(struct buffer_view *view,
-                        struct buffer_view_update_params *params) {
+/* Redraw the line numbers of the lines that dot moved between, which are the
+ * only line numbers that change when nothing else did.
+ */
+static void render_dot_line_numbers(struct buffer_view *view,
+                                    struct command_list *commands,
+                                    uint32_t height) {
+  uint32_t longest_nchars = longest_linenum(view);
 
-  struct timer *buffer_update_timer =
-      timer_start("update-windows.buffer-update");
-  buffer_update(view->buffer);
-  timer_stop(buffer_update_timer);
+  uint32_t nlines_buf = buffer_num_lines(view->buffer);
+  uint32_t lines[] = {view->rendered.dot_line, view->dot.line};
+  for (uint32_t i = 0; i < 2; ++i) {
+    uint32_t line = lines[i];
+    if (line >= view->scroll.line && line < view->scroll.line + height &&
+        line < nlines_buf) {
+      render_line_number(view, commands, line, longest_nchars);
+    }
+  }
+}
 
-  uint32_t height = params->height;
-  uint32_t width = params->width;
+/* Can what was drawn in the previous frame be kept? This is the case when it
+ * was drawn from the same inputs and nothing has been drawn over it since.
+ */
+static bool can_keep(const struct buffer_view_rendered *prev,
+                     const struct buffer_view_rendered *next) {
+  return next->frame > 0 && prev->frame + 1 == next->frame &&
+         prev->buffer == next->buffer &&
+         prev->text_generation == next->text_generation &&
+         prev->properties_generation == next->properties_generation &&
+         prev->settings_generation == next->settings_generation &&
+         location_compare(prev->scroll, next->scroll) == 0 &&
+         prev->window_x == next->window_x && prev->window_y == next->window_y &&
+         prev->width == next->width && prev->height == next->height;
+}
 
+struct region buffer_view_visible_region(struct buffer_view *view,
+                                         uint32_t width, uint32_t height) {
   /* Make sure the dot is always inside buffer limits.
    * It can be outside for example if the text is changed elsewhere. */
   view->dot = buffer_clamp(view->buffer, (int64_t)view->dot.line,
                            (int64_t)view->dot.col);
 
-  // render modeline
-  struct timer *render_modeline_timer =
-      timer_start("update-windows.modeline-render");
-  uint32_t modeline_height = 0;
-  if (view->modeline != NULL) {
-    modeline_height = 1;
-    render_modeline(view->modeline, view, params->commands, params->window_id,
-                    params->width, params->height, params->frame_time);
-  }
-
-  height -= modeline_height;
+  uint32_t text_height = view->modeline != NULL ? height - 1 : height;
 
   // update scroll position if needed
-  if (view->dot.line >= view->scroll.line + height ||
+  if (view->dot.line >= view->scroll.line + text_height ||
       view->dot.line < view->scroll.line) {
     // put dot in the middle, height-wise
     view->scroll.line =
-        buffer_clamp(view->buffer, (int64_t)view->dot.line - params->height / 2,
-                     0)
+        buffer_clamp(view->buffer, (int64_t)view->dot.line - height / 2, 0)
             .line;
   }
-  timer_stop(render_modeline_timer);
-
-  // render line numbers
-  struct timer *render_linenumbers_timer =
-      timer_start("update-windows.linenum-render");
-  uint32_t linum_width = 0;
-  if (view->line_numbers) {
-    linum_width = render_line_numbers(view, params->commands, height);
-  }
 
-  width -= linum_width;
+  uint32_t linum_width = view->line_numbers ? longest_linenum(view) + 2 : 0;
+  uint32_t text_width = width - linum_width;
   view->fringe_width = linum_width;
 
-  if (view->dot.col >= view->scroll.col + width ||
+  if (view->dot.col >= view->scroll.col + text_width ||
       view->dot.col < view->scroll.col) {
     view->scroll.col =
         buffer_clamp(view->buffer, view->dot.line, view->dot.col).col;
   }
-  timer_stop(render_linenumbers_timer);
 
-  // color region
-  if (view->mark_set) {
-    struct region reg = region_new(view->dot, view->mark);
-    if (region_has_size(reg)) {
-      buffer_add_text_property(view->buffer, reg.begin, reg.end,
-                               (struct text_property){
-                                   .type = TextProperty_Colors,
-                                   .data.colors =
-                                       (struct text_property_colors){
-                                           .set_bg = true,
-                                           .bg = 5,
-                                           .set_fg = false,
-                                       },
-                               });
+  return (struct region){
+      .begin = view->scroll,
+      .end =
+          (struct location){
+              .line = view->scroll.line + text_height,
+              .col = view->scroll.col + text_width,
+          },
+  };
+}
+
+void buffer_view_highlight_region(struct buffer_view *view) {
+  // the highlight stays in the buffer until the region changes
+  struct region reg = region_new(view->dot, view->mark);
+  bool has_region = view->mark_set && region_has_size(reg);
+  bool region_changed =
+      has_region != view->region_highlighted ||
+      (has_region &&
+       (location_compare(reg.begin, view->highlighted_region.begin) != 0 ||
+        location_compare(reg.end, view->highlighted_region.end) != 0));
+
+  if (region_changed) {
+    buffer_clear_text_layer(view->buffer, view->region_layer);
+    view->highlighted_region = reg;
+    view->region_highlighted = has_region;
+
+    if (has_region) {
+      buffer_add_layer_text_property(
+          view->buffer, view->region_layer, reg.begin, reg.end,
+          (struct text_property){
+              .type = TextProperty_Colors,
+              .data.colors =
+                  (struct text_property_colors){
+                      .set_bg = true,
+                      .bg = 5,
+                      .set_fg = false,
+                  },
+          });
+    }
+  }
+}
+
+void buffer_view_update(struct buffer_view *view,
+                        struct buffer_view_update_params *params) {
+
+  if (!params->hooks_run) {
+    struct timer *buffer_update_timer =
+        timer_start("update-windows.buffer-update");
+    buffer_update(view->buffer);
+    timer_stop(buffer_update_timer);
+  }
+
+  // other windows might keep what they drew, do not draw over them
+  command_list_set_clip(params->commands, params->width, params->height);
+
+  struct region visible =
+      buffer_view_visible_region(view, params->width, params->height);
+  if (!params->hooks_run) {
+    buffer_view_highlight_region(view);
+  }
+
+  uint32_t height = visible.end.line - visible.begin.line;
+  uint32_t width = visible.end.col - visible.begin.col;
+  uint32_t linum_width = view->fringe_width;
+
+  // render modeline
+  struct timer *render_modeline_timer =
+      timer_start("update-windows.modeline-render");
+  if (view->modeline != NULL) {
+    render_modeline(view->modeline, view, params->commands, params->window_id,
+                    params->width, params->height, params->frame_time);
+  }
+  timer_stop(render_modeline_timer);
+
+  struct buffer_view_rendered rendered = {
+      .frame = params->frame,
+      .buffer = view->buffer,
+      .text_generation = text_generation(view->buffer->text),
+      .properties_generation = text_properties_generation(view->buffer->text),
+      .settings_generation = settings_generation(),
+      .scroll = view->scroll,
+      .window_x = params->window_x,
+      .window_y = params->window_y,
+      .width = params->width,
+      .height = params->height,
+      .dot_line = view->dot.line,
+  };
+
+  // if only dot moved, the buffer contents and line numbers from the previous
+  // frame are still on the display, only redraw the line numbers that dot
+  // moved between
+  if (can_keep(&view->rendered, &rendered)) {
+    if (view->line_numbers) {
+      struct timer *render_linenumbers_timer =
+          timer_start("update-windows.linenum-render");
+      render_dot_line_numbers(view, params->commands, height);
+      timer_stop(render_linenumbers_timer);
     }
+
+    view->rendered = rendered;
+    return;
+  }
+
+  command_list_clear(params->commands, 0, 0, params->width, height);
+
+  // render line numbers
+  struct timer *render_linenumbers_timer =
+      timer_start("update-windows.linenum-render");
+  if (view->line_numbers) {
+    render_line_numbers(view, params->commands, height);
   }
+  timer_stop(render_linenumbers_timer);
 
   // render buffer
   struct timer *render_buffer_timer =
       timer_start("update-windows.buffer-render");
   struct command_list *buf_cmds = command_list_create(
-      width * height, params->frame_alloc, params->window_x + linum_width,
+      height * 128, params->frame_alloc, params->window_x + linum_width,
       params->window_y, view->buffer->name);
   struct buffer_render_params render_params = {
       .commands = buf_cmds,
       .origin = view->scroll,
       .width = width,
       .height = height,
+      .frame_alloc = params->frame_alloc,
+      .skip_render_hooks = params->hooks_run,
   };
   buffer_render(view->buffer, &render_params);
 
   // draw buffer commands nested inside this command list
   command_list_draw_command_list(params->commands, buf_cmds);
   timer_stop(render_buffer_timer);
+
+  // render hooks can add properties
+  rendered.properties_generation =
+      text_properties_generation(view->buffer->text);
+  view->rendered = rendered;
 }
@@ -7,6 +7,41 @@
 
 struct buffer;
 
+/**
+ * What a buffer view drew in a frame, and what it was drawn from.
+ *
+ * If nothing but the dot has changed in the next frame, the buffer contents
+ * are kept as they were drawn instead of being rendered again.
+ */
+struct buffer_view_rendered {
+  /** The frame that this was drawn in, 0 if nothing can be kept from it */
+  uint64_t frame;
+
+  /** The buffer that was drawn */
+  struct buffer *buffer;
+
+  /** Generation of the buffer text */
+  uint64_t text_generation;
+
+  /** Generation of the buffer text properties */
+  uint64_t properties_generation;
+
+  /** Generation of the settings */
+  uint64_t settings_generation;
+
+  /** Scroll position */
+  struct location scroll;
+
+  /** Position and size of the window */
+  uint32_t window_x;
+  uint32_t window_y;
+  uint32_t width;
+  uint32_t height;
+
+  /** The line that dot was on, which has its line number highlighted */
+  uint32_t dot_line;
+};
+
 /**
  * A view of a buffer.
  *
@@ -36,6 +71,18 @@ struct buffer_view {
 
   /** True if the start of a selection has been set */
   bool mark_set;
+
+  /** The property layer that the selection of this view is highlighted in */
+  uint32_t region_layer;
+
+  /** The selection currently highlighted in the buffer, if any */
+  struct region highlighted_region;
+
+  /** True if a selection is highlighted in the buffer */
+  bool region_highlighted;
+
+  /** What was drawn in the latest frame */
+  struct buffer_view_rendered rendered;
 };
 
 struct buffer_view buffer_view_create(struct buffer *buffer, bool modeline,
@@ -43,6 +90,16 @@ struct buffer_view buffer_view_create(struct buffer *buffer, bool modeline,
 struct buffer_view buffer_view_clone(const struct buffer_view *view);
 void buffer_view_destroy(struct buffer_view *view);
 
+/**
+ * Stop showing a buffer view.
+ *
+ * Removes the highlight of its region from the buffer, where other views of
+ * the buffer would show it. It is added back the next time the view is
+ * updated.
+ * @param view The buffer view.
+ */
+void buffer_view_hide(struct buffer_view *view);
+
 void buffer_view_add(struct buffer_view *view, uint8_t *txt, uint32_t nbytes);
 
 void buffer_view_goto_beginning(struct buffer_view *view);
@@ -95,8 +152,39 @@ struct buffer_view_update_params {
   uint32_t height;
   uint32_t window_x;
   uint32_t window_y;
+
+  /** Number of this frame, one more than the previous one. 0 if nothing that
+   * was drawn in earlier frames can be kept. */
+  uint64_t frame;
+
+  /** The update and render hooks of the buffer have already been run, and the
+   * regions of all views of it highlighted, for this frame. */
+  bool hooks_run;
 };
 
+/**
+ * Get the part of the buffer that a buffer view shows.
+ *
+ * This scrolls the view to dot first, the same way @ref buffer_view_update
+ * does, so it can be used to find out what is going to be rendered.
+ * @param view The buffer view.
+ * @param width The width of the window showing the buffer view.
+ * @param height The height of the window showing the buffer view.
+ * @returns The region of the buffer that is shown, excluding the end.
+ */
+struct region buffer_view_visible_region(struct buffer_view *view,
+                                         uint32_t width, uint32_t height);
+
+/**
+ * Highlight the region of a buffer view in its buffer.
+ *
+ * Each view highlights its region in a property layer of its own, so views
+ * showing the same buffer keep each other's highlights. Since the highlight
+ * is visible in all of the views, it has to be updated before any of them are.
+ * @param view The buffer view.
+ */
+void buffer_view_highlight_region(struct buffer_view *view);
+
 void buffer_view_update(struct buffer_view *view,
                         struct buffer_view_update_params *params);
 
@@ -2,11 +2,15 @@
 #include "display.h"
 
 #include "buffer.h"
+#include "reactor.h"
 #include "timers.h"
 #include "utf8.h"
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,13 +21,96 @@
 
 #define ESC 0x1b
 
+// colors are tagged with their kind in the top byte
+#define COLOR_DEFAULT 0
+#define COLOR_INDEXED (1u << 24)
+#define COLOR_RGB (2u << 24)
+#define COLOR_KIND(c) ((c) & 0xff000000u)
+
+// bytes of a codepoint, and any zero-width codepoints that follow it
+#define CELL_BYTES 8
+
+struct cell_style {
+  uint32_t fg;
+  uint32_t bg;
+  bool inverted;
+};
+
+struct cell {
+  uint8_t bytes[CELL_BYTES];
+  uint8_t nbytes;
+
+  // number of columns, 0 for the second half of a wide character
+  uint8_t width;
+
+  struct cell_style style;
+};
+
+// SGR parameters selecting a color, like "38;5;208"
+struct sgr_fragment {
+  uint8_t len;
+  char bytes[15];
+};
+
 struct display {
   struct termios term;
   struct termios orig_term;
   uint32_t width;
   uint32_t height;
+
+  // what has been drawn and what the terminal is showing
+  struct cell *cells;
+  struct cell *prev_cells;
+  uint32_t grid_width;
+  uint32_t grid_height;
+
+  // per row, the columns [from, to) that were drawn since the terminal was
+  // last updated, the rest of the row is the same as on the terminal
+  uint32_t *dirty_from;
+  uint32_t *dirty_to;
+
+  // drawing outside of these is ignored, see command_list_set_clip
+  uint32_t clip_left;
+  uint32_t clip_top;
+  uint32_t clip_right;
+  uint32_t clip_bottom;
+
+  // per row of the grids, used to find rows that moved
+  uint64_t *row_hashes;
+  uint64_t *prev_row_hashes;
+  uint32_t *row_counts;
+  bool prev_row_hashes_valid;
+
+  uint32_t cursor_row;
+  uint32_t cursor_col;
+
+  // bytes written to the terminal during the current frame
+  uint64_t nbytes;
+
+  // output collected during a frame, written to the terminal in one go
+  uint8_t *out;
+  uint32_t nout;
+  uint32_t out_capacity;
+
+  // how much of the output the terminal has taken, when it could not take
+  // all of it at once, and the reactor event to wait for it to take more
+  uint32_t out_written;
+  int out_flags;
+  struct reactor *reactor;
+  uint32_t write_interest;
+
+  // a frame ended while the terminal was busy and has not been written
+  bool frame_skipped;
+
+  // formatted once, for the default color and all indexed colors
+  struct sgr_fragment fg_sgr[257];
+  struct sgr_fragment bg_sgr[257];
 };
 
+/* Commands are encoded one after another in the command list's data, as a
+ * type byte followed by the command struct. Text drawn with
+ * command_list_draw_text_copy is stored right after its command.
+ */
 enum render_cmd_type {
   RenderCommand_DrawText = 0,
   RenderCommand_PushFormat = 1,
@@ -31,17 +118,9 @@ enum render_cmd_type {
   RenderCommand_ClearFormat = 3,
   RenderCommand_SetShowWhitespace = 4,
   RenderCommand_DrawList = 5,
-};
-
-struct render_command {
-  enum render_cmd_type type;
-  union render_cmd_data {
-    struct draw_text_cmd *draw_txt;
-    struct push_fmt_cmd *push_fmt;
-    struct repeat_cmd *repeat;
-    struct show_ws_cmd *show_ws;
-    struct draw_list_cmd *draw_list;
-  } data;
+  RenderCommand_SetTabWidth = 6,
+  RenderCommand_DrawTextInline = 7,
+  RenderCommand_Clear = 8,
 };
 
 struct draw_text_cmd {
@@ -52,11 +131,23 @@ struct draw_text_cmd {
   uint32_t len;
 };
 
-struct push_fmt_cmd {
-  uint8_t fmt[64];
+struct draw_text_inline_cmd {
+  uint32_t col;
+  uint32_t row;
   uint32_t len;
 };
 
+enum fmt_attr {
+  Fmt_Fg,
+  Fmt_Bg,
+  Fmt_Inverted,
+};
+
+struct push_fmt_cmd {
+  enum fmt_attr attr;
+  uint32_t color;
+};
+
 struct repeat_cmd {
   uint32_t col;
   uint32_t row;
@@ -72,19 +163,48 @@ struct draw_list_cmd {
   struct command_list *list;
 };
 
+struct tab_width_cmd {
+  uint32_t width;
+};
+
+struct clear_cmd {
+  uint32_t col;
+  uint32_t row;
+  uint32_t width;
+  uint32_t height;
+};
+
 struct command_list {
-  struct render_command *cmds;
-  uint64_t ncmds;
-  uint64_t capacity;
+  uint8_t *data;
+  uint32_t size;
+  uint32_t capacity;
 
   uint32_t xoffset;
   uint32_t yoffset;
 
   void *(*allocator)(size_t);
 
+  uint32_t clip_width;
+  uint32_t clip_height;
+
   char name[16];
 
+  // more commands, when this list ran out of capacity
   struct command_list *next_list;
+  struct command_list *last_list;
+};
+
+static const struct cell_style default_style = {
+    .fg = COLOR_DEFAULT,
+    .bg = COLOR_DEFAULT,
+    .inverted = false,
+};
+
+static const struct cell blank_cell = {
+    .bytes = {' '},
+    .nbytes = 1,
+    .width = 1,
+    .style = {.fg = COLOR_DEFAULT, .bg = COLOR_DEFAULT, .inverted = false},
 };
 
 struct winsize getsize(void) {
@@ -93,7 +213,81 @@ struct winsize getsize(void) {
   return ws;
 }
 
-struct display *display_create(void) {
+static void clear_cells(struct cell *cells, uint32_t ncells) {
+  for (uint32_t celli = 0; celli < ncells; ++celli) {
+    cells[celli] = blank_cell;
+  }
+}
+
+static void mark_all_dirty(struct display *display) {
+  for (uint32_t row = 0; row < display->grid_height; ++row) {
+    display->dirty_from[row] = 0;
+    display->dirty_to[row] = display->grid_width;
+  }
+}
+
+/* Make the grids match the size of the display. Returns true if they had to
+ * be recreated, which means that the contents of the terminal are unknown.
+ */
+static bool resize_grids(struct display *display) {
+  uint32_t width = display->width, height = display->height;
+  if (display->cells != NULL && display->grid_width == width &&
+      display->grid_height == height) {
+    return false;
+  }
+
+  free(display->cells);
+  free(display->prev_cells);
+  free(display->dirty_from);
+  free(display->dirty_to);
+  free(display->row_hashes);
+  free(display->prev_row_hashes);
+  free(display->row_counts);
+  display->cells = calloc((size_t)width * height + 1, sizeof(struct cell));
+  display->prev_cells = calloc((size_t)width * height + 1, sizeof(struct cell));
+  display->dirty_from = calloc(height + 1, sizeof(uint32_t));
+  display->dirty_to = calloc(height + 1, sizeof(uint32_t));
+  display->row_hashes = calloc(height + 1, sizeof(uint64_t));
+  display->prev_row_hashes = calloc(height + 1, sizeof(uint64_t));
+  display->row_counts = calloc(2 * (height + 1), sizeof(uint32_t));
+  display->grid_width = width;
+  display->grid_height = height;
+  clear_cells(display->cells, width * height);
+  clear_cells(display->prev_cells, width * height);
+  mark_all_dirty(display);
+  display->prev_row_hashes_valid = false;
+  return true;
+}
+
+static void format_sgr(struct sgr_fragment *fragment, const char *fmt,
+                       uint32_t n) {
+  fragment->len = snprintf(fragment->bytes, sizeof(fragment->bytes), fmt, n);
+}
+
+/* Format the SGR parameters for the default color (at index 256) and all
+ * indexed colors, so that style changes can copy them instead.
+ */
+static void format_color_fragments(struct display *display) {
+  for (uint32_t i = 0; i < 8; ++i) {
+    format_sgr(&display->fg_sgr[i], "%u", 30 + i);
+    format_sgr(&display->bg_sgr[i], "%u", 40 + i);
+  }
+
+  for (uint32_t i = 8; i < 16; ++i) {
+    format_sgr(&display->fg_sgr[i], "%u", 90 + i - 8);
+    format_sgr(&display->bg_sgr[i], "%u", 100 + i - 8);
+  }
+
+  for (uint32_t i = 16; i < 256; ++i) {
+    format_sgr(&display->fg_sgr[i], "38;5;%u", i);
+    format_sgr(&display->bg_sgr[i], "48;5;%u", i);
+  }
+
+  format_sgr(&display->fg_sgr[256], "%u", 39);
+  format_sgr(&display->bg_sgr[256], "%u", 49);
+}
+
+struct display *display_create(struct reactor *reactor) {
 
   struct winsize ws = getsize();
 
@@ -116,10 +310,20 @@ struct display *display_create(void) {
   d->term = term;
   d->height = ws.ws_row;
   d->width = ws.ws_col;
+  d->out_capacity = 4096;
+  d->out = malloc(d->out_capacity);
+  d->out_written = 0;
+  d->out_flags = fcntl(STDOUT_FILENO, F_GETFL);
+  d->reactor = reactor;
+  d->write_interest = -1;
+  d->frame_skipped = false;
+  format_color_fragments(d);
+  resize_grids(d);
   return d;
 }
 
 void display_resize(struct display *display) {
+  // called from a signal handler, the grids are resized on the next render
   struct winsize sz = getsize();
   display->width = sz.ws_col;
   display->height = sz.ws_row;
@@ -129,229 +333,586 @@ void display_destroy(struct display *display) {
   // reset old terminal mode
   tcsetattr(0, TCSADRAIN, &display->orig_term);
 
+  free(display->cells);
+  free(display->prev_cells);
+  free(display->dirty_from);
+  free(display->dirty_to);
+  free(display->row_hashes);
+  free(display->prev_row_hashes);
+  free(display->row_counts);
+  free(display->out);
   free(display);
 }
 
 uint32_t display_width(struct display *display) { return display->width; }
 uint32_t display_height(struct display *display) { return display->height; }
 
-void putch(uint8_t c) { putc(c, stdout); }
+static void put(struct display *display, const uint8_t *bytes, uint32_t len) {
+  if (display->nout + len > display->out_capacity) {
+    while (display->nout + len > display->out_capacity) {
+      display->out_capacity *= 2;
+    }
+    display->out = realloc(display->out, display->out_capacity);
+  }
 
-static void apply_fmt(uint8_t *fmt_stack, uint32_t fmt_stack_len) {
-  if (fmt_stack == NULL || fmt_stack_len == 0) {
-    return;
+  memcpy(display->out + display->nout, bytes, len);
+  display->nout += len;
+  display->nbytes += len;
+}
+
+/* Write as much of the collected output as the terminal takes without
+ * blocking. If some of it is left, the reactor is asked to wake the main loop
+ * when the terminal can take more. Returns true if everything was written.
+ */
+static bool write_output(struct display *display) {
+  if (display->out_written < display->nout) {
+    fcntl(STDOUT_FILENO, F_SETFL, display->out_flags | O_NONBLOCK);
+    while (display->out_written < display->nout) {
+      ssize_t res = write(STDOUT_FILENO, display->out + display->out_written,
+                          display->nout - display->out_written);
+      if (res < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+
+        // nothing sensible to do with the rest if the terminal is gone
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          display->out_written = display->nout;
+        }
+        break;
+      }
+
+      display->out_written += res;
+    }
+    fcntl(STDOUT_FILENO, F_SETFL, display->out_flags);
   }
 
-  for (uint32_t i = 0; i < fmt_stack_len; ++i) {
-    putc(fmt_stack[i], stdout);
+  bool done = display->out_written == display->nout;
+  if (done) {
+    display->nout = 0;
+    display->out_written = 0;
   }
-  putc('m', stdout);
+
+  if (!done && display->write_interest == (uint32_t)-1) {
+    display->write_interest = reactor_register_interest(
+        display->reactor, STDOUT_FILENO, WriteInterest);
+  } else if (done && display->write_interest != (uint32_t)-1) {
+    reactor_unregister_interest(display->reactor, display->write_interest);
+    display->write_interest = -1;
+  }
+
+  return done;
 }
 
-void putch_ws(uint8_t c, bool show_whitespace, uint8_t *fmt_stack,
-              uint32_t fmt_stack_len) {
-  // TODO: tab width needs to be sent here
-  if (show_whitespace && c == '\t') {
-    fputs("\x1b[90m →  \x1b[39m", stdout);
-    apply_fmt(fmt_stack, fmt_stack_len);
-  } else if (show_whitespace && c == ' ') {
-    fputs("\x1b[90m·\x1b[39m", stdout);
-    apply_fmt(fmt_stack, fmt_stack_len);
-  } else {
-    putch(c);
+/* Write all of the collected output, waiting for the terminal if needed. */
+static void flush_output(struct display *display) {
+  while (!write_output(display)) {
+    struct pollfd pfd = {.fd = STDOUT_FILENO, .events = POLLOUT};
+    poll(&pfd, 1, -1);
   }
 }
 
-void putbytes(uint8_t *line_bytes, uint32_t line_length, bool show_whitespace,
-              uint8_t *fmt_stack, uint32_t fmt_stack_len) {
-  for (uint32_t bytei = 0; bytei < line_length; ++bytei) {
-    putch_ws(line_bytes[bytei], show_whitespace, fmt_stack, fmt_stack_len);
+static void putstr(struct display *display, const char *str) {
+  put(display, (const uint8_t *)str, strlen(str));
+}
+
+static void put_ansiparm(struct display *display, uint32_t n) {
+  uint8_t buf[10];
+  uint32_t start = sizeof(buf);
+  do {
+    buf[--start] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0);
+
+  put(display, buf + start, sizeof(buf) - start);
+}
+
+static void put_cursor(struct display *display, uint32_t row, uint32_t col) {
+  uint8_t csi[] = {ESC, '['};
+  put(display, csi, 2);
+  put_ansiparm(display, row + 1);
+  putstr(display, ";");
+  put_ansiparm(display, col + 1);
+  putstr(display, "H");
+}
+
+/* Write one SGR parameter, separated from the previous one if needed. */
+static void put_sgrparm(struct display *display, uint32_t n, bool *first) {
+  if (!*first) {
+    putstr(display, ";");
   }
+
+  put_ansiparm(display, n);
+  *first = false;
 }
 
-void put_ansiparm(int n) {
-  int q = n / 10;
-  if (q != 0) {
-    int r = q / 10;
-    if (r != 0) {
-      putc((r % 10) + '0', stdout);
+static void put_color(struct display *display, uint32_t color, bool bg,
+                      bool *first) {
+  uint32_t value = color & 0xffffff;
+  switch (COLOR_KIND(color)) {
+  case COLOR_DEFAULT:
+  case COLOR_INDEXED: {
+    uint32_t i = COLOR_KIND(color) == COLOR_DEFAULT ? 256 : value & 0xff;
+    const struct sgr_fragment *fragment =
+        bg ? &display->bg_sgr[i] : &display->fg_sgr[i];
+    if (!*first) {
+      putstr(display, ";");
     }
-    putc((q % 10) + '0', stdout);
+    put(display, (const uint8_t *)fragment->bytes, fragment->len);
+    *first = false;
+    break;
+  }
+  case COLOR_RGB:
+    put_sgrparm(display, bg ? 48 : 38, first);
+    put_sgrparm(display, 2, first);
+    put_sgrparm(display, value >> 16, first);
+    put_sgrparm(display, (value >> 8) & 0xff, first);
+    put_sgrparm(display, value & 0xff, first);
+    break;
   }
-  putc((n % 10) + '0', stdout);
 }
 
-void display_move_cursor(struct display *display, uint32_t row, uint32_t col) {
-  (void)display;
+/* Write the SGR sequence that changes the terminal's style from `from` to
+ * `to`, containing only the attributes that differ. When attributes are
+ * turned off and nothing is kept, a reset is shorter than turning them off
+ * one by one.
+ */
+static void put_style(struct display *display, const struct cell_style *from,
+                      const struct cell_style *to) {
+  uint8_t csi[] = {ESC, '['};
+  put(display, csi, 2);
+
+  bool turns_off = (from->fg != COLOR_DEFAULT && to->fg == COLOR_DEFAULT) ||
+                   (from->bg != COLOR_DEFAULT && to->bg == COLOR_DEFAULT) ||
+                   (from->inverted && !to->inverted);
+  bool keeps = (to->fg != COLOR_DEFAULT && to->fg == from->fg) ||
+               (to->bg != COLOR_DEFAULT && to->bg == from->bg) ||
+               (to->inverted && from->inverted);
+
+  bool first = true;
+  if (turns_off && !keeps) {
+    put_sgrparm(display, 0, &first);
+    from = &default_style;
+  }
+  if (to->fg != from->fg) {
+    put_color(display, to->fg, false, &first);
+  }
+
+  if (to->bg != from->bg) {
+    put_color(display, to->bg, true, &first);
+  }
+
+  if (to->inverted != from->inverted) {
+    put_sgrparm(display, to->inverted ? 7 : 27, &first);
+  }
+
+  putstr(display, "m");
+}
+
+static bool styles_eq(const struct cell_style *a, const struct cell_style *b) {
+  return a->fg == b->fg && a->bg == b->bg && a->inverted == b->inverted;
+}
 
-  putc(ESC, stdout);
-  putc('[', stdout);
-  put_ansiparm(row + 1);
-  putc(';', stdout);
-  put_ansiparm(col + 1);
-  putc('H', stdout);
+static bool cells_eq(const struct cell *a, const struct cell *b) {
+  return a->nbytes == b->nbytes && a->width == b->width &&
+         styles_eq(&a->style, &b->style) &&
+         memcmp(a->bytes, b->bytes, a->nbytes) == 0;
+}
+
+void display_move_cursor(struct display *display, uint32_t row, uint32_t col) {
+  display->cursor_row = row;
+  display->cursor_col = col;
 }
 
 void display_clear(struct display *display) {
-  display_move_cursor(display, 0, 0);
-  putc(ESC, stdout);
-  putc('[', stdout);
-  putc('J', stdout);
+  uint8_t clear[] = {ESC, '[', '0', 'm', ESC, '[', 'H', ESC, '[', 'J'};
+  put(display, clear, sizeof(clear));
+  flush_output(display);
+
+  // the terminal is blank now
+  clear_cells(display->prev_cells,
+              display->grid_width * display->grid_height);
+  mark_all_dirty(display);
+  display->prev_row_hashes_valid = false;
 }
 
-struct command_list *command_list_create(uint32_t initial_capacity,
+struct command_list *command_list_create(uint32_t capacity,
                                          void *(*allocator)(size_t),
                                          uint32_t xoffset, uint32_t yoffset,
                                          const char *name) {
   struct command_list *command_list = allocator(sizeof(struct command_list));
 
-  command_list->capacity = initial_capacity;
-  command_list->ncmds = 0;
+  command_list->data = allocator(capacity);
+  command_list->size = 0;
+  command_list->capacity = capacity;
   command_list->xoffset = xoffset;
   command_list->yoffset = yoffset;
+  command_list->allocator = allocator;
+  command_list->clip_width = UINT32_MAX;
+  command_list->clip_height = UINT32_MAX;
   command_list->next_list = NULL;
+  command_list->last_list = command_list;
   strncpy(command_list->name, name, 15);
 
-  command_list->cmds =
-      allocator(sizeof(struct render_command) * initial_capacity);
-  command_list->allocator = allocator;
-
   return command_list;
 }
 
-struct render_command *add_command(struct command_list *list,
-                                   enum render_cmd_type tp) {
-  struct command_list *l = list;
-  struct command_list *n = l->next_list;
-
-  // scan through lists for one with capacity
-  while (l->ncmds == l->capacity && n != NULL) {
-    l = n;
-    n = l->next_list;
-  }
-
-  if (l->ncmds == l->capacity && n == NULL) {
-    l->next_list = command_list_create(l->capacity, l->allocator, l->xoffset,
-                                       l->yoffset, l->name);
-    l = l->next_list;
+/* Add a command with a payload of `len` bytes and `extra` bytes after it.
+ * Returns a pointer to where the extra bytes go.
+ */
+static uint8_t *add_command(struct command_list *list, enum render_cmd_type tp,
+                            const void *payload, uint32_t len, uint32_t extra) {
+  uint32_t nbytes = 1 + len + extra;
+  struct command_list *l = list->last_list;
+  if (l->size + nbytes > l->capacity) {
+    // commands are never split between lists
+    uint32_t capacity = l->capacity * 2;
+    l->next_list =
+        command_list_create(capacity > nbytes ? capacity : nbytes, l->allocator,
+                            l->xoffset, l->yoffset, l->name);
+    l = list->last_list = l->next_list;
   }
 
-  struct render_command *cmd = &l->cmds[l->ncmds];
-  cmd->type = tp;
-  switch (tp) {
-  case RenderCommand_DrawText:
-    cmd->data.draw_txt = l->allocator(sizeof(struct draw_text_cmd));
-    break;
-  case RenderCommand_Repeat:
-    cmd->data.repeat = l->allocator(sizeof(struct repeat_cmd));
-    break;
-  case RenderCommand_PushFormat:
-    cmd->data.push_fmt = l->allocator(sizeof(struct push_fmt_cmd));
-    break;
-  case RenderCommand_SetShowWhitespace:
-    cmd->data.show_ws = l->allocator(sizeof(struct show_ws_cmd));
-    break;
-  case RenderCommand_ClearFormat:
-    break;
-  case RenderCommand_DrawList:
-    cmd->data.draw_list = l->allocator(sizeof(struct draw_list_cmd));
-    break;
-  default:
-    assert(false);
+  uint8_t *dst = l->data + l->size;
+  dst[0] = tp;
+  if (len > 0) {
+    memcpy(dst + 1, payload, len);
   }
-
-  ++l->ncmds;
-  return cmd;
+  l->size += nbytes;
+  return dst + 1 + len;
 }
 
 void command_list_draw_text(struct command_list *list, uint32_t col,
                             uint32_t row, uint8_t *data, uint32_t len) {
-  struct draw_text_cmd *cmd =
-      add_command(list, RenderCommand_DrawText)->data.draw_txt;
-  cmd->data = data;
-  cmd->col = col;
-  cmd->row = row;
-  cmd->len = len;
+  struct draw_text_cmd cmd = {
+      .col = col,
+      .row = row,
+      .data = data,
+      .len = len,
+  };
+  add_command(list, RenderCommand_DrawText, &cmd, sizeof(cmd), 0);
 }
 
 void command_list_draw_text_copy(struct command_list *list, uint32_t col,
                                  uint32_t row, uint8_t *data, uint32_t len) {
-  uint8_t *bytes = (uint8_t *)list->allocator(len);
+  struct draw_text_inline_cmd cmd = {
+      .col = col,
+      .row = row,
+      .len = len,
+  };
+  uint8_t *bytes = add_command(list, RenderCommand_DrawTextInline, &cmd,
+                               sizeof(cmd), len);
   memcpy(bytes, data, len);
-
-  command_list_draw_text(list, col, row, bytes, len);
 }
 
 void command_list_draw_repeated(struct command_list *list, uint32_t col,
                                 uint32_t row, uint32_t c, uint32_t nrepeat) {
-  struct repeat_cmd *cmd = add_command(list, RenderCommand_Repeat)->data.repeat;
-  cmd->col = col;
-  cmd->row = row;
-  cmd->c = c;
-  cmd->nrepeat = nrepeat;
+  struct repeat_cmd cmd = {
+      .col = col,
+      .row = row,
+      .c = c,
+      .nrepeat = nrepeat,
+  };
+  add_command(list, RenderCommand_Repeat, &cmd, sizeof(cmd), 0);
 }
 
 void command_list_draw_command_list(struct command_list *list,
                                     struct command_list *to_draw) {
-  struct draw_list_cmd *cmd =
-      add_command(list, RenderCommand_DrawList)->data.draw_list;
-  cmd->list = to_draw;
+  struct draw_list_cmd cmd = {.list = to_draw};
+  add_command(list, RenderCommand_DrawList, &cmd, sizeof(cmd), 0);
+}
+
+static void push_format(struct command_list *list, enum fmt_attr attr,
+                        uint32_t color) {
+  struct push_fmt_cmd cmd = {.attr = attr, .color = color};
+  add_command(list, RenderCommand_PushFormat, &cmd, sizeof(cmd), 0);
 }
 
 void command_list_set_index_color_fg(struct command_list *list,
                                      uint8_t color_idx) {
-  struct push_fmt_cmd *cmd =
-      add_command(list, RenderCommand_PushFormat)->data.push_fmt;
-
-  if (color_idx < 8) {
-    cmd->len = snprintf((char *)cmd->fmt, 64, "%d", 30 + color_idx);
-  } else if (color_idx < 16) {
-    cmd->len = snprintf((char *)cmd->fmt, 64, "%d", 90 + color_idx - 8);
-  } else {
-    cmd->len = snprintf((char *)cmd->fmt, 64, "38;5;%d", color_idx);
-  }
+  push_format(list, Fmt_Fg, COLOR_INDEXED | color_idx);
 }
 
 void command_list_set_color_fg(struct command_list *list, uint8_t red,
                                uint8_t green, uint8_t blue) {
-  struct push_fmt_cmd *cmd =
-      add_command(list, RenderCommand_PushFormat)->data.push_fmt;
-  cmd->len = snprintf((char *)cmd->fmt, 64, "38;2;%d;%d;%d", red, green, blue);
+  push_format(list, Fmt_Fg, COLOR_RGB | red << 16 | green << 8 | blue);
 }
 
 void command_list_set_index_color_bg(struct command_list *list,
                                      uint8_t color_idx) {
-  struct push_fmt_cmd *cmd =
-      add_command(list, RenderCommand_PushFormat)->data.push_fmt;
-  if (color_idx < 8) {
-    cmd->len = snprintf((char *)cmd->fmt, 64, "%d", 40 + color_idx);
-  } else if (color_idx < 16) {
-    cmd->len = snprintf((char *)cmd->fmt, 64, "%d", 100 + color_idx - 8);
-  } else {
-    cmd->len = snprintf((char *)cmd->fmt, 64, "48;5;%d", color_idx);
-  }
+  push_format(list, Fmt_Bg, COLOR_INDEXED | color_idx);
 }
 
 void command_list_set_color_bg(struct command_list *list, uint8_t red,
                                uint8_t green, uint8_t blue) {
-  struct push_fmt_cmd *cmd =
-      add_command(list, RenderCommand_PushFormat)->data.push_fmt;
-  cmd->len = snprintf((char *)cmd->fmt, 64, "48;2;%d;%d;%d", red, green, blue);
+  push_format(list, Fmt_Bg, COLOR_RGB | red << 16 | green << 8 | blue);
 }
 
 void command_list_set_inverted_colors(struct command_list *list) {
-  struct push_fmt_cmd *cmd =
-      add_command(list, RenderCommand_PushFormat)->data.push_fmt;
-  cmd->fmt[0] = '7';
-  cmd->len = 1;
+  push_format(list, Fmt_Inverted, 0);
 }
 
 void command_list_reset_color(struct command_list *list) {
-  add_command(list, RenderCommand_ClearFormat);
+  add_command(list, RenderCommand_ClearFormat, NULL, 0, 0);
 }
 
 void command_list_set_show_whitespace(struct command_list *list, bool show) {
-  add_command(list, RenderCommand_SetShowWhitespace)->data.show_ws->show = show;
+  struct show_ws_cmd cmd = {.show = show};
+  add_command(list, RenderCommand_SetShowWhitespace, &cmd, sizeof(cmd), 0);
+}
+
+void command_list_set_tab_width(struct command_list *list, uint32_t width) {
+  struct tab_width_cmd cmd = {.width = width};
+  add_command(list, RenderCommand_SetTabWidth, &cmd, sizeof(cmd), 0);
+}
+
+void command_list_clear(struct command_list *list, uint32_t col, uint32_t row,
+                        uint32_t width, uint32_t height) {
+  struct clear_cmd cmd = {
+      .col = col,
+      .row = row,
+      .width = width,
+      .height = height,
+  };
+  add_command(list, RenderCommand_Clear, &cmd, sizeof(cmd), 0);
+}
+
+void command_list_set_clip(struct command_list *list, uint32_t width,
+                           uint32_t height) {
+  list->clip_width = width;
+  list->clip_height = height;
+}
+
+/* Rasterization
+ *
+ * Command lists are drawn into a grid of cells instead of straight to the
+ * terminal. The grid keeps its contents between frames, so that the parts of
+ * the screen that did not change do not have to be drawn again. At the end of
+ * the frame the parts of the grid that were drawn are compared to what the
+ * terminal is showing, and only the cells that changed are written.
+ */
+struct clip_rect {
+  uint32_t left;
+  uint32_t top;
+  uint32_t right;
+  uint32_t bottom;
+};
+
+struct raster_state {
+  struct cell_style style;
+  bool show_whitespace;
+  uint32_t tab_width;
+};
+
+static struct cell *cell_at(struct display *display, uint32_t row,
+                            uint32_t col) {
+  return &display->cells[row * display->grid_width + col];
+}
+
+static void mark_dirty(struct display *display, uint32_t row, uint32_t from,
+                       uint32_t to) {
+  if (from < display->dirty_from[row]) {
+    display->dirty_from[row] = from;
+  }
+  if (to > display->dirty_to[row]) {
+    display->dirty_to[row] = to;
+  }
+}
+
+/* Put a cell in the grid, making sure that no half of a wide character is
+ * left behind where it is overwritten.
+ */
+static void set_cell(struct display *display, uint32_t row, uint32_t col,
+                     const uint8_t *bytes, uint32_t nbytes, uint32_t width,
+                     const struct cell_style *style) {
+  if (row < display->clip_top || row >= display->clip_bottom ||
+      col < display->clip_left || col >= display->clip_right) {
+    return;
+  }
+
+  // wide characters that do not fit are replaced by spaces
+  if (col + width > display->clip_right) {
+    for (; col < display->clip_right; ++col) {
+      set_cell(display, row, col, (uint8_t *)" ", 1, 1, style);
+    }
+    return;
+  }
+
+  // the halves of wide characters on either side can be cleared as well
+  mark_dirty(display, row, col > 0 ? col - 1 : 0,
+             col + 3 < display->grid_width ? col + 3 : display->grid_width);
+
+  struct cell *c = cell_at(display, row, col);
+  if (c->width == 0 && col > 0) {
+    *cell_at(display, row, col - 1) = blank_cell;
+  }
+  if (c->width == 2 && width < 2) {
+    *cell_at(display, row, col + 1) = blank_cell;
+  }
+
+  memcpy(c->bytes, bytes, nbytes);
+  c->nbytes = nbytes;
+  c->width = width;
+  c->style = *style;
+
+  if (width == 2) {
+    struct cell *rest = cell_at(display, row, col + 1);
+    if (rest->width == 2 && col + 2 < display->grid_width) {
+      *cell_at(display, row, col + 2) = blank_cell;
+    }
+    *rest = (struct cell){.nbytes = 0, .width = 0, .style = *style};
+  }
+}
+
+/* Draw a codepoint at a column, returning the number of columns it took. */
+static uint32_t draw_codepoint(struct display *display, uint32_t row,
+                               uint32_t col, const uint8_t *bytes,
+                               const struct codepoint *codepoint,
+                               const struct raster_state *state) {
+  struct cell_style ws_style = state->style;
+  ws_style.fg = COLOR_INDEXED | Color_BrightBlack;
+
+  uint32_t cp = codepoint->codepoint;
+  if (cp == '\t') {
+    // shown as " →  ", padded to the tab width
+    const struct cell_style *style =
+        state->show_whitespace ? &ws_style : &state->style;
+    for (uint32_t i = 0; i < state->tab_width; ++i) {
+      if (state->show_whitespace && i == (state->tab_width > 1 ? 1 : 0)) {
+        set_cell(display, row, col + i, (uint8_t *)"→", 3, 1, style);
+      } else {
+        set_cell(display, row, col + i, (uint8_t *)" ", 1, 1, style);
+      }
+    }
+    return state->tab_width;
+  } else if (cp == ' ' && state->show_whitespace) {
+    set_cell(display, row, col, (uint8_t *)"·", 2, 1, &ws_style);
+    return 1;
+  }
+
+  uint32_t width = unicode_visual_char_width(codepoint);
+  if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) {
+    // control characters would mess up the terminal, show them as ^X
+    uint8_t caret[2] = {'^', cp < 0x80 ? cp ^ 0x40 : '?'};
+    set_cell(display, row, col, caret, 1, 1, &state->style);
+    set_cell(display, row, col + 1, caret + 1, 1, 1, &state->style);
+    return 2;
+  } else if (width == 0) {
+    // combining characters go with the character before them
+    if (col > display->clip_left && row >= display->clip_top &&
+        row < display->clip_bottom && col <= display->clip_right) {
+      uint32_t basecol = col - 1;
+      if (cell_at(display, row, basecol)->width == 0 &&
+          basecol > display->clip_left) {
+        --basecol;
+      }
+      struct cell *c = cell_at(display, row, basecol);
+      mark_dirty(display, row, basecol, basecol + 1);
+      if (c->nbytes + codepoint->nbytes <= CELL_BYTES) {
+        memcpy(c->bytes + c->nbytes, bytes, codepoint->nbytes);
+        c->nbytes += codepoint->nbytes;
+      }
+    }
+    return 0;
+  } else if (cp == 0xfffd && codepoint->nbytes != 3) {
+    // invalid utf-8
+    set_cell(display, row, col, (uint8_t *)"\xef\xbf\xbd", 3, width,
+             &state->style);
+    return width;
+  }
+
+  set_cell(display, row, col, bytes, codepoint->nbytes, width, &state->style);
+  return width;
+}
+
+static void draw_bytes(struct display *display, uint32_t row, uint32_t col,
+                       uint8_t *bytes, uint32_t nbytes,
+                       const struct raster_state *state) {
+  struct utf8_codepoint_iterator iter =
+      create_utf8_codepoint_iterator(bytes, nbytes, 0);
+  struct codepoint *codepoint;
+  uint32_t offset = 0;
+  while ((codepoint = utf8_next_codepoint(&iter)) != NULL &&
+         col < display->clip_right) {
+    col += draw_codepoint(display, row, col, bytes + offset, codepoint, state);
+    offset += codepoint->nbytes;
+  }
+}
+
+static void apply_format(struct cell_style *style,
+                         const struct push_fmt_cmd *cmd) {
+  switch (cmd->attr) {
+  case Fmt_Fg:
+    style->fg = cmd->color;
+    break;
+  case Fmt_Bg:
+    style->bg = cmd->color;
+    break;
+  case Fmt_Inverted:
+    style->inverted = true;
+    break;
+  }
+}
+
+static void clear_rect(struct display *display, uint32_t row, uint32_t col,
+                       uint32_t width, uint32_t height) {
+  uint32_t from = col > display->clip_left ? col : display->clip_left;
+  uint32_t to = col + width < display->clip_right ? col + width
+                                                   : display->clip_right;
+  uint32_t bottom = row + height < display->clip_bottom ? row + height
+                                                         : display->clip_bottom;
+  if (from >= to) {
+    return;
+  }
+
+  for (row = row > display->clip_top ? row : display->clip_top; row < bottom;
+       ++row) {
+    // do not leave any halves of wide characters behind at the edges
+    uint32_t dirty_from = from, dirty_to = to;
+    if (from > 0 && cell_at(display, row, from)->width == 0) {
+      *cell_at(display, row, --dirty_from) = blank_cell;
+    }
+    if (to < display->grid_width && cell_at(display, row, to)->width == 0) {
+      *cell_at(display, row, dirty_to++) = blank_cell;
+    }
+
+    clear_cells(cell_at(display, row, from), to - from);
+    mark_dirty(display, row, dirty_from, dirty_to);
+  }
+}
+
+/* Limit drawing to the clip rectangle of a command list, within the current
+ * one. Returns the current clip rectangle to put back afterwards.
+ */
+static struct clip_rect push_clip(struct display *display,
+                                  const struct command_list *cl) {
+  struct clip_rect prev = {
+      .left = display->clip_left,
+      .top = display->clip_top,
+      .right = display->clip_right,
+      .bottom = display->clip_bottom,
+  };
+
+  uint64_t right = (uint64_t)cl->xoffset + cl->clip_width;
+  uint64_t bottom = (uint64_t)cl->yoffset + cl->clip_height;
+  display->clip_left = cl->xoffset > prev.left ? cl->xoffset : prev.left;
+  display->clip_top = cl->yoffset > prev.top ? cl->yoffset : prev.top;
+  display->clip_right = right < prev.right ? right : prev.right;
+  display->clip_bottom = bottom < prev.bottom ? bottom : prev.bottom;
+  return prev;
+}
+
+static void pop_clip(struct display *display, const struct clip_rect *clip) {
+  display->clip_left = clip->left;
+  display->clip_top = clip->top;
+  display->clip_right = clip->right;
+  display->clip_bottom = clip->bottom;
+}
+
+/* Copy out a command struct, which is not necessarily aligned in the list. */
+static uint8_t *read_command(uint8_t *cmds, void *cmd, uint32_t len) {
+  memcpy(cmd, cmds, len);
+  return cmds + len;
 }
 
 void display_render(struct display *display,
@@ -362,100 +923,471 @@ void display_render(struct display *display,
   snprintf(name, 31, "display.cl.%s", cl->name);
   struct timer *render_timer = timer_start(name);
 
-  uint8_t fmt_stack[256] = {0};
-  fmt_stack[0] = ESC;
-  fmt_stack[1] = '[';
-  fmt_stack[2] = '0';
-  uint32_t fmt_stack_len = 3;
-  bool show_whitespace_state = false;
+  struct raster_state state = {
+      .style = default_style,
+      .show_whitespace = false,
+      .tab_width = 4,
+  };
 
+  // lists that commands overflowed into are limited by the first one
+  struct clip_rect clip = push_clip(display, command_list);
   while (cl != NULL) {
-
-    for (uint64_t cmdi = 0; cmdi < cl->ncmds; ++cmdi) {
-      struct render_command *cmd = &cl->cmds[cmdi];
-      switch (cmd->type) {
+    uint8_t *cmds = cl->data, *end = cl->data + cl->size;
+    while (cmds < end) {
+      enum render_cmd_type type = *cmds++;
+      switch (type) {
       case RenderCommand_DrawText: {
-        struct draw_text_cmd *txt_cmd = cmd->data.draw_txt;
-        display_move_cursor(display, txt_cmd->row + cl->yoffset,
-                            txt_cmd->col + cl->xoffset);
-        apply_fmt(fmt_stack, fmt_stack_len);
-        putbytes(txt_cmd->data, txt_cmd->len, show_whitespace_state, fmt_stack,
-                 fmt_stack_len);
+        struct draw_text_cmd txt_cmd;
+        cmds = read_command(cmds, &txt_cmd, sizeof(txt_cmd));
+        draw_bytes(display, txt_cmd.row + cl->yoffset,
+                   txt_cmd.col + cl->xoffset, txt_cmd.data, txt_cmd.len,
+                   &state);
+        break;
+      }
+
+      case RenderCommand_DrawTextInline: {
+        struct draw_text_inline_cmd txt_cmd;
+        cmds = read_command(cmds, &txt_cmd, sizeof(txt_cmd));
+        draw_bytes(display, txt_cmd.row + cl->yoffset,
+                   txt_cmd.col + cl->xoffset, cmds, txt_cmd.len, &state);
+        cmds += txt_cmd.len;
         break;
       }
 
       case RenderCommand_Repeat: {
-        struct repeat_cmd *repeat_cmd = cmd->data.repeat;
-        display_move_cursor(display, repeat_cmd->row + cl->yoffset,
-                            repeat_cmd->col + cl->xoffset);
-        apply_fmt(fmt_stack, fmt_stack_len);
+        struct repeat_cmd repeat_cmd;
+        cmds = read_command(cmds, &repeat_cmd, sizeof(repeat_cmd));
+        uint32_t row = repeat_cmd.row + cl->yoffset;
+        uint32_t col = repeat_cmd.col + cl->xoffset;
         struct utf8_codepoint_iterator iter =
-            create_utf8_codepoint_iterator((uint8_t *)&repeat_cmd->c, 4, 0);
+            create_utf8_codepoint_iterator((uint8_t *)&repeat_cmd.c, 4, 0);
         struct codepoint *codepoint = utf8_next_codepoint(&iter);
         if (codepoint != NULL) {
-          for (uint32_t i = 0; i < repeat_cmd->nrepeat; ++i) {
-            putbytes((uint8_t *)&repeat_cmd->c, codepoint->nbytes,
-                     show_whitespace_state, fmt_stack, fmt_stack_len);
+          for (uint32_t i = 0;
+               i < repeat_cmd.nrepeat && col < display->clip_right; ++i) {
+            col += draw_codepoint(display, row, col, (uint8_t *)&repeat_cmd.c,
+                                  codepoint, &state);
           }
         }
         break;
       }
 
       case RenderCommand_PushFormat: {
-        struct push_fmt_cmd *fmt_cmd = cmd->data.push_fmt;
+        struct push_fmt_cmd fmt_cmd;
+        cmds = read_command(cmds, &fmt_cmd, sizeof(fmt_cmd));
+        apply_format(&state.style, &fmt_cmd);
+        break;
+      }
 
-        fmt_stack[fmt_stack_len] = ';';
-        ++fmt_stack_len;
+      case RenderCommand_ClearFormat:
+        state.style = default_style;
+        break;
 
-        memcpy(fmt_stack + fmt_stack_len, fmt_cmd->fmt, fmt_cmd->len);
-        fmt_stack_len += fmt_cmd->len;
+      case RenderCommand_SetShowWhitespace: {
+        struct show_ws_cmd ws_cmd;
+        cmds = read_command(cmds, &ws_cmd, sizeof(ws_cmd));
+        state.show_whitespace = ws_cmd.show;
         break;
       }
 
-      case RenderCommand_ClearFormat:
-        fmt_stack_len = 3;
+      case RenderCommand_SetTabWidth: {
+        struct tab_width_cmd tab_cmd;
+        cmds = read_command(cmds, &tab_cmd, sizeof(tab_cmd));
+        state.tab_width = tab_cmd.width;
         break;
+      }
 
-      case RenderCommand_SetShowWhitespace:
-        show_whitespace_state = cmd->data.show_ws->show;
+      case RenderCommand_Clear: {
+        struct clear_cmd clear_cmd;
+        cmds = read_command(cmds, &clear_cmd, sizeof(clear_cmd));
+        clear_rect(display, clear_cmd.row + cl->yoffset,
+                   clear_cmd.col + cl->xoffset, clear_cmd.width,
+                   clear_cmd.height);
         break;
+      }
 
-      case RenderCommand_DrawList:
-        display_render(display, cmd->data.draw_list->list);
+      case RenderCommand_DrawList: {
+        struct draw_list_cmd list_cmd;
+        cmds = read_command(cmds, &list_cmd, sizeof(list_cmd));
+        display_render(display, list_cmd.list);
         break;
       }
+      }
     }
     cl = cl->next_list;
   }
+  pop_clip(display, &clip);
 
   timer_stop(render_timer);
 }
 
-void hide_cursor(void) {
-  putc(ESC, stdout);
-  putc('[', stdout);
-  putc('?', stdout);
-  putc('2', stdout);
-  putc('5', stdout);
-  putc('l', stdout);
+static void hide_cursor(struct display *display) {
+  uint8_t seq[] = {ESC, '[', '?', '2', '5', 'l'};
+  put(display, seq, sizeof(seq));
 }
 
-void show_cursor(void) {
-  putc(ESC, stdout);
-  putc('[', stdout);
-  putc('?', stdout);
-  putc('2', stdout);
-  putc('5', stdout);
-  putc('h', stdout);
+static void show_cursor(struct display *display) {
+  uint8_t seq[] = {ESC, '[', '?', '2', '5', 'h'};
+  put(display, seq, sizeof(seq));
 }
 
 void display_begin_render(struct display *display) {
-  (void)display;
-  hide_cursor();
+  display->nbytes = 0;
+
+  // the old contents are gone when the size changes, start over
+  if (resize_grids(display)) {
+    uint8_t clear[] = {ESC, '[', '0', 'm', ESC, '[', '2', 'J'};
+    put(display, clear, sizeof(clear));
+  }
+
+  display->clip_left = 0;
+  display->clip_top = 0;
+  display->clip_right = display->grid_width;
+  display->clip_bottom = display->grid_height;
 }
+
+/* Scrolling
+ *
+ * When a window scrolls, many rows of the new frame are rows of the previous
+ * frame moved up or down. Instead of drawing them again, the terminal is told
+ * to scroll that part of the screen (DECSTBM to set the region, then SU or
+ * SD), and the previous grid is shifted the same way, so that only the rows
+ * that scrolled into view differ. Scroll regions always span the full width
+ * of the terminal, so this only works when whole rows moved.
+ */
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME 1099511628211ull
+
+static uint64_t hash_cell(uint64_t hash, const struct cell *c) {
+  // FNV-1a, but a word at a time since this is done for every cell on every
+  // frame, the first word holds all of the CELL_BYTES (8) bytes
+  uint64_t bytes;
+  memcpy(&bytes, c->bytes, sizeof(bytes));
+  if (c->nbytes < sizeof(bytes)) {
+    bytes &= (1ull << (8 * c->nbytes)) - 1;
+  }
+
+  uint64_t attrs = ((uint64_t)c->style.fg << 32 | c->style.bg) ^
+                   ((uint64_t)c->nbytes << 16 | (uint64_t)c->width << 8 |
+                    c->style.inverted);
+
+  hash = (hash ^ bytes) * FNV_PRIME;
+  return (hash ^ attrs) * FNV_PRIME;
+}
+
+static uint64_t hash_row(const struct cell *cells, uint32_t width) {
+  uint64_t hash = FNV_OFFSET;
+  for (uint32_t col = 0; col < width; ++col) {
+    hash = hash_cell(hash, &cells[col]);
+  }
+  return hash;
+}
+
+struct scroll {
+  // rows top to bottom (inclusive) move up by shift rows, or down if negative
+  uint32_t top;
+  uint32_t bottom;
+  int32_t shift;
+
+  // number of rows that match the new frame after scrolling, minus before
+  int32_t gain;
+};
+
+/* Find the scroll that makes the most rows of the previous grid match the new
+ * one, given the hashes of all rows.
+ */
+static struct scroll find_scroll(struct display *display,
+                                 uint64_t blank_hash) {
+  const uint64_t *hashes = display->row_hashes;
+  const uint64_t *prev_hashes = display->prev_row_hashes;
+  uint32_t height = display->grid_height;
+
+  // running counts of rows that already match, and of blank rows
+  uint32_t *matching = display->row_counts;
+  uint32_t *blank = display->row_counts + height + 1;
+  matching[0] = blank[0] = 0;
+  for (uint32_t row = 0; row < height; ++row) {
+    matching[row + 1] = matching[row] + (hashes[row] == prev_hashes[row]);
+    blank[row + 1] = blank[row] + (hashes[row] == blank_hash);
+  }
+
+  struct scroll best = {.gain = 0};
+  for (int32_t shift = 1 - (int32_t)height; shift < (int32_t)height;
+       ++shift) {
+    if (shift == 0) {
+      continue;
+    }
+
+    // new row r shows what was on row r + shift
+    uint32_t first = shift < 0 ? -shift : 0;
+    uint32_t last = shift > 0 ? height - shift : height;
+    for (uint32_t row = first; row < last;) {
+      if (hashes[row] != prev_hashes[row + shift]) {
+        ++row;
+        continue;
+      }
+
+      uint32_t start = row;
+      while (row < last && hashes[row] == prev_hashes[row + shift]) {
+        ++row;
+      }
+
+      // rows start to row move, the rest of the region scrolls into view
+      uint32_t top, bottom, exposed;
+      if (shift > 0) {
+        top = start;
+        bottom = row + shift - 1;
+        exposed = blank[row + shift] - blank[row];
+      } else {
+        top = start + shift;
+        bottom = row - 1;
+        exposed = blank[start] - blank[start + shift];
+      }
+
+      int32_t gain = (int32_t)(row - start + exposed) -
+                     (int32_t)(matching[bottom + 1] - matching[top]);
+      if (gain > best.gain) {
+        best = (struct scroll){
+            .top = top,
+            .bottom = bottom,
+            .shift = shift,
+            .gain = gain,
+        };
+      }
+    }
+  }
+
+  return best;
+}
+
+static uint32_t count_changed_cells(const struct cell *a, const struct cell *b,
+                                    uint32_t ncells) {
+  uint32_t changed = 0;
+  for (uint32_t celli = 0; celli < ncells; ++celli) {
+    changed += !cells_eq(&a[celli], &b[celli]);
+  }
+  return changed;
+}
+
+/* Rows that match completely are only an estimate: a row that was almost
+ * right before scrolling might be cheaper to fix up than the rows scrolled
+ * into view are to draw. Compare the number of cells to write with and
+ * without scrolling, counting the escape sequences for it as some cells.
+ */
+static bool scroll_pays_off(struct display *display,
+                            const struct scroll *scroll) {
+  uint32_t width = display->grid_width;
+  uint32_t n = scroll->shift > 0 ? scroll->shift : -scroll->shift;
+
+  uint32_t before = 0, after = 16;
+  for (uint32_t row = scroll->top; row <= scroll->bottom; ++row) {
+    const struct cell *cells = &display->cells[row * width];
+    before += count_changed_cells(cells, &display->prev_cells[row * width],
+                                  width);
+
+    bool exposed = scroll->shift > 0 ? row > scroll->bottom - n
+                                     : row < scroll->top + n;
+    if (exposed) {
+      for (uint32_t col = 0; col < width; ++col) {
+        after += !cells_eq(&cells[col], &blank_cell);
+      }
+    } else {
+      after += count_changed_cells(
+          cells, &display->prev_cells[(row + scroll->shift) * width], width);
+    }
+  }
+
+  return after < before;
+}
+
+static void apply_scroll(struct display *display, const struct scroll *scroll,
+                         uint64_t blank_hash) {
+  uint32_t width = display->grid_width;
+  uint32_t nrows = scroll->bottom - scroll->top + 1;
+  uint32_t n = scroll->shift > 0 ? scroll->shift : -scroll->shift;
+
+  uint8_t csi[] = {ESC, '['};
+  put(display, csi, 2);
+  put_ansiparm(display, scroll->top + 1);
+  putstr(display, ";");
+  put_ansiparm(display, scroll->bottom + 1);
+  putstr(display, "r");
+  put(display, csi, 2);
+  put_ansiparm(display, n);
+  putstr(display, scroll->shift > 0 ? "S" : "T");
+  put(display, csi, 2);
+  putstr(display, "r");
+
+  // do the same to what the terminal is showing
+  struct cell *region = &display->prev_cells[scroll->top * width];
+  uint64_t *hashes = &display->prev_row_hashes[scroll->top];
+  uint32_t blank_from = 0;
+  if (scroll->shift > 0) {
+    memmove(region, region + n * width,
+            sizeof(struct cell) * (nrows - n) * width);
+    memmove(hashes, hashes + n, sizeof(uint64_t) * (nrows - n));
+    blank_from = nrows - n;
+  } else {
+    memmove(region + n * width, region,
+            sizeof(struct cell) * (nrows - n) * width);
+    memmove(hashes + n, hashes, sizeof(uint64_t) * (nrows - n));
+  }
+
+  clear_cells(region + blank_from * width, n * width);
+  for (uint32_t row = blank_from; row < blank_from + n; ++row) {
+    hashes[row] = blank_hash;
+  }
+
+  // none of these rows can be assumed to match the terminal anymore
+  for (uint32_t row = scroll->top; row <= scroll->bottom; ++row) {
+    display->dirty_from[row] = 0;
+    display->dirty_to[row] = width;
+  }
+}
+
+/* Scroll the parts of the terminal where rows have moved since the previous
+ * frame. The terminal has to be in the default style, since that is what the
+ * rows scrolled into view are filled with.
+ */
+static void scroll_moved_rows(struct display *display) {
+  uint32_t width = display->grid_width, height = display->grid_height;
+
+  // usually known from the previous frame
+  if (!display->prev_row_hashes_valid) {
+    for (uint32_t row = 0; row < height; ++row) {
+      display->prev_row_hashes[row] =
+          hash_row(&display->prev_cells[row * width], width);
+    }
+  }
+
+  // rows that were not drawn look the same as on the terminal
+  for (uint32_t row = 0; row < height; ++row) {
+    display->row_hashes[row] =
+        display->dirty_from[row] < display->dirty_to[row]
+            ? hash_row(&display->cells[row * width], width)
+            : display->prev_row_hashes[row];
+  }
+
+  // nothing to gain from scrolling unless a couple of rows changed
+  uint32_t changed = 0;
+  for (uint32_t row = 0; row < height; ++row) {
+    changed += display->row_hashes[row] != display->prev_row_hashes[row];
+  }
+  if (changed < 2) {
+    return;
+  }
+
+  uint64_t blank_hash = FNV_OFFSET;
+  for (uint32_t col = 0; col < width; ++col) {
+    blank_hash = hash_cell(blank_hash, &blank_cell);
+  }
+
+  // a few scrolls are enough for a couple of windows scrolling at once
+  for (uint32_t i = 0; i < 4; ++i) {
+    struct scroll scroll = find_scroll(display, blank_hash);
+    if (scroll.gain < 2 || !scroll_pays_off(display, &scroll)) {
+      break;
+    }
+
+    apply_scroll(display, &scroll, blank_hash);
+  }
+}
+
+/* Write all cells that differ from what the terminal is showing. Only the
+ * parts of the grid that were drawn since the last time can differ.
+ */
+static void flush_changes(struct display *display) {
+  bool cursor_known = false;
+  uint32_t cursor_row = 0, cursor_col = 0;
+
+  // the terminal is always left in the default style between frames
+  struct cell_style style = default_style;
+
+  scroll_moved_rows(display);
+
+  for (uint32_t row = 0; row < display->grid_height; ++row) {
+    uint32_t col = display->dirty_from[row], end = display->dirty_to[row];
+    if (col < end && col > 0 && cell_at(display, row, col)->width == 0) {
+      --col;
+    }
+
+    while (col < end) {
+      uint32_t celli = row * display->grid_width + col;
+      struct cell *c = &display->cells[celli];
+      struct cell *prev = &display->prev_cells[celli];
+
+      // a wide character is written as a whole if any half of it changed
+      uint32_t width = c->width > 0 ? c->width : 1;
+      bool changed = !cells_eq(c, prev) ||
+                     (width == 2 && !cells_eq(c + 1, prev + 1));
+      if (!changed) {
+        col += width;
+        continue;
+      }
+
+      if (!cursor_known || cursor_row != row || cursor_col != col) {
+        put_cursor(display, row, col);
+      }
+
+      if (!styles_eq(&style, &c->style)) {
+        put_style(display, &style, &c->style);
+        style = c->style;
+      }
+
+      if (c->width == 0) {
+        // the first half was overwritten, leaving this one on its own
+        put(display, (uint8_t *)" ", 1);
+      } else {
+        put(display, c->bytes, c->nbytes);
+      }
+
+      memcpy(prev, c, sizeof(struct cell) * width);
+      col += width;
+
+      // the terminal may wrap when writing the last column, do not rely on it
+      cursor_row = row;
+      cursor_col = col;
+      cursor_known = col < display->grid_width;
+    }
+  }
+
+  if (!styles_eq(&style, &default_style)) {
+    put_style(display, &style, &default_style);
+  }
+
+  for (uint32_t row = 0; row < display->grid_height; ++row) {
+    display->dirty_from[row] = display->grid_width;
+    display->dirty_to[row] = 0;
+  }
+
+  // the terminal now shows this frame
+  uint64_t *hashes = display->prev_row_hashes;
+  display->prev_row_hashes = display->row_hashes;
+  display->row_hashes = hashes;
+  display->prev_row_hashes_valid = true;
+}
+
+bool display_pending(const struct display *display) {
+  return display->frame_skipped || display->nout > 0;
+}
+
 void display_end_render(struct display *display) {
-  (void)display;
+  // if the terminal has not taken all of an earlier frame yet, skip this one
+  // instead of queueing more, the changes are compared against what was
+  // queued and go out with the next frame that is not skipped
+  if (!write_output(display)) {
+    display->frame_skipped = true;
+    timer_count("display.skipped-frames", 1);
+    return;
+  }
+
+  display->frame_skipped = false;
+
+  hide_cursor(display);
+  flush_changes(display);
+  put_cursor(display, display->cursor_row, display->cursor_col);
+  show_cursor(display);
+  write_output(display);
 
-  show_cursor();
-  fflush(stdout);
+  timer_count("display.bytes", display->nbytes);
 }
@@ -4,16 +4,18 @@
 
 struct display;
 
-struct render_command;
 struct command_list;
+struct reactor;
 
 /**
  * Create a new display
  *
  * The only implementation of this is currently a termios one.
+ * @param reactor Reactor used to wait for the terminal when it cannot take a
+ * whole frame at once.
  * @returns A pointer to the display.
  */
-struct display *display_create(void);
+struct display *display_create(struct reactor *reactor);
 
 /**
  * Resize the display
@@ -59,7 +61,8 @@ void display_clear(struct display *display);
 /**
  * Move the cursor to the specified location
  *
- * Move the cursor to the specified row and column.
+ * Move the cursor to the specified row and column. The cursor is moved when
+ * the current render pass ends.
  * @param display The display to move the cursor for.
  * @param row The row to move the cursor to.
  * @param col The col to move the cursor to.
@@ -79,7 +82,8 @@ void display_begin_render(struct display *display);
  * Render a command list on the display.
  *
  * Render a command list on the given display. A command list is a series of
- * rendering instructions.
+ * rendering instructions. The result is drawn into an in-memory grid of cells
+ * that is written to the display by @ref display_end_render.
  * @param display The display to render on.
  * @param command_list The command list to render.
  */
@@ -89,16 +93,36 @@ void display_render(struct display *display, struct command_list *command_list);
  * Finish a render pass on the display.
  *
  * This tells the display that rendering is done for now and a flush is
- * triggered to update the display hardware.
+ * triggered to update the display hardware. Only the cells that changed since
+ * the last render pass are written. The number of bytes written is recorded in
+ * the "display.bytes" counter.
+ *
+ * Writing never blocks. When the terminal cannot take everything, the rest is
+ * written on later calls, and frames that end while an earlier one is still
+ * being written are skipped. Their changes go out with the next frame that is
+ * not skipped.
  * @param display The display to end rendering on.
  */
 void display_end_render(struct display *display);
 
+/**
+ * Does the display have output that has not reached the terminal?
+ *
+ * This is the case while a frame is still being written, or when a frame was
+ * skipped because of that. Another render pass is needed to write the rest.
+ * @param display The display to check.
+ * @returns True if there is output left to write, false otherwise.
+ */
+bool display_pending(const struct display *display);
+
 /**
  * Create a new command list.
  *
  * A command list records a series of commands for drawing text to a display.
- * @param capacity The capacity of the command list.
+ * The commands are stored in a single block of memory from @p allocator. If
+ * they do not fit, another block of twice the size is added.
+ * @param capacity The initial capacity of the command list, in bytes. Around
+ * 128 bytes per line to draw is usually enough.
  * @param allocator Allocation callback to use for data in the command list.
  * @param xoffset Column offset to apply to all operations in the list.
  * @param yoffset Row offset to apply to all operations in the list.
@@ -119,6 +143,42 @@ struct command_list *command_list_create(uint32_t capacity,
  */
 void command_list_set_show_whitespace(struct command_list *list, bool show);
 
+/**
+ * Set the number of columns that a '\\t' takes up.
+ *
+ * The default is 4.
+ * @param list Command list to record command in.
+ * @param width Width of a tab, in columns.
+ */
+void command_list_set_tab_width(struct command_list *list, uint32_t width);
+
+/**
+ * Clear a rectangle of cells.
+ *
+ * Cells that are not drawn keep what was drawn in them in earlier frames, so
+ * anything that is redrawn from scratch should be cleared first.
+ * @param list Command list to record command in.
+ * @param col Column of the top left cell to clear.
+ * @param row Row of the top left cell to clear.
+ * @param width Number of columns to clear.
+ * @param height Number of rows to clear.
+ */
+void command_list_clear(struct command_list *list, uint32_t col, uint32_t row,
+                        uint32_t width, uint32_t height);
+
+/**
+ * Limit drawing by a command list to a rectangle.
+ *
+ * Anything the command list, or command lists drawn from it, draws outside of
+ * the rectangle is ignored. This keeps a window from drawing over its
+ * neighbours, which might not draw again.
+ * @param list Command list to limit.
+ * @param width Number of columns, from the offset of the command list.
+ * @param height Number of rows, from the offset of the command list.
+ */
+void command_list_set_clip(struct command_list *list, uint32_t width,
+                           uint32_t height);
+
 /**
  * Names for the first 16 colors.
  */
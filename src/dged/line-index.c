@@ -0,0 +1,213 @@
+#include "line-index.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_BITS 16
+#define CHUNK_SIZE (1 << CHUNK_BITS)
+
+// how many bytes the worker scans before publishing what it found
+#define SCAN_BATCH (1024 * 1024)
+
+struct line_index {
+  const uint8_t *data;
+  uint64_t nbytes;
+
+  // line start offsets, in chunks so that they never move once written
+  uint64_t **chunks;
+  uint32_t nchunks;
+
+  // worker state, only touched by the worker thread (or before it starts)
+  uint32_t found;
+  uint64_t pos;
+
+  // published state, guarded by lock
+  uint32_t nlines;
+  uint64_t scanned;
+  bool done;
+  bool cancel;
+
+  bool has_thread;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static uint64_t line_start(const struct line_index *idx, uint32_t line) {
+  return idx->chunks[line >> CHUNK_BITS][line & (CHUNK_SIZE - 1)];
+}
+
+static void add_line_start(struct line_index *idx, uint64_t offset) {
+  uint32_t chunk = idx->found >> CHUNK_BITS;
+  if (idx->chunks[chunk] == NULL) {
+    idx->chunks[chunk] = (uint64_t *)malloc(sizeof(uint64_t) * CHUNK_SIZE);
+  }
+
+  idx->chunks[chunk][idx->found & (CHUNK_SIZE - 1)] = offset;
+  ++idx->found;
+}
+
+/* Scan forward from the current position until at least `nlines` lines or
+ * `nbytes` bytes have been found, returning true when the end is reached.
+ */
+static bool scan(struct line_index *idx, uint32_t nlines, uint64_t nbytes) {
+  const uint8_t *end = idx->data + idx->nbytes;
+  const uint8_t *limit =
+      idx->nbytes - idx->pos > nbytes ? idx->data + idx->pos + nbytes : end;
+  const uint8_t *p = idx->data + idx->pos;
+
+  while (p < limit && idx->found < nlines) {
+    const uint8_t *nl = memchr(p, '\n', limit - p);
+    if (nl == NULL) {
+      p = limit;
+      break;
+    }
+
+    add_line_start(idx, nl - idx->data + 1);
+    p = nl + 1;
+  }
+
+  idx->pos = p - idx->data;
+  return p == end;
+}
+
+static void publish(struct line_index *idx, bool done) {
+  pthread_mutex_lock(&idx->lock);
+  idx->nlines = idx->found;
+  idx->scanned = idx->pos;
+  idx->done = done;
+  pthread_cond_broadcast(&idx->cond);
+  pthread_mutex_unlock(&idx->lock);
+}
+
+static void *index_worker(void *userdata) {
+  struct line_index *idx = (struct line_index *)userdata;
+
+  bool done = false;
+  while (!done) {
+    done = scan(idx, UINT32_MAX, SCAN_BATCH);
+    publish(idx, done);
+
+    pthread_mutex_lock(&idx->lock);
+    bool cancel = idx->cancel;
+    pthread_mutex_unlock(&idx->lock);
+    if (cancel) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+struct line_index *line_index_create(const uint8_t *data, uint64_t nbytes,
+                                     uint32_t nsync_lines) {
+  struct line_index *idx = calloc(1, sizeof(struct line_index));
+  idx->data = data;
+  idx->nbytes = nbytes;
+
+  // there can never be more lines than bytes + 1
+  idx->nchunks = (nbytes + 1) / CHUNK_SIZE + 1;
+  idx->chunks = calloc(idx->nchunks, sizeof(uint64_t *));
+
+  pthread_mutex_init(&idx->lock, NULL);
+  pthread_cond_init(&idx->cond, NULL);
+
+  add_line_start(idx, 0);
+  bool done = scan(idx, nsync_lines, nbytes);
+  publish(idx, done);
+
+  if (!done) {
+    idx->has_thread =
+        pthread_create(&idx->thread, NULL, index_worker, idx) == 0;
+
+    // no thread, index everything up front instead
+    if (!idx->has_thread) {
+      scan(idx, UINT32_MAX, nbytes);
+      publish(idx, true);
+    }
+  }
+
+  return idx;
+}
+
+void line_index_destroy(struct line_index *idx) {
+  if (idx->has_thread) {
+    pthread_mutex_lock(&idx->lock);
+    idx->cancel = true;
+    pthread_mutex_unlock(&idx->lock);
+    pthread_join(idx->thread, NULL);
+  }
+
+  for (uint32_t ci = 0; ci < idx->nchunks; ++ci) {
+    free(idx->chunks[ci]);
+  }
+  free(idx->chunks);
+
+  pthread_cond_destroy(&idx->cond);
+  pthread_mutex_destroy(&idx->lock);
+  free(idx);
+}
+
+uint32_t line_index_nlines(struct line_index *idx) {
+  pthread_mutex_lock(&idx->lock);
+  uint32_t nlines = idx->nlines;
+  pthread_mutex_unlock(&idx->lock);
+  return nlines;
+}
+
+bool line_index_done(struct line_index *idx) {
+  pthread_mutex_lock(&idx->lock);
+  bool done = idx->done;
+  pthread_mutex_unlock(&idx->lock);
+  return done;
+}
+
+void line_index_wait(struct line_index *idx) {
+  pthread_mutex_lock(&idx->lock);
+  while (!idx->done) {
+    pthread_cond_wait(&idx->cond, &idx->lock);
+  }
+  pthread_mutex_unlock(&idx->lock);
+}
+
+bool line_index_line(struct line_index *idx, uint32_t line, uint64_t *start,
+                     uint64_t *end) {
+  // the end of a line is only known once the next one has been found
+  pthread_mutex_lock(&idx->lock);
+  while (!idx->done && line + 1 >= idx->nlines) {
+    pthread_cond_wait(&idx->cond, &idx->lock);
+  }
+  uint32_t nlines = idx->nlines;
+  pthread_mutex_unlock(&idx->lock);
+
+  if (line >= nlines) {
+    return false;
+  }
+
+  *start = line_start(idx, line);
+  *end = line + 1 < nlines ? line_start(idx, line + 1) - 1 : idx->nbytes;
+  return true;
+}
+
+uint32_t line_index_line_at(struct line_index *idx, uint64_t offset) {
+  pthread_mutex_lock(&idx->lock);
+  while (!idx->done && idx->scanned <= offset) {
+    pthread_cond_wait(&idx->cond, &idx->lock);
+  }
+  uint32_t nlines = idx->nlines;
+  pthread_mutex_unlock(&idx->lock);
+
+  // last line starting at or before offset
+  uint32_t lo = 0, hi = nlines;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (line_start(idx, mid) <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
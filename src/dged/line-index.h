@@ -0,0 +1,83 @@
+#ifndef _LINE_INDEX_H
+#define _LINE_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** @file line-index.h
+ * Background line indexing of a large, immutable, block of bytes.
+ *
+ * The start of the first lines is found before @ref line_index_create
+ * returns, the rest are found by a worker thread. Queries for lines that have
+ * not been indexed yet block until the worker gets to them.
+ */
+
+struct line_index;
+
+/**
+ * Create a new line index and start indexing in the background.
+ *
+ * @param data The bytes to index. Must stay valid and unmodified until the
+ * index is destroyed.
+ * @param nbytes The number of bytes in @p data.
+ * @param nsync_lines Number of lines to index before returning.
+ * @returns A new line index.
+ */
+struct line_index *line_index_create(const uint8_t *data, uint64_t nbytes,
+                                     uint32_t nsync_lines);
+
+/**
+ * Stop indexing and free all memory used by a line index.
+ *
+ * @param idx The line index to destroy.
+ */
+void line_index_destroy(struct line_index *idx);
+
+/**
+ * Get the number of lines found so far.
+ *
+ * @param idx The line index.
+ * @returns The number of lines found. This is the total number of lines once
+ * @ref line_index_done returns true.
+ */
+uint32_t line_index_nlines(struct line_index *idx);
+
+/**
+ * Check if all lines have been indexed.
+ *
+ * @param idx The line index.
+ * @returns True if the worker has indexed all lines.
+ */
+bool line_index_done(struct line_index *idx);
+
+/**
+ * Wait for the worker to index all lines.
+ *
+ * @param idx The line index.
+ */
+void line_index_wait(struct line_index *idx);
+
+/**
+ * Get the byte range of a line, waiting for it to be indexed if needed.
+ *
+ * @param idx The line index.
+ * @param line The line to get.
+ * @param [out] start Offset of the first byte of the line.
+ * @param [out] end Offset of the newline ending the line, or the end of the
+ * data for the last line.
+ * @returns False if @p line is past the last line.
+ */
+bool line_index_line(struct line_index *idx, uint32_t line, uint64_t *start,
+                     uint64_t *end);
+
+/**
+ * Get the line that a byte offset is on, waiting for it to be indexed if
+ * needed.
+ *
+ * @param idx The line index.
+ * @param offset The byte offset. Must be less than the size of the data.
+ * @returns The line containing @p offset.
+ */
+uint32_t line_index_line_at(struct line_index *idx, uint64_t offset);
+
+#endif
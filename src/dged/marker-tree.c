@@ -0,0 +1,243 @@
+#include "marker-tree.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+struct marker {
+  struct marker *left;
+  struct marker *right;
+  struct marker *parent;
+  uint32_t priority;
+  enum marker_gravity gravity;
+
+  // up to date as long as no ancestor has a pending change
+  uint64_t offset;
+
+  // pending change for the subtree below this marker: every offset is set to
+  // `to` (if `set`) and then moved by `shift`
+  bool set;
+  uint64_t to;
+  int64_t shift;
+};
+
+struct marker_tree {
+  // one tree per gravity, so that inserts never reorder markers
+  struct marker *roots[2];
+  uint32_t nmarkers;
+  uint32_t seed;
+};
+
+static uint32_t next_priority(struct marker_tree *tree) {
+  // xorshift32, good enough to keep the treap balanced
+  uint32_t x = tree->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  tree->seed = x;
+  return x;
+}
+
+static void apply(struct marker *m, bool set, uint64_t to, int64_t shift) {
+  if (m == NULL) {
+    return;
+  }
+
+  if (set) {
+    m->offset = to;
+    m->set = true;
+    m->to = to;
+    m->shift = 0;
+  }
+
+  m->offset += shift;
+  m->shift += shift;
+}
+
+static void push(struct marker *m) {
+  if (!m->set && m->shift == 0) {
+    return;
+  }
+
+  apply(m->left, m->set, m->to, m->shift);
+  apply(m->right, m->set, m->to, m->shift);
+  m->set = false;
+  m->shift = 0;
+}
+
+/* Push all pending changes down from the root to m, making its offset and the
+ * links to its children up to date.
+ */
+static void push_path(struct marker *m) {
+  if (m->parent != NULL) {
+    push_path(m->parent);
+  }
+
+  push(m);
+}
+
+static void set_left(struct marker *m, struct marker *child) {
+  m->left = child;
+  if (child != NULL) {
+    child->parent = m;
+  }
+}
+
+static void set_right(struct marker *m, struct marker *child) {
+  m->right = child;
+  if (child != NULL) {
+    child->parent = m;
+  }
+}
+
+static void set_root(struct marker_tree *tree, enum marker_gravity gravity,
+                     struct marker *root) {
+  tree->roots[gravity] = root;
+  if (root != NULL) {
+    root->parent = NULL;
+  }
+}
+
+static struct marker *merge(struct marker *a, struct marker *b) {
+  if (a == NULL) {
+    return b;
+  }
+
+  if (b == NULL) {
+    return a;
+  }
+
+  if (a->priority > b->priority) {
+    push(a);
+    set_right(a, merge(a->right, b));
+    return a;
+  }
+
+  push(b);
+  set_left(b, merge(a, b->left));
+  return b;
+}
+
+/* Split the tree rooted at m so that markers before offset end up in *l and
+ * the rest in *r.
+ */
+static void split(struct marker *m, uint64_t offset, struct marker **l,
+                  struct marker **r) {
+  if (m == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+
+  push(m);
+  struct marker *rest = NULL;
+  if (m->offset < offset) {
+    split(m->right, offset, &rest, r);
+    set_right(m, rest);
+    *l = m;
+  } else {
+    split(m->left, offset, l, &rest);
+    set_left(m, rest);
+    *r = m;
+  }
+}
+
+static void free_markers(struct marker *m) {
+  if (m == NULL) {
+    return;
+  }
+
+  free_markers(m->left);
+  free_markers(m->right);
+  free(m);
+}
+
+struct marker_tree *marker_tree_create(void) {
+  struct marker_tree *tree = calloc(1, sizeof(struct marker_tree));
+  tree->roots[MarkerGravity_Left] = NULL;
+  tree->roots[MarkerGravity_Right] = NULL;
+  tree->nmarkers = 0;
+  tree->seed = 2463534242;
+  return tree;
+}
+
+void marker_tree_destroy(struct marker_tree *tree) {
+  free_markers(tree->roots[MarkerGravity_Left]);
+  free_markers(tree->roots[MarkerGravity_Right]);
+  free(tree);
+}
+
+uint32_t marker_tree_size(const struct marker_tree *tree) {
+  return tree->nmarkers;
+}
+
+struct marker *marker_tree_add(struct marker_tree *tree, uint64_t offset,
+                               enum marker_gravity gravity) {
+  struct marker *m = calloc(1, sizeof(struct marker));
+  m->priority = next_priority(tree);
+  m->gravity = gravity;
+  m->offset = offset;
+
+  struct marker *l, *r;
+  split(tree->roots[gravity], offset, &l, &r);
+  set_root(tree, gravity, merge(merge(l, m), r));
+  ++tree->nmarkers;
+  return m;
+}
+
+void marker_tree_remove(struct marker_tree *tree, struct marker *marker) {
+  push_path(marker);
+
+  struct marker *parent = marker->parent;
+  struct marker *rest = merge(marker->left, marker->right);
+  if (parent == NULL) {
+    set_root(tree, marker->gravity, rest);
+  } else if (parent->left == marker) {
+    set_left(parent, rest);
+  } else {
+    set_right(parent, rest);
+  }
+
+  free(marker);
+  --tree->nmarkers;
+}
+
+uint64_t marker_tree_offset(struct marker *marker) {
+  if (marker->parent != NULL) {
+    push_path(marker->parent);
+  }
+
+  return marker->offset;
+}
+
+void marker_tree_insert(struct marker_tree *tree, uint64_t offset,
+                        uint64_t nbytes) {
+  if (nbytes == 0) {
+    return;
+  }
+
+  for (uint32_t gravity = 0; gravity < 2; ++gravity) {
+    // markers exactly at offset only move if they have right gravity
+    uint64_t split_at = gravity == MarkerGravity_Left ? offset + 1 : offset;
+
+    struct marker *l, *r;
+    split(tree->roots[gravity], split_at, &l, &r);
+    apply(r, false, 0, nbytes);
+    set_root(tree, gravity, merge(l, r));
+  }
+}
+
+void marker_tree_delete(struct marker_tree *tree, uint64_t offset,
+                        uint64_t nbytes) {
+  if (nbytes == 0) {
+    return;
+  }
+
+  uint64_t end = offset + nbytes < offset ? UINT64_MAX : offset + nbytes;
+  for (uint32_t gravity = 0; gravity < 2; ++gravity) {
+    struct marker *l, *mid, *r;
+    split(tree->roots[gravity], offset, &l, &r);
+    split(r, end, &mid, &r);
+    apply(mid, true, offset, 0);
+    apply(r, false, 0, -(int64_t)(end - offset));
+    set_root(tree, gravity, merge(merge(l, mid), r));
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef _MARKER_TREE_H
+#define _MARKER_TREE_H
+
+#include <stdint.h>
+
+/** @file marker-tree.h
+ * Positions in a text that follow along when the text is edited.
+ *
+ * Markers are kept in a balanced tree (a treap) ordered by byte offset.
+ * Edits shift or collapse whole subtrees at once by tagging them with a
+ * pending change that is only pushed down to the children when needed, so
+ * every edit is O(log n) in the number of markers, no matter how many of
+ * them it moves.
+ */
+
+/**
+ * Which way a marker moves when text is inserted exactly at it.
+ */
+enum marker_gravity {
+  /** Stay before the inserted text. */
+  MarkerGravity_Left,
+
+  /** Move to after the inserted text. */
+  MarkerGravity_Right,
+};
+
+struct marker;
+struct marker_tree;
+
+/**
+ * Create a new, empty, marker tree.
+ *
+ * @returns A pointer to the new marker tree.
+ */
+struct marker_tree *marker_tree_create(void);
+
+/**
+ * Destroy a marker tree and all markers in it.
+ *
+ * @param tree The marker tree to destroy.
+ */
+void marker_tree_destroy(struct marker_tree *tree);
+
+/**
+ * Get the number of markers in a marker tree.
+ *
+ * @param tree The marker tree.
+ * @returns The number of markers.
+ */
+uint32_t marker_tree_size(const struct marker_tree *tree);
+
+/**
+ * Add a marker to a marker tree.
+ *
+ * @param tree The marker tree to add the marker to.
+ * @param offset Byte offset of the marker.
+ * @param gravity How the marker moves when text is inserted at it.
+ * @returns The new marker, owned by the tree.
+ */
+struct marker *marker_tree_add(struct marker_tree *tree, uint64_t offset,
+                               enum marker_gravity gravity);
+
+/**
+ * Remove a marker from a marker tree and free it.
+ *
+ * @param tree The marker tree that the marker belongs to.
+ * @param marker The marker to remove.
+ */
+void marker_tree_remove(struct marker_tree *tree, struct marker *marker);
+
+/**
+ * Get the current byte offset of a marker.
+ *
+ * @param marker The marker.
+ * @returns The byte offset of @p marker.
+ */
+uint64_t marker_tree_offset(struct marker *marker);
+
+/**
+ * Move markers to account for bytes inserted in the text.
+ *
+ * @param tree The marker tree.
+ * @param offset Byte offset where the bytes were inserted.
+ * @param nbytes The number of inserted bytes.
+ */
+void marker_tree_insert(struct marker_tree *tree, uint64_t offset,
+                        uint64_t nbytes);
+
+/**
+ * Move markers to account for bytes deleted from the text.
+ *
+ * Markers inside the deleted range end up at @p offset.
+ *
+ * @param tree The marker tree.
+ * @param offset Byte offset of the first deleted byte.
+ * @param nbytes The number of deleted bytes.
+ */
+void marker_tree_delete(struct marker_tree *tree, uint64_t offset,
+                        uint64_t nbytes);
+
+#endif
@@ -249,6 +249,16 @@ void minibuffer_abort_prompt(void) { minibuffer_abort_prompt_internal(true); }
 
 bool minibuffer_empty(void) { return !minibuffer_displaying(); }
 
+bool minibuffer_message_expired(void) {
+  if (g_minibuffer.prompt_active || !minibuffer_displaying()) {
+    return false;
+  }
+
+  struct timespec current;
+  clock_gettime(CLOCK_MONOTONIC, &current);
+  return current.tv_sec >= g_minibuffer.expires.tv_sec;
+}
+
 bool minibuffer_displaying(void) {
   return g_minibuffer.buffer != NULL && !buffer_is_empty(g_minibuffer.buffer);
 }
@@ -105,6 +105,16 @@ bool minibuffer_empty(void);
  */
 bool minibuffer_displaying(void);
 
+/**
+ * Has the message in the minibuffer timed out?
+ *
+ * An expired message is cleared the next time the minibuffer is updated.
+ *
+ * @returns True if a message is displayed and it has timed out, false
+ * otherwise.
+ */
+bool minibuffer_message_expired(void);
+
 /**
  * Is the minibuffer currently focused?
  *
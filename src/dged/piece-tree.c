@@ -0,0 +1,453 @@
+#include "piece-tree.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vec.h"
+
+#define PIECE_BLOCK_SIZE (64 * 1024)
+
+struct piece_block {
+  uint8_t *data;
+  uint32_t nbytes;
+  uint32_t capacity;
+
+  // offsets of all newlines in data, in increasing order
+  VEC(uint32_t) newlines;
+};
+
+struct piece {
+  struct piece *left;
+  struct piece *right;
+  uint32_t priority;
+
+  uint32_t block;
+  uint32_t start;
+  uint32_t nbytes;
+
+  // index of the first newline of this piece in the block newline table
+  uint32_t first_newline;
+  uint32_t nnewlines;
+
+  // totals for the subtree rooted at this piece, including itself
+  uint64_t subtree_bytes;
+  uint64_t subtree_newlines;
+};
+
+struct piece_tree {
+  struct piece *root;
+  VEC(struct piece_block) blocks;
+  uint32_t seed;
+};
+
+static uint64_t subtree_bytes(const struct piece *p) {
+  return p != NULL ? p->subtree_bytes : 0;
+}
+
+static uint64_t subtree_newlines(const struct piece *p) {
+  return p != NULL ? p->subtree_newlines : 0;
+}
+
+static void update(struct piece *p) {
+  p->subtree_bytes = subtree_bytes(p->left) + p->nbytes + subtree_bytes(p->right);
+  p->subtree_newlines =
+      subtree_newlines(p->left) + p->nnewlines + subtree_newlines(p->right);
+}
+
+static uint32_t next_priority(struct piece_tree *tree) {
+  // xorshift32, good enough to keep the treap balanced
+  uint32_t x = tree->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  tree->seed = x;
+  return x;
+}
+
+static struct piece_block *block(const struct piece_tree *tree,
+                                 uint32_t blocki) {
+  return &VEC_ENTRIES(&tree->blocks)[blocki];
+}
+
+static struct piece *new_piece(struct piece_tree *tree, uint32_t blocki,
+                               uint32_t start, uint32_t nbytes,
+                               uint32_t first_newline, uint32_t nnewlines) {
+  struct piece *p = calloc(1, sizeof(struct piece));
+  p->priority = next_priority(tree);
+  p->block = blocki;
+  p->start = start;
+  p->nbytes = nbytes;
+  p->first_newline = first_newline;
+  p->nnewlines = nnewlines;
+  update(p);
+  return p;
+}
+
+static void free_pieces(struct piece *p) {
+  if (p == NULL) {
+    return;
+  }
+
+  free_pieces(p->left);
+  free_pieces(p->right);
+  free(p);
+}
+
+static void free_blocks(struct piece_tree *tree) {
+  VEC_FOR_EACH(&tree->blocks, struct piece_block * b) {
+    free(b->data);
+    VEC_DESTROY(&b->newlines);
+  }
+  VEC_CLEAR(&tree->blocks);
+}
+
+/* Number of newlines in the newline table range [first, first + n) that come
+ * before the block offset end.
+ */
+static uint32_t count_newlines(const struct piece_block *b, uint32_t first,
+                               uint32_t n, uint32_t end) {
+  uint32_t lo = first, hi = first + n;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (VEC_ENTRIES(&b->newlines)[mid] < end) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo - first;
+}
+
+static struct piece *merge(struct piece *a, struct piece *b) {
+  if (a == NULL) {
+    return b;
+  }
+
+  if (b == NULL) {
+    return a;
+  }
+
+  if (a->priority > b->priority) {
+    a->right = merge(a->right, b);
+    update(a);
+    return a;
+  }
+
+  b->left = merge(a, b->left);
+  update(b);
+  return b;
+}
+
+/* Split the tree rooted at p so that the first offset bytes end up in *l and
+ * the rest in *r, splitting a piece in two if needed.
+ */
+static void split(struct piece_tree *tree, struct piece *p, uint64_t offset,
+                  struct piece **l, struct piece **r) {
+  if (p == NULL) {
+    *l = *r = NULL;
+    return;
+  }
+
+  uint64_t left_bytes = subtree_bytes(p->left);
+  if (offset <= left_bytes) {
+    split(tree, p->left, offset, l, &p->left);
+    update(p);
+    *r = p;
+  } else if (offset >= left_bytes + p->nbytes) {
+    split(tree, p->right, offset - left_bytes - p->nbytes, &p->right, r);
+    update(p);
+    *l = p;
+  } else {
+    uint32_t rel = offset - left_bytes;
+    uint32_t head_newlines = count_newlines(
+        block(tree, p->block), p->first_newline, p->nnewlines, p->start + rel);
+    struct piece *tail = new_piece(
+        tree, p->block, p->start + rel, p->nbytes - rel,
+        p->first_newline + head_newlines, p->nnewlines - head_newlines);
+
+    p->nbytes = rel;
+    p->nnewlines = head_newlines;
+    *r = merge(tail, p->right);
+    p->right = NULL;
+    update(p);
+    *l = p;
+  }
+}
+
+/* Grow the rightmost piece under p if the new bytes were written right after
+ * it in the same block. This keeps typing and appending from creating a new
+ * piece for every insertion.
+ */
+static bool extend_last(struct piece *p, uint32_t blocki, uint32_t start,
+                        uint32_t nbytes, uint32_t nnewlines) {
+  if (p == NULL) {
+    return false;
+  }
+
+  bool extended = false;
+  if (p->right != NULL) {
+    extended = extend_last(p->right, blocki, start, nbytes, nnewlines);
+  } else if (p->block == blocki && p->start + p->nbytes == start) {
+    p->nbytes += nbytes;
+    p->nnewlines += nnewlines;
+    extended = true;
+  }
+
+  if (extended) {
+    p->subtree_bytes += nbytes;
+    p->subtree_newlines += nnewlines;
+  }
+
+  return extended;
+}
+
+static uint32_t writable_block(struct piece_tree *tree, uint32_t nbytes) {
+  struct piece_block *last = VEC_BACK(&tree->blocks);
+  if (last != NULL && last->capacity - last->nbytes >= nbytes) {
+    return VEC_SIZE(&tree->blocks) - 1;
+  }
+
+  uint32_t capacity = nbytes > PIECE_BLOCK_SIZE ? nbytes : PIECE_BLOCK_SIZE;
+  VEC_APPEND(&tree->blocks, struct piece_block * b);
+  b->data = malloc(capacity);
+  b->nbytes = 0;
+  b->capacity = capacity;
+  VEC_INIT(&b->newlines, 64);
+
+  return VEC_SIZE(&tree->blocks) - 1;
+}
+
+struct piece_tree *piece_tree_create(void) {
+  struct piece_tree *tree = calloc(1, sizeof(struct piece_tree));
+  tree->root = NULL;
+  tree->seed = 2463534242;
+  VEC_INIT(&tree->blocks, 8);
+
+  return tree;
+}
+
+void piece_tree_destroy(struct piece_tree *tree) {
+  free_pieces(tree->root);
+  free_blocks(tree);
+  VEC_DESTROY(&tree->blocks);
+  free(tree);
+}
+
+void piece_tree_clear(struct piece_tree *tree) {
+  free_pieces(tree->root);
+  tree->root = NULL;
+  free_blocks(tree);
+}
+
+uint64_t piece_tree_size(const struct piece_tree *tree) {
+  return subtree_bytes(tree->root);
+}
+
+uint64_t piece_tree_newlines(const struct piece_tree *tree) {
+  return subtree_newlines(tree->root);
+}
+
+void piece_tree_insert(struct piece_tree *tree, uint64_t offset,
+                       const uint8_t *bytes, uint32_t nbytes) {
+  if (nbytes == 0) {
+    return;
+  }
+
+  uint64_t size = piece_tree_size(tree);
+  if (offset > size) {
+    offset = size;
+  }
+
+  // append the bytes to a block, recording where the newlines went
+  uint32_t blocki = writable_block(tree, nbytes);
+  struct piece_block *b = block(tree, blocki);
+  uint32_t start = b->nbytes;
+  uint32_t first_newline = VEC_SIZE(&b->newlines);
+
+  memcpy(b->data + start, bytes, nbytes);
+  const uint8_t *nl = b->data + start, *end = b->data + start + nbytes;
+  while ((nl = memchr(nl, '\n', end - nl)) != NULL) {
+    VEC_PUSH(&b->newlines, nl - b->data);
+    ++nl;
+  }
+  b->nbytes += nbytes;
+  uint32_t nnewlines = VEC_SIZE(&b->newlines) - first_newline;
+
+  // then link them into the tree
+  struct piece *l, *r;
+  split(tree, tree->root, offset, &l, &r);
+  if (!extend_last(l, blocki, start, nbytes, nnewlines)) {
+    l = merge(l, new_piece(tree, blocki, start, nbytes, first_newline,
+                           nnewlines));
+  }
+
+  tree->root = merge(l, r);
+}
+
+void piece_tree_delete(struct piece_tree *tree, uint64_t offset,
+                       uint64_t nbytes) {
+  if (nbytes == 0) {
+    return;
+  }
+
+  struct piece *l, *mid, *r;
+  split(tree, tree->root, offset, &l, &r);
+  split(tree, r, nbytes, &mid, &r);
+  free_pieces(mid);
+
+  tree->root = merge(l, r);
+}
+
+uint64_t piece_tree_line_offset(const struct piece_tree *tree, uint32_t line) {
+  if (line == 0) {
+    return 0;
+  }
+
+  // find the piece containing newline number `line`
+  uint64_t base = 0, nth = line;
+  struct piece *p = tree->root;
+  while (p != NULL) {
+    uint64_t left_newlines = subtree_newlines(p->left);
+    if (nth <= left_newlines) {
+      p = p->left;
+      continue;
+    }
+
+    base += subtree_bytes(p->left);
+    nth -= left_newlines;
+    if (nth <= p->nnewlines) {
+      struct piece_block *b = block(tree, p->block);
+      uint32_t at = VEC_ENTRIES(&b->newlines)[p->first_newline + nth - 1];
+      return base + (at - p->start) + 1;
+    }
+
+    nth -= p->nnewlines;
+    base += p->nbytes;
+    p = p->right;
+  }
+
+  return base;
+}
+
+uint32_t piece_tree_line_at(const struct piece_tree *tree, uint64_t offset) {
+  uint64_t newlines = 0;
+  struct piece *p = tree->root;
+  while (p != NULL) {
+    uint64_t left_bytes = subtree_bytes(p->left);
+    if (offset < left_bytes) {
+      p = p->left;
+      continue;
+    }
+
+    newlines += subtree_newlines(p->left);
+    offset -= left_bytes;
+    if (offset < p->nbytes) {
+      newlines += count_newlines(block(tree, p->block), p->first_newline,
+                                 p->nnewlines, p->start + offset);
+      break;
+    }
+
+    newlines += p->nnewlines;
+    offset -= p->nbytes;
+    p = p->right;
+  }
+
+  return newlines;
+}
+
+static void for_each_span(const struct piece_tree *tree, const struct piece *p,
+                          uint64_t base, uint64_t from, uint64_t to,
+                          piece_span_cb callback, void *userdata) {
+  if (p == NULL) {
+    return;
+  }
+
+  uint64_t begin = base + subtree_bytes(p->left);
+  uint64_t end = begin + p->nbytes;
+
+  if (from < begin) {
+    for_each_span(tree, p->left, base, from, to, callback, userdata);
+  }
+
+  if (from < end && to > begin && p->nbytes > 0) {
+    uint64_t span_begin = from > begin ? from : begin;
+    uint64_t span_end = to < end ? to : end;
+    callback(block(tree, p->block)->data + p->start + (span_begin - begin),
+             span_end - span_begin, userdata);
+  }
+
+  if (to > end) {
+    for_each_span(tree, p->right, end, from, to, callback, userdata);
+  }
+}
+
+void piece_tree_for_each_span(const struct piece_tree *tree, uint64_t offset,
+                              uint64_t nbytes, piece_span_cb callback,
+                              void *userdata) {
+  if (nbytes == 0) {
+    return;
+  }
+
+  for_each_span(tree, tree->root, 0, offset, offset + nbytes, callback,
+                userdata);
+}
+
+static const uint8_t *find_contiguous(const struct piece_tree *tree,
+                                      uint64_t offset, uint32_t nbytes) {
+  struct piece *p = tree->root;
+  while (p != NULL) {
+    uint64_t left_bytes = subtree_bytes(p->left);
+    if (offset < left_bytes) {
+      p = p->left;
+      continue;
+    }
+
+    offset -= left_bytes;
+    if (offset < p->nbytes) {
+      if (offset + nbytes > p->nbytes) {
+        return NULL;
+      }
+
+      return block(tree, p->block)->data + p->start + offset;
+    }
+
+    offset -= p->nbytes;
+    p = p->right;
+  }
+
+  return NULL;
+}
+
+struct copy_state {
+  uint8_t *dst;
+  uint32_t offset;
+};
+
+static void copy_span(const uint8_t *bytes, uint32_t nbytes, void *userdata) {
+  struct copy_state *state = (struct copy_state *)userdata;
+  memcpy(state->dst + state->offset, bytes, nbytes);
+  state->offset += nbytes;
+}
+
+const uint8_t *piece_tree_contiguous(struct piece_tree *tree, uint64_t offset,
+                                     uint32_t nbytes) {
+  if (nbytes == 0) {
+    return NULL;
+  }
+
+  const uint8_t *bytes = find_contiguous(tree, offset, nbytes);
+  if (bytes != NULL) {
+    return bytes;
+  }
+
+  // the range is spread out over several pieces, replace them with one
+  struct copy_state state = {.dst = malloc(nbytes), .offset = 0};
+  piece_tree_for_each_span(tree, offset, nbytes, copy_span, &state);
+  piece_tree_delete(tree, offset, nbytes);
+  piece_tree_insert(tree, offset, state.dst, nbytes);
+  free(state.dst);
+
+  return find_contiguous(tree, offset, nbytes);
+}
@@ -0,0 +1,134 @@
+#ifndef _PIECE_TREE_H
+#define _PIECE_TREE_H
+
+#include <stdint.h>
+
+/** @file piece-tree.h
+ * Piece table text storage.
+ *
+ * Bytes are never moved once they have been written. Inserted text is
+ * appended to fixed-size blocks and the contents are described by a
+ * balanced tree (a treap) of pieces ordered by their position in the text.
+ * Every node keeps the number of bytes and newlines in its subtree so
+ * inserting, deleting and looking up lines are all O(log n) in the number of
+ * pieces.
+ */
+
+struct piece_tree;
+
+/**
+ * Callback for a contiguous span of bytes in a piece tree.
+ *
+ * @param bytes Pointer to the bytes of the span.
+ * @param nbytes Number of bytes in the span.
+ * @param userdata Userdata passed to @ref piece_tree_for_each_span.
+ */
+typedef void (*piece_span_cb)(const uint8_t *bytes, uint32_t nbytes,
+                              void *userdata);
+
+/**
+ * Create a new, empty, piece tree.
+ *
+ * @returns A pointer to the new piece tree.
+ */
+struct piece_tree *piece_tree_create(void);
+
+/**
+ * Destroy a piece tree, freeing all associated memory.
+ *
+ * @param tree The piece tree to destroy.
+ */
+void piece_tree_destroy(struct piece_tree *tree);
+
+/**
+ * Remove all bytes from a piece tree.
+ *
+ * @param tree The piece tree to clear.
+ */
+void piece_tree_clear(struct piece_tree *tree);
+
+/**
+ * Get the total number of bytes in a piece tree.
+ *
+ * @param tree The piece tree.
+ * @returns The number of bytes.
+ */
+uint64_t piece_tree_size(const struct piece_tree *tree);
+
+/**
+ * Get the total number of newline characters in a piece tree.
+ *
+ * @param tree The piece tree.
+ * @returns The number of '\\n' bytes.
+ */
+uint64_t piece_tree_newlines(const struct piece_tree *tree);
+
+/**
+ * Insert bytes into a piece tree.
+ *
+ * @param tree The piece tree to insert into.
+ * @param offset The byte offset to insert at. Clamped to the size of the tree.
+ * @param bytes The bytes to insert.
+ * @param nbytes The number of bytes in @p bytes.
+ */
+void piece_tree_insert(struct piece_tree *tree, uint64_t offset,
+                       const uint8_t *bytes, uint32_t nbytes);
+
+/**
+ * Delete bytes from a piece tree.
+ *
+ * @param tree The piece tree to delete from.
+ * @param offset The byte offset of the first byte to delete.
+ * @param nbytes The number of bytes to delete.
+ */
+void piece_tree_delete(struct piece_tree *tree, uint64_t offset,
+                       uint64_t nbytes);
+
+/**
+ * Get the byte offset of the start of a line.
+ *
+ * @param tree The piece tree.
+ * @param line The line (0..) to get the offset for.
+ * @returns The offset of the byte following the @p line:th newline. If there
+ * are fewer newlines than that, the size of the tree is returned.
+ */
+uint64_t piece_tree_line_offset(const struct piece_tree *tree, uint32_t line);
+
+/**
+ * Get the line that a byte offset is on.
+ *
+ * @param tree The piece tree.
+ * @param offset The byte offset.
+ * @returns The number of newlines before @p offset.
+ */
+uint32_t piece_tree_line_at(const struct piece_tree *tree, uint64_t offset);
+
+/**
+ * Call @p callback for each contiguous span of bytes in a range.
+ *
+ * @param tree The piece tree.
+ * @param offset Byte offset where the range starts.
+ * @param nbytes Number of bytes in the range.
+ * @param callback Callback to call for each span.
+ * @param userdata Data passed unmodified to @p callback.
+ */
+void piece_tree_for_each_span(const struct piece_tree *tree, uint64_t offset,
+                              uint64_t nbytes, piece_span_cb callback,
+                              void *userdata);
+
+/**
+ * Get a pointer to a range of bytes stored contiguously.
+ *
+ * If the range spans several pieces, the bytes are copied into a single new
+ * piece first. This does not change the contents of the tree and pointers
+ * previously returned stay valid until the tree is cleared or destroyed.
+ *
+ * @param tree The piece tree.
+ * @param offset Byte offset where the range starts.
+ * @param nbytes Number of bytes in the range.
+ * @returns A pointer to @p nbytes contiguous bytes or NULL if @p nbytes is 0.
+ */
+const uint8_t *piece_tree_contiguous(struct piece_tree *tree, uint64_t offset,
+                                     uint32_t nbytes);
+
+#endif
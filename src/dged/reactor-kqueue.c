@@ -62,12 +62,12 @@ uint32_t reactor_register_interest(struct reactor *reactor, int fd,
   uint32_t nchanges = 0;
 
   if ((interest & ReadInterest) != 0) {
-    EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EV_SET(&changes[nchanges], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
     ++nchanges;
   }
 
   if ((interest & WriteInterest) != 0) {
-    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+    EV_SET(&changes[nchanges], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
     ++nchanges;
   }
 
@@ -133,9 +133,12 @@ bool reactor_next_file_event(struct reactor *reactor, struct file_event *out) {
 }
 
 void reactor_unregister_interest(struct reactor *reactor, uint32_t ev_id) {
-  struct kevent changes[2] = {0};
-  EV_SET(&changes[0], ev_id, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-  EV_SET(&changes[1], ev_id, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-
-  kevent(reactor->queue, changes, 2, NULL, 0, NULL);
+  // one at a time, deleting a filter that was never added fails and would
+  // stop the rest of the changes from being applied
+  struct kevent change;
+  EV_SET(&change, ev_id, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  kevent(reactor->queue, &change, 1, NULL, 0, NULL);
+
+  EV_SET(&change, ev_id, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+  kevent(reactor->queue, &change, 1, NULL, 0, NULL);
 }
@@ -33,6 +33,7 @@ void settings_destroy(void) {
 
 void setting_set_value(struct setting *setting, struct setting_value val) {
   if (setting->value.type == val.type) {
+    ++g_settings.generation;
     if (setting->value.type == Setting_String &&
         val.data.string_value != NULL) {
       setting->value.data.string_value = strdup(val.data.string_value);
@@ -97,6 +98,8 @@ void settings_set_default(const char *path, struct setting_value value) {
   }
 }
 
+uint64_t settings_generation(void) { return g_settings.generation; }
+
 void setting_to_string(struct setting *setting, char *buf, size_t n) {
   switch (setting->value.type) {
   case Setting_Bool:
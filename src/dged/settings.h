@@ -61,6 +61,9 @@ HASHMAP_ENTRY_TYPE(setting_entry, struct setting);
  */
 struct settings {
   HASHMAP(struct setting_entry) settings;
+
+  /** Increased every time a setting is changed. */
+  uint64_t generation;
 };
 
 /**
@@ -119,6 +122,16 @@ void settings_set(const char *path, struct setting_value value);
  */
 void settings_set_default(const char *path, struct setting_value value);
 
+/**
+ * Get the current generation of the settings.
+ *
+ * The generation is increased every time a setting is added or changed, so
+ * anything computed from settings is up to date as long as it stays the same.
+ *
+ * @returns The current generation of the settings.
+ */
+uint64_t settings_generation(void);
+
 /**
  * Set a value for a setting.
  *
@@ -39,14 +39,29 @@ struct predicate {
   void (*cleanup)(void *);
 };
 
+#define MAX_HIGHLIGHTED_RANGES 8
+
+struct line_range {
+  uint32_t begin;
+  uint32_t end;
+};
+
 struct highlight {
   TSParser *parser;
   TSTree *tree;
   TSQuery *query;
   VEC(struct predicate) predicates;
   void *dlhandle;
+
+  // the lines that the syntax layer has properties for, and the text
+  // generation they were made for
+  struct line_range highlighted[MAX_HIGHLIGHTED_RANGES];
+  uint32_t nhighlighted;
+  uint64_t highlighted_generation;
 };
 
+static uint32_t g_syntax_layer = 0;
+
 static void delete_parser(struct buffer *buffer, void *userdata) {
   (void)buffer;
 
@@ -72,24 +87,45 @@ static void delete_parser(struct buffer *buffer, void *userdata) {
   free(highlight);
 }
 
+struct first_span {
+  const uint8_t *bytes;
+  uint32_t nbytes;
+};
+
+static void keep_first_span(const uint8_t *bytes, uint32_t nbytes,
+                            void *userdata) {
+  struct first_span *span = (struct first_span *)userdata;
+  if (span->bytes == NULL) {
+    span->bytes = bytes;
+    span->nbytes = nbytes;
+  }
+}
+
 static const char *read_text(void *payload, uint32_t byte_offset,
                              TSPoint position, uint32_t *bytes_read) {
   (void)byte_offset;
 
   struct text *text = (struct text *)payload;
 
-  if (position.row < text_num_lines(text)) {
-    struct text_chunk chunk = text_get_line(text, position.row);
+  // only wait for the lines of a mapped text to be counted when reading past
+  // the ones counted so far
+  if (position.row < text_num_lines(text) ||
+      position.row < text_wait_num_lines(text)) {
+    // a line being edited is returned one side of its gap at a time, the
+    // parser asks for the rest when it gets there
+    struct first_span span = {0};
+    text_for_each_span(text, position.row, position.column, position.row,
+                       text_line_size(text, position.row), keep_first_span,
+                       &span);
 
     // empty lines
-    if (chunk.nbytes == 0 || position.column >= chunk.nbytes) {
+    if (span.bytes == NULL) {
       *bytes_read = 1;
       return "\n";
     }
 
-    uint32_t bytei = position.column;
-    *bytes_read = chunk.nbytes - bytei;
-    return (const char *)chunk.text + bytei;
+    *bytes_read = span.nbytes;
+    return (const char *)span.bytes;
   }
 
   // eof
@@ -159,11 +195,18 @@ static bool eval_match(struct s8 capname, uint32_t argc, struct s8 argv[],
     return false;
   }
 
+#ifdef REG_STARTEND
+  // match directly in the text, without a terminating nul
+  regmatch_t bounds = {.rm_so = 0, .rm_eo = value.l};
+  return regexec(regex, value.l > 0 ? (const char *)value.s : "", 1, &bounds,
+                 REG_STARTEND) == 0;
+#else
   char *text = s8tocstr(value);
   bool match = regexec(regex, text, 0, NULL, 0) == 0;
 
   free(text);
   return match;
+#endif
 }
 
 static void cleanup_match(void *data) {
@@ -305,56 +348,92 @@ static TSQuery *setup_queries(const char *lang_root, TSTree *tree) {
   return q;
 }
 
+struct capture_text {
+  struct s8 value;
+  uint64_t nbytes;
+  uint8_t *copy;
+};
+
+static void collect_capture_span(const uint8_t *bytes, uint32_t nbytes,
+                                 void *userdata) {
+  struct capture_text *capture = (struct capture_text *)userdata;
+
+  // captures on a single line are usually one span, use it as is
+  if (capture->value.l == 0 && nbytes == capture->nbytes) {
+    capture->value = (struct s8){.s = (uint8_t *)bytes, .l = nbytes};
+    return;
+  }
+
+  if (capture->copy == NULL) {
+    capture->copy = (uint8_t *)malloc(capture->nbytes);
+  }
+
+  memcpy(capture->copy + capture->value.l, bytes, nbytes);
+  capture->value.s = capture->copy;
+  capture->value.l += nbytes;
+}
+
 static bool eval_predicates(struct highlight *h, struct text *text,
                             TSPoint start, TSPoint end, uint32_t pattern_index,
                             struct s8 cname) {
+  struct capture_text capture = {0};
+  bool fetched = false, result = true;
+
   VEC_FOR_EACH(&h->predicates, struct predicate * p) {
     if (p->pattern_idx == pattern_index) {
-      struct text_chunk txt =
-          text_get_region(text, start.row, start.column, end.row, end.column);
-      bool result =
-          p->eval(cname, p->argc, p->argv,
-                  (struct s8){.s = txt.text, .l = txt.nbytes}, p->data);
-
-      if (txt.allocated) {
-        free(txt.text);
+      if (!fetched) {
+        capture.nbytes = text_region_size(text, start.row, start.column,
+                                          end.row, end.column);
+        text_for_each_span(text, start.row, start.column, end.row, end.column,
+                           collect_capture_span, &capture);
+        fetched = true;
       }
 
-      if (!result) {
-        return false;
+      if (!p->eval(cname, p->argc, p->argv, capture.value, p->data)) {
+        result = false;
+        break;
       }
     }
   }
 
-  return true;
+  free(capture.copy);
+  return result;
 }
 
-#define match_cname(cname, capture)                                            \
-  (s8eq(cname, s8(capture)) || s8startswith(cname, s8(capture ".")))
-
-static void update_parser(struct buffer *buffer, void *userdata,
-                          struct location origin, uint32_t width,
-                          uint32_t height) {
-
-  (void)width;
+static void forget_highlights(struct buffer *buffer, struct highlight *h) {
+  text_clear_layer(buffer->text, g_syntax_layer);
+  h->nhighlighted = 0;
+  h->highlighted_generation = 0;
+}
 
-  struct highlight *h = (struct highlight *)userdata;
+/* The lines of a shown part of the buffer, including the one below it. */
+static struct line_range shown_lines(struct region shown, uint32_t nlines) {
+  return (struct line_range){
+      .begin = shown.begin.line,
+      .end = shown.end.line >= nlines ? nlines - 1 : shown.end.line,
+  };
+}
 
-  if (h->query == NULL) {
-    return;
+static bool is_highlighted(struct highlight *h, struct line_range lines) {
+  for (uint32_t i = 0; i < h->nhighlighted; ++i) {
+    if (lines.begin >= h->highlighted[i].begin &&
+        lines.end <= h->highlighted[i].end) {
+      return true;
+    }
   }
 
-  if (buffer_is_empty(buffer)) {
-    return;
-  }
+  return false;
+}
+
+#define match_cname(cname, capture)                                            \
+  (s8eq(cname, s8(capture)) || s8startswith(cname, s8(capture ".")))
 
+static void highlight_lines(struct buffer *buffer, struct highlight *h,
+                            uint32_t begin_line, uint32_t end_line) {
   // take results and set text properties
   TSQueryCursor *cursor = ts_query_cursor_new();
-  uint32_t end_line = origin.line + height >= buffer_num_lines(buffer)
-                          ? buffer_num_lines(buffer) - 1
-                          : origin.line + height;
   ts_query_cursor_set_point_range(
-      cursor, (TSPoint){.row = origin.line, .column = origin.col},
+      cursor, (TSPoint){.row = begin_line, .column = 0},
       (TSPoint){.row = end_line,
                 .column = buffer_line_length(buffer, end_line)});
   ts_query_cursor_exec(cursor, h->query, ts_tree_root_node(h->tree));
@@ -420,22 +499,79 @@ static void update_parser(struct buffer *buffer, void *userdata,
         continue;
       }
 
-      text_add_property(buffer->text, start.row, start.column, end.row,
-                        end.column > 0 ? end.column - 1 : 0,
-                        (struct text_property){
-                            .type = TextProperty_Colors,
-                            .data.colors =
-                                (struct text_property_colors){
-                                    .set_fg = true,
-                                    .fg = color,
-                                },
-                        });
+      text_add_layer_property(buffer->text, g_syntax_layer, start.row,
+                              start.column, end.row,
+                              end.column > 0 ? end.column - 1 : 0,
+                              (struct text_property){
+                                  .type = TextProperty_Colors,
+                                  .data.colors =
+                                      (struct text_property_colors){
+                                          .set_fg = true,
+                                          .fg = color,
+                                      },
+                              });
     }
   }
 
   ts_query_cursor_delete(cursor);
 }
 
+static void update_parser(struct buffer *buffer, void *userdata,
+                          const struct region *shown, uint32_t nshown) {
+  struct highlight *h = (struct highlight *)userdata;
+
+  if (h->query == NULL) {
+    return;
+  }
+
+  // an emptied buffer can still have properties from before it was emptied
+  if (buffer_is_empty(buffer)) {
+    if (h->nhighlighted > 0) {
+      forget_highlights(buffer, h);
+    }
+    return;
+  }
+
+  // properties from earlier frames stay valid until the text changes or a
+  // view scrolls outside of them
+  uint32_t nlines = buffer_num_lines(buffer);
+  uint64_t generation = text_generation(buffer->text);
+  bool highlighted =
+      h->nhighlighted > 0 && h->highlighted_generation == generation;
+  for (uint32_t i = 0; i < nshown && highlighted; ++i) {
+    highlighted = is_highlighted(h, shown_lines(shown[i], nlines));
+  }
+
+  if (highlighted) {
+    return;
+  }
+
+  forget_highlights(buffer, h);
+  h->highlighted_generation = generation;
+
+  // highlight a screen above and below as well, to not have to redo it on
+  // every scroll. Parts that get close to each other are highlighted as one.
+  for (uint32_t i = 0; i < nshown; ++i) {
+    struct line_range lines = shown_lines(shown[i], nlines);
+    uint32_t height = shown[i].end.line - shown[i].begin.line;
+    lines.begin = lines.begin > height ? lines.begin - height : 0;
+    lines.end = lines.end + height >= nlines ? nlines - 1 : lines.end + height;
+
+    struct line_range *last =
+        h->nhighlighted > 0 ? &h->highlighted[h->nhighlighted - 1] : NULL;
+    if (last != NULL && (lines.begin <= last->end + 1 ||
+                         h->nhighlighted == MAX_HIGHLIGHTED_RANGES)) {
+      last->end = lines.end > last->end ? lines.end : last->end;
+    } else {
+      h->highlighted[h->nhighlighted++] = lines;
+    }
+  }
+
+  for (uint32_t i = 0; i < h->nhighlighted; ++i) {
+    highlight_lines(buffer, h, h->highlighted[i].begin, h->highlighted[i].end);
+  }
+}
+
 static void text_removed(struct buffer *buffer, struct edit_location removed,
                          void *userdata) {
   struct highlight *h = (struct highlight *)userdata;
@@ -472,6 +608,10 @@ static void text_removed(struct buffer *buffer, struct edit_location removed,
 static void buffer_reloaded(struct buffer *buffer, void *userdata) {
   struct highlight *h = (struct highlight *)userdata;
 
+  // the properties were made from the old tree, so redo them on the next
+  // render
+  forget_highlights(buffer, h);
+
   TSInput i = (TSInput){
       .payload = buffer->text,
       .read = read_text,
@@ -602,6 +742,7 @@ static void create_parser(struct buffer *buffer, void *userdata) {
 }
 
 void syntax_init(uint32_t grammar_path_len, const char *grammar_path[]) {
+  g_syntax_layer = text_property_layer("syntax");
 
   treesitter_path_len = grammar_path_len < 256 ? grammar_path_len : 256;
   for (uint32_t i = 0; i < treesitter_path_len; ++i) {
@@ -4,482 +4,2249 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include "display.h"
+#include "line-index.h"
+#include "piece-tree.h"
 #include "signal.h"
 #include "utf8.h"
 #include "vec.h"
 
 enum flags {
-  LineChanged = 1 << 0,
+  // data points into the slab of a bulk loaded text
+  LineBorrowed = 1 << 0,
+
+  // data is stored in the line itself
+  LineInline = 1 << 1,
+
+  // data is a heap allocation of exactly nbytes, without a line buffer
+  LineExact = 1 << 2,
+
+  // the line buffer gap was closed to read the line after the last edit
+  LineRead = 1 << 3,
 };
 
+// short lines are stored in the space otherwise used for the data pointer,
+// sized so that a line is still 16 bytes
+#define LINE_INLINE_SIZE 11
+
 struct line {
-  uint8_t *data;
+  // a pointer to the data, unless the line is inline
+  uint8_t data[LINE_INLINE_SIZE];
   uint8_t flags;
   uint32_t nbytes;
 };
 
+static const struct line empty_line = {.flags = LineInline};
+
+/* Heap storage of a line that has been edited. The bytes are kept as a gap
+ * buffer with the gap at the last edit point, so that repeated edits at the
+ * same position do not have to move the rest of the line. The gap is
+ * `capacity - nbytes` bytes long.
+ *
+ * Reads that can take the line in two parts, like rendering, read around the
+ * gap. Reading the line in one piece closes the gap, and an edit following such
+ * a read is made in place instead of moving the gap back just to close it for
+ * the next read.
+ */
+struct line_buffer {
+  uint32_t capacity;
+  uint32_t gap;
+  uint8_t bytes[];
+};
+
+#define LINE_BLOCK_SIZE 512
+
+/* A run of consecutive lines. Lines are kept in a list of these blocks so that
+ * inserting or removing a line only moves the lines in one block.
+ */
+struct line_block {
+  uint32_t nlines;
+
+  // number of texts and snapshots sharing the block, see own_block
+  uint32_t refs;
+
+  // if lines have been edited since the last snapshot and might have open gaps
+  bool edited;
+
+  // number of bytes in the block, counting a newline after each line
+  uint64_t nbytes;
+
+  struct line lines[LINE_BLOCK_SIZE];
+};
+
+/* Bytes from text_load that unmodified lines point into. Shared between a text
+ * and its snapshots and freed with the last of them.
+ */
+struct slab {
+  uint8_t *bytes;
+  uint64_t size;
+  bool mapped;
+  uint32_t refs;
+};
+
+struct text_snapshot {
+  uint32_t refs;
+  struct text *text;
+};
+
+// number of changes kept for text_get_changes
+#define CHANGE_HISTORY_SIZE 64
+
+struct change_entry {
+  uint64_t generation;
+  struct text_change change;
+};
+
 struct text_property_entry {
   struct location start;
   struct location end;
+  uint32_t layer;
   struct text_property property;
 };
 
+/* A node in the property index, which is an interval tree stored as an array
+ * sorted on start location. The root of each subtree is in the middle of its
+ * range, and knows the last end location in the subtree.
+ */
+struct property_node {
+  struct location start;
+  struct location max_end;
+  uint32_t entry;
+};
+
 struct text {
+  enum text_storage storage;
+
   // raw bytes without any null terminators
-  struct line *lines;
+  struct line_block **blocks;
+  uint32_t nblocks;
+  uint32_t blocks_capacity;
+
+  // fenwick trees over the number of lines and bytes in each block
+  uint64_t *block_lines;
+  uint64_t *block_bytes;
+
   uint32_t nlines;
-  uint32_t capacity;
+
+  struct slab *slab;
+
+  // read-only file mapping from text_load_mapped, used until first edit
+  uint8_t *mapping;
+  uint64_t mapping_size;
+  uint64_t mapping_nbytes;
+  struct line_index *mapping_index;
+
+  // the last changes, in a ring buffer, and what was before them
+  uint64_t generation;
+  struct change_entry changes[CHANGE_HISTORY_SIZE];
+  uint32_t changes_first;
+  uint32_t nchanges;
+  struct change_entry dropped_changes;
+
+  // only used for TextStorage_PieceTable
+  struct piece_tree *pieces;
+
   VEC(struct text_property_entry) properties;
+
+  // built on the first query after properties are added
+  VEC(struct property_node) property_index;
+  bool property_index_valid;
+
+  // increased every time the properties change
+  uint64_t properties_generation;
+
+  struct marker_tree *markers;
 };
 
-struct text *text_create(uint32_t initial_capacity) {
-  struct text *txt = calloc(1, sizeof(struct text));
-  txt->lines = calloc(initial_capacity, sizeof(struct line));
-  txt->capacity = initial_capacity;
-  txt->nlines = 0;
+static void fenwick_add(uint64_t *tree, uint32_t n, uint32_t idx,
+                        int64_t delta) {
+  for (uint32_t i = idx + 1; i <= n; i += i & (~i + 1)) {
+    tree[i - 1] += delta;
+  }
+}
 
-  VEC_INIT(&txt->properties, 32);
+/* Sum of the entries before `idx`. */
+static uint64_t fenwick_sum(const uint64_t *tree, uint32_t idx) {
+  uint64_t sum = 0;
+  for (uint32_t i = idx; i > 0; i -= i & (~i + 1)) {
+    sum += tree[i - 1];
+  }
 
-  return txt;
+  return sum;
 }
 
-void text_destroy(struct text *text) {
-  VEC_DESTROY(&text->properties);
+static void fenwick_build(uint64_t *tree, uint32_t n) {
+  for (uint32_t i = 1; i <= n; ++i) {
+    uint32_t parent = i + (i & (~i + 1));
+    if (parent <= n) {
+      tree[parent - 1] += tree[i - 1];
+    }
+  }
+}
 
-  for (uint32_t li = 0; li < text->nlines; ++li) {
-    free(text->lines[li].data);
-    text->lines[li].data = NULL;
-    text->lines[li].flags = 0;
-    text->lines[li].nbytes = 0;
+/* Find the index of the entry where the prefix sum passes `value`, storing the
+ * remainder in `rest`.
+ */
+static uint32_t fenwick_find(const uint64_t *tree, uint32_t n, uint64_t value,
+                             uint64_t *rest) {
+  uint32_t step = 1;
+  while (step * 2 <= n) {
+    step *= 2;
   }
 
-  free(text->lines);
-  free(text);
+  uint32_t pos = 0;
+  for (; step > 0; step /= 2) {
+    if (pos + step <= n && tree[pos + step - 1] <= value) {
+      pos += step;
+      value -= tree[pos - 1];
+    }
+  }
+
+  *rest = value;
+  return pos;
 }
 
-void text_clear(struct text *text) {
-  for (uint32_t li = 0; li < text->nlines; ++li) {
-    free(text->lines[li].data);
-    text->lines[li].data = NULL;
-    text->lines[li].flags = 0;
-    text->lines[li].nbytes = 0;
+static void rebuild_block_index(struct text *text) {
+  for (uint32_t bi = 0; bi < text->nblocks; ++bi) {
+    text->block_lines[bi] = text->blocks[bi]->nlines;
+    text->block_bytes[bi] = text->blocks[bi]->nbytes;
   }
 
-  text->nlines = 0;
-  text_clear_properties(text);
+  fenwick_build(text->block_lines, text->nblocks);
+  fenwick_build(text->block_bytes, text->nblocks);
 }
 
-struct utf8_codepoint_iterator
-text_line_codepoint_iterator(const struct text *text, uint32_t lineidx) {
-  if (lineidx >= text_num_lines(text)) {
-    return create_utf8_codepoint_iterator(NULL, 0, 0);
+static void insert_block(struct text *text, uint32_t blocki) {
+  if (text->nblocks == text->blocks_capacity) {
+    text->blocks_capacity = text->blocks_capacity * 2 + 1;
+    text->blocks = realloc(text->blocks, sizeof(struct line_block *) *
+                                             text->blocks_capacity);
+    text->block_lines =
+        realloc(text->block_lines, sizeof(uint64_t) * text->blocks_capacity);
+    text->block_bytes =
+        realloc(text->block_bytes, sizeof(uint64_t) * text->blocks_capacity);
   }
 
-  return create_utf8_codepoint_iterator(text->lines[lineidx].data,
-                                        text->lines[lineidx].nbytes, 0);
-}
+  memmove(&text->blocks[blocki + 1], &text->blocks[blocki],
+          sizeof(struct line_block *) * (text->nblocks - blocki));
+  text->blocks[blocki] = calloc(1, sizeof(struct line_block));
+  text->blocks[blocki]->refs = 1;
 
-struct utf8_codepoint_iterator
-text_chunk_codepoint_iterator(const struct text_chunk *chunk) {
-  return create_utf8_codepoint_iterator(chunk->text, chunk->nbytes, 0);
+  // lines with open gaps can be moved into it when splitting a block
+  text->blocks[blocki]->edited = true;
+  ++text->nblocks;
 }
 
-void append_empty_lines(struct text *text, uint32_t numlines) {
+static void free_line_data(struct line *line);
 
-  if (text->nlines + numlines >= text->capacity) {
-    text->capacity += text->capacity + numlines > text->capacity * 2
-                          ? numlines + 1
-                          : text->capacity;
-    text->lines = realloc(text->lines, sizeof(struct line) * text->capacity);
+static void release_block(struct line_block *block) {
+  if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
   }
 
-  for (uint32_t i = 0; i < numlines; ++i) {
-    struct line *nline = &text->lines[text->nlines];
-    nline->data = NULL;
-    nline->nbytes = 0;
-    nline->flags = 0;
-
-    ++text->nlines;
+  for (uint32_t li = 0; li < block->nlines; ++li) {
+    free_line_data(&block->lines[li]);
   }
+  free(block);
 }
 
-void ensure_line(struct text *text, uint32_t line) {
-  if (line >= text->nlines) {
-    append_empty_lines(text, line - text->nlines + 1);
-  }
+static void remove_block(struct text *text, uint32_t blocki) {
+  release_block(text->blocks[blocki]);
+  memmove(&text->blocks[blocki], &text->blocks[blocki + 1],
+          sizeof(struct line_block *) * (text->nblocks - blocki - 1));
+  --text->nblocks;
 }
 
-// It is assumed that `data` does not contain any \n, that is handled by
-// higher-level functions
-static void insert_at(struct text *text, uint32_t line, uint32_t offset,
-                      uint8_t *data, uint32_t len) {
+static struct line *line_at(const struct text *text, uint32_t line) {
+  uint64_t local = 0;
+  uint32_t blocki =
+      fenwick_find(text->block_lines, text->nblocks, line, &local);
+  return &text->blocks[blocki]->lines[local];
+}
 
-  if (len == 0) {
-    return;
+static uint8_t *line_bytes(struct line *line);
+static void insert_line_bytes(struct line *line, uint32_t offset,
+                              const uint8_t *data, uint32_t len);
+
+/* Make sure that a block is not shared with any snapshot before modifying it,
+ * by replacing it with a copy of its own if it is.
+ */
+static struct line_block *own_block(struct text *text, uint32_t blocki) {
+  struct line_block *block = text->blocks[blocki];
+  if (__atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) == 1) {
+    block->edited = true;
+    return block;
   }
 
-  ensure_line(text, line);
+  struct line_block *copy = malloc(sizeof(struct line_block));
+  copy->nlines = block->nlines;
+  copy->nbytes = block->nbytes;
+  copy->refs = 1;
+  copy->edited = true;
+  memcpy(copy->lines, block->lines, sizeof(struct line) * block->nlines);
+
+  // slab and inline lines can be shared as they are, everything else needs a
+  // copy of its own. The gaps of shared lines are already closed.
+  for (uint32_t li = 0; li < copy->nlines; ++li) {
+    struct line *line = &copy->lines[li];
+    if (line->flags & (LineBorrowed | LineInline)) {
+      continue;
+    }
 
-  struct line *l = &text->lines[line];
+    *line = empty_line;
+    insert_line_bytes(line, 0, line_bytes(&block->lines[li]),
+                      block->lines[li].nbytes);
+  }
 
-  l->nbytes += len;
-  l->flags = LineChanged;
-  l->data = realloc(l->data, l->nbytes);
+  text->blocks[blocki] = copy;
+  release_block(block);
+  return copy;
+}
 
-  uint32_t bytei = offset;
+/* Get a line to modify it. */
+static struct line *line_at_mut(struct text *text, uint32_t line) {
+  uint64_t local = 0;
+  uint32_t blocki =
+      fenwick_find(text->block_lines, text->nblocks, line, &local);
+  return &own_block(text, blocki)->lines[local];
+}
 
-  // move following bytes out of the way
-  if (bytei + len < l->nbytes) {
-    uint32_t start = bytei + len;
-    memmove(l->data + start, l->data + bytei, l->nbytes - start);
+/* Account for `delta` bytes having been added to (or removed from) a line. The
+ * size of the line itself is updated when editing it.
+ */
+static void add_line_bytes(struct text *text, uint32_t line, int64_t delta) {
+  if (delta == 0) {
+    return;
   }
 
-  // insert new chars
-  memcpy(l->data + bytei, data, len);
+  uint64_t local = 0;
+  uint32_t blocki =
+      fenwick_find(text->block_lines, text->nblocks, line, &local);
+  own_block(text, blocki)->nbytes += delta;
+  fenwick_add(text->block_bytes, text->nblocks, blocki, delta);
 }
 
-uint32_t text_line_size(const struct text *text, uint32_t lineidx) {
-  if (lineidx >= text_num_lines(text)) {
-    return 0;
+static uint64_t block_bytes(const struct line_block *block, uint32_t from,
+                            uint32_t to) {
+  uint64_t nbytes = 0;
+  for (uint32_t li = from; li < to; ++li) {
+    nbytes += block->lines[li].nbytes + 1;
   }
 
-  return text->lines[lineidx].nbytes;
+  return nbytes;
 }
 
-uint32_t text_num_lines(const struct text *text) { return text->nlines; }
+/* Insert an empty line before `line`, which may be equal to the number of
+ * lines to append one.
+ */
+static void insert_line(struct text *text, uint32_t line) {
+  uint32_t blocki = 0;
+  uint64_t local = 0;
+  if (line < text->nlines) {
+    blocki = fenwick_find(text->block_lines, text->nblocks, line, &local);
+  } else if (text->nblocks > 0) {
+    blocki = text->nblocks - 1;
+    local = text->blocks[blocki]->nlines;
+  }
 
-static void split_line(struct text *text, uint32_t offset, uint32_t lineidx,
-                       uint32_t newlineidx) {
-  struct line *line = &text->lines[lineidx];
-  struct line *next = &text->lines[newlineidx];
+  if (text->nblocks == 0) {
+    insert_block(text, 0);
+    rebuild_block_index(text);
+  } else if (text->blocks[blocki]->nlines == LINE_BLOCK_SIZE) {
+    if (local == LINE_BLOCK_SIZE && blocki + 1 == text->nblocks) {
+      // appending, start a new block
+      insert_block(text, ++blocki);
+      local = 0;
+    } else {
+      // split the full block in two halves
+      uint32_t half = LINE_BLOCK_SIZE / 2;
+      insert_block(text, blocki + 1);
+      struct line_block *full = own_block(text, blocki);
+      struct line_block *next = text->blocks[blocki + 1];
+      memcpy(next->lines, &full->lines[half],
+             sizeof(struct line) * (LINE_BLOCK_SIZE - half));
+      next->nlines = LINE_BLOCK_SIZE - half;
+      full->nlines = half;
+      next->nbytes = block_bytes(next, 0, next->nlines);
+      full->nbytes -= next->nbytes;
+
+      if (local > half) {
+        ++blocki;
+        local -= half;
+      }
+    }
 
-  uint8_t *data = line->data;
-  uint32_t nbytes = line->nbytes;
-  uint32_t bytei = offset;
+    rebuild_block_index(text);
+  }
 
-  line->nbytes = bytei;
-  next->nbytes = nbytes - bytei;
-  line->flags = next->flags = line->flags;
+  struct line_block *block = own_block(text, blocki);
+  memmove(&block->lines[local + 1], &block->lines[local],
+          sizeof(struct line) * (block->nlines - local));
+  block->lines[local] = empty_line;
+  ++block->nlines;
+  ++block->nbytes;
+  fenwick_add(text->block_lines, text->nblocks, blocki, 1);
+  fenwick_add(text->block_bytes, text->nblocks, blocki, 1);
+  ++text->nlines;
+}
 
-  next->data = NULL;
-  line->data = NULL;
+/* Remove a line from the line table. The line data is not freed. */
+static void remove_line(struct text *text, uint32_t line) {
+  uint64_t local = 0;
+  uint32_t blocki =
+      fenwick_find(text->block_lines, text->nblocks, line, &local);
+  struct line_block *block = own_block(text, blocki);
+  uint32_t nbytes = block->lines[local].nbytes + 1;
+
+  memmove(&block->lines[local], &block->lines[local + 1],
+          sizeof(struct line) * (block->nlines - local - 1));
+  --block->nlines;
+  block->nbytes -= nbytes;
+  --text->nlines;
 
-  // first, handle some cases where the new line or the pre-existing one is
-  // empty
-  if (next->nbytes == 0) {
-    line->data = data;
-  } else if (line->nbytes == 0) {
-    next->data = data;
+  if (block->nlines == 0) {
+    remove_block(text, blocki);
+    rebuild_block_index(text);
   } else {
-    // actually split the line
-    next->data = (uint8_t *)realloc(next->data, next->nbytes);
-    memcpy(next->data, data + bytei, next->nbytes);
-
-    line->data = (uint8_t *)realloc(line->data, line->nbytes);
-    memcpy(line->data, data, line->nbytes);
-
-    free(data);
+    fenwick_add(text->block_lines, text->nblocks, blocki, -1);
+    fenwick_add(text->block_bytes, text->nblocks, blocki, -(int64_t)nbytes);
   }
 }
 
-void mark_lines_changed(struct text *text, uint32_t line, uint32_t nlines) {
-  for (uint32_t linei = line; linei < (line + nlines); ++linei) {
-    text->lines[linei].flags |= LineChanged;
-  }
+static uint8_t *line_heap(const struct line *line) {
+  uint8_t *heap;
+  memcpy(&heap, line->data, sizeof(heap));
+  return heap;
 }
 
-void shift_lines(struct text *text, uint32_t start, int32_t direction) {
-  struct line *dest = &text->lines[((int64_t)start + direction)];
-  struct line *src = &text->lines[start];
-  uint32_t nlines = text->nlines - (dest > src ? (start + direction) : start);
-  memmove(dest, src, nlines * sizeof(struct line));
+static void set_line_heap(struct line *line, uint8_t *heap) {
+  memcpy(line->data, &heap, sizeof(heap));
 }
 
-void new_line_at(struct text *text, uint32_t line, uint32_t offset) {
-  ensure_line(text, line);
+// if the line has a line buffer
+static bool line_owned(const struct line *line) {
+  return (line->flags & (LineBorrowed | LineInline | LineExact)) == 0;
+}
 
-  uint32_t newline = line + 1;
-  append_empty_lines(text, 1);
+static struct line_buffer *line_buffer(const struct line *line) {
+  return (struct line_buffer *)line_heap(line);
+}
 
-  mark_lines_changed(text, line, text->nlines - line);
+static void move_gap(struct line *line, uint32_t offset) {
+  struct line_buffer *buf = line_buffer(line);
+  uint32_t gaplen = buf->capacity - line->nbytes;
 
-  // move following lines out of the way, if there are any
-  if (newline + 1 < text->nlines) {
-    shift_lines(text, newline, 1);
+  if (gaplen > 0 && offset < buf->gap) {
+    memmove(buf->bytes + offset + gaplen, buf->bytes + offset,
+            buf->gap - offset);
+  } else if (gaplen > 0 && offset > buf->gap) {
+    memmove(buf->bytes + buf->gap, buf->bytes + buf->gap + gaplen,
+            offset - buf->gap);
   }
 
-  // split line if needed
-  split_line(text, offset, line, newline);
+  buf->gap = offset;
 }
 
-void delete_line(struct text *text, uint32_t line) {
-  if (text->nlines == 0) {
-    return;
+/* Get a pointer to the bytes of a line from `offset` to the end of the line,
+ * moving the gap out of the way if needed. This does not change the contents
+ * of the line.
+ */
+static uint8_t *line_tail(struct line *line, uint32_t offset) {
+  if (line->flags & LineInline) {
+    return line->data + offset;
+  } else if (line->flags & (LineBorrowed | LineExact)) {
+    return line_heap(line) + offset;
   }
 
-  mark_lines_changed(text, line, text->nlines - line);
+  // move the gap to whichever side of the tail is closest
+  struct line_buffer *buf = line_buffer(line);
+  if (buf->gap > offset && buf->gap - offset < line->nbytes - buf->gap) {
+    move_gap(line, offset);
+  } else if (buf->gap > offset) {
+    move_gap(line, line->nbytes);
+    return buf->bytes + offset;
+  }
 
-  free(text->lines[line].data);
-  text->lines[line].data = NULL;
+  return buf->bytes + offset + (buf->capacity - line->nbytes);
+}
 
-  if (line + 1 < text->nlines) {
-    shift_lines(text, line + 1, -1);
+/* Get a pointer to the bytes of a line to read them. This closes the gap but
+ * does not change the contents of the line.
+ */
+static uint8_t *line_bytes(struct line *line) {
+  if (!line_owned(line)) {
+    return line_tail(line, 0);
   }
 
-  --text->nlines;
-  text->lines[text->nlines].data = NULL;
-  text->lines[text->nlines].nbytes = 0;
+  // the gaps of lines in blocks shared with snapshots are closed, so reading
+  // them does not write anything
+  if (line_buffer(line)->gap != line->nbytes) {
+    move_gap(line, line->nbytes);
+    line->flags |= LineRead;
+  }
+  return line_buffer(line)->bytes;
 }
 
-static void text_insert_at_inner(struct text *text, uint32_t line,
-                                 uint32_t offset, uint8_t *bytes,
-                                 uint32_t nbytes, uint32_t *lines_added) {
-  uint32_t linelen = 0, start_line = line;
+/* Get the bytes of a line as the parts before and after the gap, without
+ * closing it. Reading a line that is being edited this way does not move the
+ * bytes after the edit point. Lines without a gap only have a first part.
+ */
+static uint8_t *line_parts(struct line *line, uint32_t *nfirst,
+                           uint8_t **second, uint32_t *nsecond) {
+  if (!line_owned(line)) {
+    *nfirst = line->nbytes;
+    *second = NULL;
+    *nsecond = 0;
+    return line_tail(line, 0);
+  }
 
-  for (uint32_t bytei = 0; bytei < nbytes; ++bytei) {
-    uint8_t byte = bytes[bytei];
-    if (byte == '\n') {
-      uint8_t *line_data = bytes + (bytei - linelen);
-      insert_at(text, line, offset, line_data, linelen);
+  struct line_buffer *buf = line_buffer(line);
+  *nfirst = buf->gap;
+  *second = buf->bytes + buf->capacity - (line->nbytes - buf->gap);
+  *nsecond = line->nbytes - buf->gap;
+  return buf->bytes;
+}
 
-      offset += linelen;
-      new_line_at(text, line, offset);
+/* Call `callback` for the bytes from `from` to `to` of a line, in one span for
+ * each side of the gap that they cover.
+ */
+static void line_spans(struct line *line, uint32_t from, uint32_t to,
+                       span_cb callback, void *userdata) {
+  uint32_t nfirst, nsecond;
+  uint8_t *second;
+  uint8_t *first = line_parts(line, &nfirst, &second, &nsecond);
+
+  if (from < nfirst) {
+    callback(first + from, (to < nfirst ? to : nfirst) - from, userdata);
+  }
 
-      ++line;
-      linelen = 0;
-      offset = 0;
-    } else {
-      ++linelen;
-    }
+  if (to > nfirst) {
+    uint32_t start = from > nfirst ? from : nfirst;
+    callback(second + (start - nfirst), to - start, userdata);
   }
+}
 
-  // handle remaining
-  if (linelen > 0) {
-    uint8_t *line_data = bytes + (nbytes - linelen);
-    insert_at(text, line, offset, line_data, linelen);
+static void free_line_data(struct line *line) {
+  if (line_owned(line) || (line->flags & LineExact)) {
+    free(line_heap(line));
   }
 
-  *lines_added = line - start_line;
+  uint32_t nbytes = line->nbytes;
+  *line = empty_line;
+  line->nbytes = nbytes;
 }
 
-void text_append(struct text *text, uint8_t *bytes, uint32_t nbytes,
-                 uint32_t *lines_added) {
-  uint32_t line = text->nlines > 0 ? text->nlines - 1 : 0;
-  uint32_t offset = text_line_size(text, line);
-  text_insert_at_inner(text, line, offset, bytes, nbytes, lines_added);
-}
+/* Make sure that a line has a line buffer with room for at least `nbytes`
+ * bytes. The first buffer is exactly as large as needed since most lines are
+ * never edited again, after that it grows geometrically.
+ */
+static void reserve_line(struct line *line, uint32_t nbytes) {
+  uint32_t capacity = line_owned(line) ? line_buffer(line)->capacity : 0;
+  if (line_owned(line) && capacity >= nbytes) {
+    return;
+  }
 
-void text_insert_at(struct text *text, uint32_t line, uint32_t offset,
-                    uint8_t *bytes, uint32_t nbytes, uint32_t *lines_added) {
-  text_insert_at_inner(text, line, offset, bytes, nbytes, lines_added);
-}
+  capacity *= 2;
+  if (capacity < nbytes) {
+    capacity = nbytes;
+  }
 
-void text_delete(struct text *text, uint32_t start_line, uint32_t start_offset,
-                 uint32_t end_line, uint32_t end_offset) {
+  struct line_buffer *buf = NULL;
+  if (line_owned(line)) {
+    move_gap(line, line->nbytes);
+    buf = (struct line_buffer *)realloc(
+        line_buffer(line), sizeof(struct line_buffer) + capacity);
+  } else {
+    buf = (struct line_buffer *)malloc(sizeof(struct line_buffer) + capacity);
+    if (line->nbytes > 0) {
+      memcpy(buf->bytes, line_bytes(line), line->nbytes);
+    }
 
-  if (text->nlines == 0) {
-    return;
+    if (line->flags & LineExact) {
+      free(line_heap(line));
+    }
+    line->flags = 0;
   }
 
-  uint32_t maxline = text->nlines > 0 ? text->nlines - 1 : 0;
+  buf->capacity = capacity;
+  buf->gap = line->nbytes;
+  set_line_heap(line, (uint8_t *)buf);
+}
 
-  if (start_line > maxline) {
+static void insert_line_bytes(struct line *line, uint32_t offset,
+                              const uint8_t *data, uint32_t len) {
+  uint32_t nbytes = line->nbytes + len;
+  if ((line->flags & LineInline) && nbytes <= LINE_INLINE_SIZE) {
+    memmove(line->data + offset + len, line->data + offset,
+            line->nbytes - offset);
+    memcpy(line->data + offset, data, len);
+    line->nbytes = nbytes;
     return;
   }
 
-  if (end_line > maxline) {
-    end_line = maxline;
-    end_offset = text_line_size(text, end_line);
+  // whole lines that are pasted or appended are often never edited again
+  if (line->nbytes == 0 && !line_owned(line)) {
+    uint8_t *heap = (uint8_t *)malloc(len);
+    memcpy(heap, data, len);
+    set_line_heap(line, heap);
+    line->flags = LineExact;
+    line->nbytes = len;
+    return;
   }
 
-  struct line *firstline = &text->lines[start_line];
-  struct line *lastline = &text->lines[end_line];
+  reserve_line(line, nbytes);
 
-  // clamp column
-  uint32_t firstline_len = text_line_size(text, start_line);
-  if (start_offset > firstline_len) {
-    start_offset = firstline_len > 0 ? firstline_len - 1 : 0;
+  struct line_buffer *buf = line_buffer(line);
+  if ((line->flags & LineRead) && buf->gap == line->nbytes) {
+    memmove(buf->bytes + offset + len, buf->bytes + offset,
+            line->nbytes - offset);
+    buf->gap = nbytes;
+  } else {
+    move_gap(line, offset);
+    buf->gap += len;
   }
 
-  // handle deletion of newlines
-  uint32_t lastline_len = text_line_size(text, end_line);
-  if (end_offset > lastline_len) {
-    if (end_line + 1 < text->nlines) {
-      end_offset = 0;
-      ++end_line;
-      lastline = &text->lines[end_line];
-    } else {
-      end_offset = lastline_len;
-    }
+  memcpy(buf->bytes + offset, data, len);
+  line->nbytes = nbytes;
+  line->flags &= ~LineRead;
+}
+
+static void erase_line_bytes(struct line *line, uint32_t offset,
+                             uint32_t len) {
+  if (len == 0) {
+    return;
   }
 
-  uint32_t srcbytei = end_offset;
-  uint32_t dstbytei = start_offset;
-  uint32_t ncopy = lastline->nbytes - srcbytei;
-  if (lastline == firstline) {
-    // in this case we can "overwrite"
-    memmove(firstline->data + dstbytei, lastline->data + srcbytei, ncopy);
-  } else {
-    // otherwise we actually have to copy from the last line
-    insert_at(text, start_line, start_offset, lastline->data + srcbytei, ncopy);
+  uint32_t nbytes = line->nbytes - len;
+  if (line->flags & LineInline) {
+    memmove(line->data + offset, line->data + offset + len, nbytes - offset);
+    // keep the unused part zeroed
+    memset(line->data + nbytes, 0, LINE_INLINE_SIZE - nbytes);
+    line->nbytes = nbytes;
+    return;
   }
 
-  // new byte count is whatever we had before (left of dstbytei)
-  // plus what we copied
-  firstline->nbytes = dstbytei + ncopy;
+  if (line->flags & (LineBorrowed | LineExact)) {
+    // what is left might still be in one piece
+    if (offset == 0 && (line->flags & LineBorrowed)) {
+      set_line_heap(line, line_heap(line) + len);
+      line->nbytes = nbytes;
+      return;
+    } else if (offset == nbytes && nbytes > LINE_INLINE_SIZE) {
+      line->nbytes = nbytes;
+      return;
+    }
 
-  // delete full lines, backwards to not shift old, crappy data upwards
-  for (uint32_t linei = end_line >= text->nlines ? end_line - 1 : end_line;
-       linei > start_line; --linei) {
-    delete_line(text, linei);
+    reserve_line(line, line->nbytes);
   }
 
-  // if this is the last line in the buffer, and it turns out empty, remove it
-  if (firstline->nbytes == 0 && start_line == text->nlines - 1) {
-    delete_line(text, start_line);
+  struct line_buffer *buf = line_buffer(line);
+  if ((line->flags & LineRead) && buf->gap == line->nbytes) {
+    memmove(buf->bytes + offset, buf->bytes + offset + len, nbytes - offset);
+    buf->gap = nbytes;
+  } else {
+    // removing bytes right after the gap only makes it larger
+    move_gap(line, offset);
+  }
+
+  line->nbytes = nbytes;
+  line->flags &= ~LineRead;
+
+  if (nbytes <= LINE_INLINE_SIZE) {
+    move_gap(line, nbytes);
+    memset(line->data, 0, LINE_INLINE_SIZE);
+    memcpy(line->data, buf->bytes, nbytes);
+    line->flags = LineInline;
+    free(buf);
+  } else if (buf->capacity > nbytes * 4) {
+    move_gap(line, nbytes);
+    buf->capacity = nbytes * 2;
+    set_line_heap(line, realloc(buf, sizeof(struct line_buffer) +
+                                         buf->capacity));
   }
 }
 
-void text_for_each_chunk(struct text *text, chunk_cb callback, void *userdata) {
-  // if representation of text is changed, this can be changed as well
-  text_for_each_line(text, 0, text->nlines, callback, userdata);
+static void release_slab(uint8_t *bytes, uint64_t size, bool mapped) {
+  if (mapped) {
+    munmap(bytes, size);
+  } else {
+    free(bytes);
+  }
 }
 
-void text_for_each_line(struct text *text, uint32_t line, uint32_t nlines,
-                        chunk_cb callback, void *userdata) {
-  uint32_t nlines_max =
-      (line + nlines) > text->nlines ? text->nlines : (line + nlines);
-  for (uint32_t li = line; li < nlines_max; ++li) {
-    struct line *src_line = &text->lines[li];
-    struct text_chunk line = (struct text_chunk){
-        .allocated = false,
-        .text = src_line->data,
-        .nbytes = src_line->nbytes,
-        .line = li,
-    };
-    callback(&line, userdata);
+static void unref_slab(struct slab *slab) {
+  if (slab == NULL ||
+      __atomic_sub_fetch(&slab->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
   }
+
+  release_slab(slab->bytes, slab->size, slab->mapped);
+  free(slab);
 }
 
-struct text_chunk text_get_line(struct text *text, uint32_t line) {
-  struct line *src_line = &text->lines[line];
-  return (struct text_chunk){
-      .text = src_line->data,
-      .nbytes = src_line->nbytes,
-      .line = line,
-      .allocated = false,
-  };
+static void free_lines(struct text *text) {
+  for (uint32_t bi = 0; bi < text->nblocks; ++bi) {
+    release_block(text->blocks[bi]);
+  }
+
+  unref_slab(text->slab);
+  text->slab = NULL;
+  text->nblocks = 0;
+  text->nlines = 0;
 }
 
-struct copy_cmd {
-  uint32_t line;
-  uint32_t byteoffset;
-  uint32_t nbytes;
-};
+struct text *text_create(uint32_t initial_capacity,
+                         enum text_storage storage) {
+  struct text *txt = calloc(1, sizeof(struct text));
+  txt->storage = storage;
+  txt->nlines = 0;
+  txt->nblocks = 0;
+  txt->slab = NULL;
+  txt->mapping = NULL;
+  txt->mapping_index = NULL;
+  txt->generation = 0;
+  txt->changes_first = txt->nchanges = 0;
+  txt->dropped_changes = (struct change_entry){0};
+
+  if (storage == TextStorage_PieceTable) {
+    txt->pieces = piece_tree_create();
+    txt->blocks = NULL;
+    txt->block_lines = NULL;
+    txt->block_bytes = NULL;
+    txt->blocks_capacity = 0;
+  } else {
+    txt->pieces = NULL;
+    txt->blocks_capacity = initial_capacity / LINE_BLOCK_SIZE + 1;
+    txt->blocks = calloc(txt->blocks_capacity, sizeof(struct line_block *));
+    txt->block_lines = calloc(txt->blocks_capacity, sizeof(uint64_t));
+    txt->block_bytes = calloc(txt->blocks_capacity, sizeof(uint64_t));
+  }
 
-struct text_chunk text_get_region(struct text *text, uint32_t start_line,
-                                  uint32_t start_offset, uint32_t end_line,
-                                  uint32_t end_offset) {
-  if (start_line == end_line && start_offset == end_offset) {
-    return (struct text_chunk){0};
+  VEC_INIT(&txt->properties, 32);
+  VEC_INIT(&txt->property_index, 32);
+  txt->property_index_valid = true;
+  txt->properties_generation = 0;
+  txt->markers = marker_tree_create();
+
+  return txt;
+}
+
+/* Record that lines [start_line, end_line) have changed, as a new generation.
+ * An end_line of UINT32_MAX means to the end of the text.
+ */
+static void record_change(struct text *text, uint32_t start_line,
+                          uint32_t end_line) {
+  ++text->generation;
+
+  // typing on the same line over and over is one change
+  if (text->nchanges > 0) {
+    struct change_entry *last =
+        &text->changes[(text->changes_first + text->nchanges - 1) %
+                       CHANGE_HISTORY_SIZE];
+    if (start_line == last->change.start_line &&
+        end_line == last->change.end_line) {
+      last->generation = text->generation;
+      return;
+    }
   }
 
-  struct line *first_line = &text->lines[start_line];
-  struct line *last_line = &text->lines[end_line];
-  uint32_t first_line_len = first_line->nbytes;
-  uint32_t last_line_len = last_line->nbytes;
+  if (text->nchanges == CHANGE_HISTORY_SIZE) {
+    struct change_entry *oldest = &text->changes[text->changes_first];
+    struct change_entry *dropped = &text->dropped_changes;
+    if (dropped->generation == 0) {
+      *dropped = *oldest;
+    } else {
+      dropped->generation = oldest->generation;
+      if (oldest->change.start_line < dropped->change.start_line) {
+        dropped->change.start_line = oldest->change.start_line;
+      }
+      if (oldest->change.end_line > dropped->change.end_line) {
+        dropped->change.end_line = oldest->change.end_line;
+      }
+    }
 
-  if (start_offset > first_line_len) {
-    return (struct text_chunk){0};
+    text->changes_first = (text->changes_first + 1) % CHANGE_HISTORY_SIZE;
+    --text->nchanges;
   }
 
-  // handle copying of newlines
-  if (end_offset > last_line_len) {
-    ++end_line;
-    end_offset = 0;
-    last_line = &text->lines[end_line];
+  text->changes[(text->changes_first + text->nchanges) % CHANGE_HISTORY_SIZE] =
+      (struct change_entry){
+          .generation = text->generation,
+          .change = {.start_line = start_line, .end_line = end_line},
+      };
+  ++text->nchanges;
+}
+
+static void release_mapping(struct text *text) {
+  if (text->mapping == NULL) {
+    return;
   }
 
-  uint32_t nlines = end_line - start_line + 1;
-  struct copy_cmd *copy_cmds = calloc(nlines, sizeof(struct copy_cmd));
+  line_index_destroy(text->mapping_index);
+  munmap(text->mapping, text->mapping_size);
+  text->mapping_index = NULL;
+  text->mapping = NULL;
+  text->mapping_size = text->mapping_nbytes = 0;
+}
 
-  uint32_t total_bytes = 0;
-  for (uint32_t line = start_line; line <= end_line; ++line) {
-    struct line *l = &text->lines[line];
-    total_bytes += l->nbytes;
+void text_destroy(struct text *text) {
+  VEC_DESTROY(&text->properties);
+  VEC_DESTROY(&text->property_index);
+  marker_tree_destroy(text->markers);
+  release_mapping(text);
 
-    struct copy_cmd *cmd = &copy_cmds[line - start_line];
-    cmd->line = line;
-    cmd->byteoffset = 0;
-    cmd->nbytes = l->nbytes;
+  if (text->pieces != NULL) {
+    piece_tree_destroy(text->pieces);
+    text->pieces = NULL;
   }
 
-  // correct first line
-  struct copy_cmd *cmd_first = &copy_cmds[0];
-  cmd_first->byteoffset += start_offset;
-  cmd_first->nbytes -= start_offset;
-  total_bytes -= start_offset;
+  free_lines(text);
+  free(text->blocks);
+  free(text->block_lines);
+  free(text->block_bytes);
+  free(text);
+}
 
-  // correct last line
-  struct copy_cmd *cmd_last = &copy_cmds[nlines - 1];
-  cmd_last->nbytes -= (last_line->nbytes - end_offset);
-  total_bytes -= (last_line->nbytes - end_offset);
+void text_clear(struct text *text) {
+  bool empty = text_num_lines(text) == 0;
+  release_mapping(text);
 
-  uint8_t *data = (uint8_t *)malloc(
-      total_bytes + /* nr of newline chars */ (end_line - start_line));
+  if (text->storage == TextStorage_PieceTable) {
+    piece_tree_clear(text->pieces);
+  }
 
-  // copy data
-  for (uint32_t cmdi = 0, curr = 0; cmdi < nlines; ++cmdi) {
-    struct copy_cmd *c = &copy_cmds[cmdi];
-    struct line *l = &text->lines[c->line];
-    memcpy(data + curr, l->data + c->byteoffset, c->nbytes);
-    curr += c->nbytes;
+  free_lines(text);
+  text_clear_properties(text);
+  marker_tree_delete(text->markers, 0, UINT64_MAX);
 
-    if (cmdi != (nlines - 1)) {
-      data[curr] = '\n';
-      ++curr;
-      ++total_bytes;
-    }
+  if (!empty) {
+    record_change(text, 0, UINT32_MAX);
   }
+}
 
-  free(copy_cmds);
-  return (struct text_chunk){
-      .text = data,
-      .line = 0,
-      .nbytes = total_bytes,
+/* Mapped storage
+ *
+ * Lines are served straight from a read-only file mapping, using a line index
+ * that is built in the background. Before the first modification the text is
+ * converted to the normal storage, with lines pointing into the mapping until
+ * they are modified.
+ */
+#define MAPPED_SYNC_LINES 4096
+
+/* The number of lines indexed so far, which is the number of lines in the
+ * whole file once the index is done.
+ */
+static uint32_t mapped_num_lines(const struct text *text) {
+  return text->mapping_nbytes > 0 ? line_index_nlines(text->mapping_index) : 0;
+}
+
+static struct text_chunk mapped_get_line(const struct text *text,
+                                         uint32_t line) {
+  uint64_t start, end;
+  if (text->mapping_nbytes == 0 ||
+      !line_index_line(text->mapping_index, line, &start, &end)) {
+    return (struct text_chunk){.line = line};
+  }
+
+  return (struct text_chunk){
+      .text = end > start ? text->mapping + start : NULL,
+      .nbytes = end - start,
+      .line = line,
+      .allocated = false,
+  };
+}
+
+static void load_slab(struct text *text, uint8_t *bytes, uint64_t nbytes,
+                      uint64_t size, bool mapped);
+
+static void unmap_text(struct text *text) {
+  if (text->mapping == NULL) {
+    return;
+  }
+
+  uint8_t *bytes = text->mapping;
+  uint64_t nbytes = text->mapping_nbytes, size = text->mapping_size;
+
+  line_index_destroy(text->mapping_index);
+  text->mapping_index = NULL;
+  text->mapping = NULL;
+  text->mapping_size = text->mapping_nbytes = 0;
+
+  load_slab(text, bytes, nbytes, size, true);
+}
+
+/* Piece table storage
+ *
+ * Lines are not stored explicitly, instead they are looked up in the newline
+ * index of the piece tree. The functions below mirror the behavior of the line
+ * based functions further down.
+ */
+static uint32_t pieces_num_lines(const struct text *text) {
+  if (piece_tree_size(text->pieces) == 0) {
+    return 0;
+  }
+
+  return piece_tree_newlines(text->pieces) + 1;
+}
+
+static uint32_t pieces_line_size(const struct text *text, uint32_t lineidx) {
+  uint32_t nlines = pieces_num_lines(text);
+  if (lineidx >= nlines) {
+    return 0;
+  }
+
+  uint64_t start = piece_tree_line_offset(text->pieces, lineidx);
+  uint64_t end = lineidx + 1 < nlines
+                     ? piece_tree_line_offset(text->pieces, lineidx + 1) - 1
+                     : piece_tree_size(text->pieces);
+  return end - start;
+}
+
+static struct text_chunk pieces_get_line(const struct text *text,
+                                         uint32_t line) {
+  uint32_t nbytes = pieces_line_size(text, line);
+  uint8_t *data = NULL;
+  if (nbytes > 0) {
+    data = (uint8_t *)piece_tree_contiguous(
+        text->pieces, piece_tree_line_offset(text->pieces, line), nbytes);
+  }
+
+  return (struct text_chunk){
+      .text = data,
+      .nbytes = nbytes,
+      .line = line,
+      .allocated = false,
+  };
+}
+
+static void pieces_insert_at(struct text *text, uint32_t line, uint32_t offset,
+                             uint8_t *bytes, uint32_t nbytes,
+                             uint32_t *lines_added) {
+  *lines_added = 0;
+  for (uint32_t bytei = 0; bytei < nbytes; ++bytei) {
+    if (bytes[bytei] == '\n') {
+      ++(*lines_added);
+    }
+  }
+
+  if (nbytes == 0) {
+    return;
+  }
+
+  // pad with empty lines if inserting past the end
+  uint32_t nlines = pieces_num_lines(text);
+  if (line >= nlines) {
+    uint32_t npad = nlines == 0 ? line : line - nlines + 1;
+    if (npad > 0) {
+      uint8_t *pad = malloc(npad);
+      memset(pad, '\n', npad);
+      piece_tree_insert(text->pieces, piece_tree_size(text->pieces), pad,
+                        npad);
+      free(pad);
+    }
+    offset = 0;
+  } else {
+    uint32_t linelen = pieces_line_size(text, line);
+    offset = offset > linelen ? linelen : offset;
+  }
+
+  piece_tree_insert(text->pieces,
+                    piece_tree_line_offset(text->pieces, line) + offset, bytes,
+                    nbytes);
+}
+
+static void pieces_delete(struct text *text, uint32_t start_line,
+                          uint32_t start_offset, uint32_t end_line,
+                          uint32_t end_offset) {
+  uint64_t start =
+      piece_tree_line_offset(text->pieces, start_line) + start_offset;
+  uint64_t end = piece_tree_line_offset(text->pieces, end_line) + end_offset;
+  if (end > start) {
+    piece_tree_delete(text->pieces, start, end - start);
+  }
+
+  // if this is the last line in the buffer, and it turns out empty, remove it
+  uint32_t nlines = pieces_num_lines(text);
+  if (start_line > 0 && start_line == nlines - 1 &&
+      pieces_line_size(text, start_line) == 0) {
+    piece_tree_delete(text->pieces, piece_tree_size(text->pieces) - 1, 1);
+  }
+}
+
+struct utf8_codepoint_iterator
+text_line_codepoint_iterator(const struct text *text, uint32_t lineidx) {
+  if (text->mapping != NULL) {
+    struct text_chunk line = mapped_get_line(text, lineidx);
+    return create_utf8_codepoint_iterator(line.text, line.nbytes, 0);
+  }
+
+  if (lineidx >= text_num_lines(text)) {
+    return create_utf8_codepoint_iterator(NULL, 0, 0);
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    struct text_chunk line = pieces_get_line(text, lineidx);
+    return create_utf8_codepoint_iterator(line.text, line.nbytes, 0);
+  }
+
+  uint32_t nfirst, nsecond;
+  uint8_t *second;
+  uint8_t *first =
+      line_parts(line_at(text, lineidx), &nfirst, &second, &nsecond);
+  return create_utf8_split_codepoint_iterator(first, nfirst, second, nsecond);
+}
+
+struct utf8_codepoint_iterator
+text_chunk_codepoint_iterator(const struct text_chunk *chunk) {
+  return create_utf8_codepoint_iterator(chunk->text, chunk->nbytes, 0);
+}
+
+void append_empty_lines(struct text *text, uint32_t numlines) {
+  for (uint32_t i = 0; i < numlines; ++i) {
+    insert_line(text, text->nlines);
+  }
+}
+
+void ensure_line(struct text *text, uint32_t line) {
+  if (line >= text->nlines) {
+    append_empty_lines(text, line - text->nlines + 1);
+  }
+}
+
+// It is assumed that `data` does not contain any \n, that is handled by
+// higher-level functions
+static void insert_at(struct text *text, uint32_t line, uint32_t offset,
+                      uint8_t *data, uint32_t len) {
+
+  if (len == 0) {
+    return;
+  }
+
+  ensure_line(text, line);
+
+  struct line *l = line_at_mut(text, line);
+
+  insert_line_bytes(l, offset, data, len);
+  add_line_bytes(text, line, len);
+}
+
+uint32_t text_line_size(const struct text *text, uint32_t lineidx) {
+  if (text->mapping != NULL) {
+    return mapped_get_line(text, lineidx).nbytes;
+  }
+
+  if (lineidx >= text_num_lines(text)) {
+    return 0;
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    return pieces_line_size(text, lineidx);
+  }
+
+  return line_at(text, lineidx)->nbytes;
+}
+
+uint32_t text_num_lines(const struct text *text) {
+  if (text->mapping != NULL) {
+    return mapped_num_lines(text);
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    return pieces_num_lines(text);
+  }
+
+  return text->nlines;
+}
+
+bool text_num_lines_known(const struct text *text) {
+  return text->mapping == NULL || text->mapping_nbytes == 0 ||
+         line_index_done(text->mapping_index);
+}
+
+uint32_t text_wait_num_lines(struct text *text) {
+  if (text->mapping != NULL && text->mapping_nbytes > 0) {
+    line_index_wait(text->mapping_index);
+  }
+
+  return text_num_lines(text);
+}
+
+static uint64_t text_size(const struct text *text) {
+  if (text->mapping != NULL) {
+    return text->mapping_nbytes;
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    return piece_tree_size(text->pieces);
+  }
+
+  // every line but the last is followed by a newline
+  return text->nlines > 0 ? fenwick_sum(text->block_bytes, text->nblocks) - 1
+                          : 0;
+}
+
+uint64_t text_line_offset(const struct text *text, uint32_t lineidx) {
+  uint64_t start, end;
+  if (text->mapping != NULL) {
+    return text->mapping_nbytes > 0 && line_index_line(text->mapping_index,
+                                                       lineidx, &start, &end)
+               ? start
+               : text->mapping_nbytes;
+  }
+
+  if (lineidx >= text_num_lines(text)) {
+    return text_size(text);
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    return piece_tree_line_offset(text->pieces, lineidx);
+  }
+
+  uint64_t local = 0;
+  uint32_t blocki =
+      fenwick_find(text->block_lines, text->nblocks, lineidx, &local);
+  return fenwick_sum(text->block_bytes, blocki) +
+         block_bytes(text->blocks[blocki], 0, local);
+}
+
+struct location text_offset_location(const struct text *text,
+                                     uint64_t offset) {
+  if (text->mapping != NULL && text->mapping_nbytes > 0 &&
+      offset < text->mapping_nbytes) {
+    uint32_t line = line_index_line_at(text->mapping_index, offset);
+    return (struct location){
+        .line = line,
+        .col = offset - text_line_offset(text, line),
+    };
+  } else if (text->mapping != NULL) {
+    // need to know the last line
+    line_index_wait(text->mapping_index);
+  }
+
+  uint32_t nlines = text_num_lines(text);
+  if (nlines == 0) {
+    return (struct location){.line = 0, .col = 0};
+  }
+
+  if (offset >= text_size(text)) {
+    return (struct location){.line = nlines - 1,
+                             .col = text_line_size(text, nlines - 1)};
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    uint32_t line = piece_tree_line_at(text->pieces, offset);
+    return (struct location){
+        .line = line,
+        .col = offset - piece_tree_line_offset(text->pieces, line),
+    };
+  }
+
+  uint64_t rest = 0;
+  uint32_t blocki =
+      fenwick_find(text->block_bytes, text->nblocks, offset, &rest);
+  struct line_block *block = text->blocks[blocki];
+
+  uint32_t local = 0;
+  while (rest > block->lines[local].nbytes) {
+    rest -= block->lines[local].nbytes + 1;
+    ++local;
+  }
+
+  return (struct location){
+      .line = fenwick_sum(text->block_lines, blocki) + local,
+      .col = rest,
+  };
+}
+
+static void split_line(struct text *text, uint32_t offset, uint32_t lineidx,
+                       uint32_t newlineidx) {
+  struct line *line = line_at_mut(text, lineidx);
+  struct line *next = line_at_mut(text, newlineidx);
+
+  uint32_t nbytes = line->nbytes;
+  uint32_t bytei = offset;
+
+  // first, handle some cases where the new line or the pre-existing one is
+  // empty
+  if (bytei == nbytes) {
+    // nothing to move
+  } else if (bytei == 0) {
+    *next = *line;
+    *line = empty_line;
+  } else if (line->flags & LineBorrowed) {
+    // both halves are still in the slab, no need to copy anything
+    set_line_heap(next, line_heap(line) + bytei);
+    next->flags = LineBorrowed;
+  } else {
+    // actually split the line
+    insert_line_bytes(next, 0, line_tail(line, bytei), nbytes - bytei);
+    erase_line_bytes(line, bytei, nbytes - bytei);
+  }
+
+  line->nbytes = bytei;
+  next->nbytes = nbytes - bytei;
+  add_line_bytes(text, lineidx, -(int64_t)(nbytes - bytei));
+  add_line_bytes(text, newlineidx, nbytes - bytei);
+}
+
+void new_line_at(struct text *text, uint32_t line, uint32_t offset) {
+  ensure_line(text, line);
+
+  uint32_t newline = line + 1;
+  insert_line(text, newline);
+
+  // split line if needed
+  split_line(text, offset, line, newline);
+}
+
+void delete_line(struct text *text, uint32_t line) {
+  if (text->nlines == 0) {
+    return;
+  }
+
+  free_line_data(line_at_mut(text, line));
+  remove_line(text, line);
+}
+
+static void text_insert_at_inner(struct text *text, uint32_t line,
+                                 uint32_t offset, uint8_t *bytes,
+                                 uint32_t nbytes, uint32_t *lines_added) {
+  uint32_t linelen = 0, start_line = line;
+
+  for (uint32_t bytei = 0; bytei < nbytes; ++bytei) {
+    uint8_t byte = bytes[bytei];
+    if (byte == '\n') {
+      uint8_t *line_data = bytes + (bytei - linelen);
+      insert_at(text, line, offset, line_data, linelen);
+
+      offset += linelen;
+      new_line_at(text, line, offset);
+
+      ++line;
+      linelen = 0;
+      offset = 0;
+    } else {
+      ++linelen;
+    }
+  }
+
+  // handle remaining
+  if (linelen > 0) {
+    uint8_t *line_data = bytes + (nbytes - linelen);
+    insert_at(text, line, offset, line_data, linelen);
+  }
+
+  *lines_added = line - start_line;
+}
+
+void text_append(struct text *text, uint8_t *bytes, uint32_t nbytes,
+                 uint32_t *lines_added) {
+  uint32_t nlines = text_num_lines(text);
+  uint32_t line = nlines > 0 ? nlines - 1 : 0;
+  uint32_t offset = text_line_size(text, line);
+  text_insert_at(text, line, offset, bytes, nbytes, lines_added);
+}
+
+static void load_line(struct text *text, uint8_t *data, uint32_t nbytes) {
+  struct line_block *block =
+      text->nblocks > 0 ? text->blocks[text->nblocks - 1] : NULL;
+  if (block == NULL || block->nlines == LINE_BLOCK_SIZE) {
+    insert_block(text, text->nblocks);
+    block = text->blocks[text->nblocks - 1];
+  }
+
+  struct line *line = &block->lines[block->nlines];
+  *line = empty_line;
+  if (nbytes > 0) {
+    set_line_heap(line, data);
+    line->flags = LineBorrowed;
+    line->nbytes = nbytes;
+  }
+  ++block->nlines;
+  block->nbytes += nbytes + 1;
+  ++text->nlines;
+}
+
+static void load_slab(struct text *text, uint8_t *bytes, uint64_t nbytes,
+                      uint64_t size, bool mapped) {
+  if (text->storage == TextStorage_PieceTable) {
+    for (uint64_t offset = 0; offset < nbytes;) {
+      uint32_t chunk =
+          nbytes - offset > (1u << 30) ? (1u << 30) : nbytes - offset;
+      piece_tree_insert(text->pieces, offset, bytes + offset, chunk);
+      offset += chunk;
+    }
+    release_slab(bytes, size, mapped);
+    return;
+  }
+
+  if (nbytes == 0) {
+    release_slab(bytes, size, mapped);
+    return;
+  }
+
+  text->slab = malloc(sizeof(struct slab));
+  *text->slab = (struct slab){
+      .bytes = bytes,
+      .size = size,
+      .mapped = mapped,
+      .refs = 1,
+  };
+
+  // memchr is vectorized in any libc worth its salt
+  uint8_t *start = bytes, *end = bytes + nbytes, *nl;
+  while ((nl = memchr(start, '\n', end - start)) != NULL) {
+    load_line(text, start, nl - start);
+    start = nl + 1;
+  }
+  load_line(text, start, end - start);
+
+  rebuild_block_index(text);
+}
+
+void text_load(struct text *text, uint8_t *bytes, uint64_t nbytes) {
+  text_clear(text);
+  load_slab(text, bytes, nbytes, nbytes, false);
+  record_change(text, 0, UINT32_MAX);
+}
+
+void text_load_mapped(struct text *text, uint8_t *mapping, uint64_t size,
+                      uint64_t nbytes) {
+  text_clear(text);
+
+  text->mapping = mapping;
+  text->mapping_size = size;
+  text->mapping_nbytes = nbytes;
+  text->mapping_index = line_index_create(mapping, nbytes, MAPPED_SYNC_LINES);
+  record_change(text, 0, UINT32_MAX);
+}
+
+bool text_is_mapped(const struct text *text) { return text->mapping != NULL; }
+
+uint64_t text_generation(const struct text *text) { return text->generation; }
+
+uint64_t text_properties_generation(const struct text *text) {
+  return text->properties_generation;
+}
+
+static void add_change(struct text_change change, struct text_change *changes,
+                       uint32_t max_nchanges, uint32_t *nchanges) {
+  // when out of room, the last change covers the rest of them
+  if (*nchanges == max_nchanges) {
+    struct text_change *last = &changes[max_nchanges - 1];
+    if (change.start_line < last->start_line) {
+      last->start_line = change.start_line;
+    }
+    if (change.end_line > last->end_line) {
+      last->end_line = change.end_line;
+    }
+    return;
+  }
+
+  changes[(*nchanges)++] = change;
+}
+
+void text_get_changes(const struct text *text, uint64_t generation,
+                      struct text_change *changes, uint32_t max_nchanges,
+                      uint32_t *nchanges) {
+  *nchanges = 0;
+  if (max_nchanges == 0) {
+    return;
+  }
+
+  if (generation < text->dropped_changes.generation) {
+    add_change(text->dropped_changes.change, changes, max_nchanges, nchanges);
+  }
+
+  for (uint32_t ci = 0; ci < text->nchanges; ++ci) {
+    const struct change_entry *entry =
+        &text->changes[(text->changes_first + ci) % CHANGE_HISTORY_SIZE];
+    if (entry->generation > generation) {
+      add_change(entry->change, changes, max_nchanges, nchanges);
+    }
+  }
+}
+
+static void shift_properties_insert(struct text *text, struct location at,
+                                    const uint8_t *bytes, uint32_t nbytes,
+                                    uint32_t lines_added);
+
+void text_insert_at(struct text *text, uint32_t line, uint32_t offset,
+                    uint8_t *bytes, uint32_t nbytes, uint32_t *lines_added) {
+  unmap_text(text);
+  uint32_t nlines = text_num_lines(text);
+
+  // markers are by byte offset, only look it up if there are any
+  uint64_t at = marker_tree_size(text->markers) > 0
+                    ? text_line_offset(text, line) + offset
+                    : 0;
+
+  if (text->storage == TextStorage_PieceTable) {
+    pieces_insert_at(text, line, offset, bytes, nbytes, lines_added);
+  } else {
+    text_insert_at_inner(text, line, offset, bytes, nbytes, lines_added);
+  }
+
+  // anything that moves lines changes everything after it
+  if (text_num_lines(text) != nlines) {
+    record_change(text, line < nlines ? line : nlines, UINT32_MAX);
+  } else if (nbytes > 0) {
+    record_change(text, line, line + 1);
+  }
+
+  shift_properties_insert(text, (struct location){.line = line, .col = offset},
+                          bytes, nbytes, *lines_added);
+  marker_tree_insert(text->markers, at, nbytes);
+}
+
+static void text_delete_inner(struct text *text, uint32_t start_line,
+                              uint32_t start_offset, uint32_t end_line,
+                              uint32_t end_offset) {
+  struct line *firstline = line_at_mut(text, start_line);
+  struct line *lastline = line_at_mut(text, end_line);
+
+  uint32_t srcbytei = end_offset;
+  uint32_t dstbytei = start_offset;
+  uint32_t ncopy = lastline->nbytes - srcbytei;
+  if (lastline != firstline) {
+    // copy the rest of the last line to the first line
+    insert_at(text, start_line, start_offset, line_tail(lastline, srcbytei),
+              ncopy);
+    dstbytei += ncopy;
+    srcbytei = firstline->nbytes;
+  }
+
+  // new byte count is whatever we had before (left of dstbytei)
+  // plus what we copied
+  erase_line_bytes(firstline, dstbytei, srcbytei - dstbytei);
+  add_line_bytes(text, start_line, -(int64_t)(srcbytei - dstbytei));
+
+  // delete full lines, backwards to not shift old, crappy data upwards
+  for (uint32_t linei = end_line >= text->nlines ? end_line - 1 : end_line;
+       linei > start_line; --linei) {
+    delete_line(text, linei);
+  }
+
+  // if this is the last line in the buffer, and it turns out empty, remove it
+  if (start_line == text->nlines - 1 && text_line_size(text, start_line) == 0) {
+    delete_line(text, start_line);
+  }
+}
+
+/* Clamp a region to delete to the text. Returns false if there is nothing to
+ * delete.
+ */
+static bool clamp_delete(const struct text *text, uint32_t *start_line,
+                         uint32_t *start_offset, uint32_t *end_line,
+                         uint32_t *end_offset) {
+  uint32_t nlines = text_num_lines(text);
+  if (nlines == 0 || *start_line >= nlines) {
+    return false;
+  }
+
+  if (*end_line >= nlines) {
+    *end_line = nlines - 1;
+    *end_offset = text_line_size(text, *end_line);
+  }
+
+  // clamp column
+  uint32_t firstline_len = text_line_size(text, *start_line);
+  if (*start_offset > firstline_len) {
+    *start_offset = firstline_len > 0 ? firstline_len - 1 : 0;
+  }
+
+  // handle deletion of newlines
+  uint32_t lastline_len = text_line_size(text, *end_line);
+  if (*end_offset > lastline_len) {
+    if (*end_line + 1 < nlines) {
+      *end_offset = 0;
+      ++*end_line;
+    } else {
+      *end_offset = lastline_len;
+    }
+  }
+
+  return true;
+}
+
+static void shift_properties_delete(struct text *text, struct location start,
+                                    struct location end);
+
+void text_delete(struct text *text, uint32_t start_line, uint32_t start_offset,
+                 uint32_t end_line, uint32_t end_offset) {
+  unmap_text(text);
+  if (!clamp_delete(text, &start_line, &start_offset, &end_line,
+                    &end_offset)) {
+    return;
+  }
+
+  uint32_t nlines = text_num_lines(text);
+  uint64_t size = text_size(text);
+
+  uint64_t start = 0, end = 0;
+  if (marker_tree_size(text->markers) > 0) {
+    start = text_line_offset(text, start_line) + start_offset;
+    end = text_line_offset(text, end_line) + end_offset;
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    pieces_delete(text, start_line, start_offset, end_line, end_offset);
+  } else {
+    text_delete_inner(text, start_line, start_offset, end_line, end_offset);
+  }
+
+  if (text_num_lines(text) != nlines) {
+    record_change(text, start_line, UINT32_MAX);
+  } else if (text_size(text) != size) {
+    record_change(text, start_line, start_line + 1);
+  }
+
+  shift_properties_delete(
+      text, (struct location){.line = start_line, .col = start_offset},
+      (struct location){.line = end_line, .col = end_offset});
+  marker_tree_delete(text->markers, start, end - start);
+}
+
+void text_for_each_chunk(struct text *text, chunk_cb callback, void *userdata) {
+  // if representation of text is changed, this can be changed as well
+  text_for_each_line(text, 0, text_wait_num_lines(text), callback, userdata);
+}
+
+void text_for_each_line(struct text *text, uint32_t line, uint32_t nlines,
+                        chunk_cb callback, void *userdata) {
+  if (text->mapping != NULL) {
+    for (uint32_t li = line; li < line + nlines; ++li) {
+      // getting the line waits for it to be indexed
+      struct text_chunk chunk = mapped_get_line(text, li);
+      if (li >= mapped_num_lines(text)) {
+        break;
+      }
+      callback(&chunk, userdata);
+    }
+    return;
+  }
+
+  uint32_t total = text_num_lines(text);
+  uint32_t nlines_max = (line + nlines) > total ? total : (line + nlines);
+
+  if (text->storage == TextStorage_PieceTable) {
+    for (uint32_t li = line; li < nlines_max; ++li) {
+      struct text_chunk chunk = pieces_get_line(text, li);
+      callback(&chunk, userdata);
+    }
+    return;
+  }
+
+  for (uint32_t li = line; li < nlines_max; ++li) {
+    struct line *src_line = line_at(text, li);
+    struct text_chunk line = (struct text_chunk){
+        .allocated = false,
+        .text = line_bytes(src_line),
+        .nbytes = src_line->nbytes,
+        .line = li,
+    };
+    callback(&line, userdata);
+  }
+}
+
+struct text_chunk text_get_line(struct text *text, uint32_t line) {
+  if (text->mapping != NULL) {
+    return mapped_get_line(text, line);
+  }
+
+  if (text->storage == TextStorage_PieceTable) {
+    return pieces_get_line(text, line);
+  }
+
+  if (line >= text->nlines) {
+    return (struct text_chunk){.line = line};
+  }
+
+  struct line *src_line = line_at(text, line);
+  return (struct text_chunk){
+      .text = line_bytes(src_line),
+      .nbytes = src_line->nbytes,
+      .line = line,
+      .allocated = false,
+  };
+}
+
+/* Normalize a region the way @ref text_get_region treats it. Returns false if
+ * the region is empty.
+ */
+static bool normalize_region(const struct text *text, uint32_t *start_line,
+                             uint32_t *start_offset, uint32_t *end_line,
+                             uint32_t *end_offset) {
+  if (*start_line == *end_line && *start_offset == *end_offset) {
+    return false;
+  }
+
+  if (*start_offset > text_line_size(text, *start_line)) {
+    return false;
+  }
+
+  // handle copying of newlines
+  if (*end_offset > text_line_size(text, *end_line)) {
+    ++*end_line;
+    *end_offset = 0;
+  }
+
+  return true;
+}
+
+/* Get the byte range of a normalized region, and the number of newlines
+ * separating the empty lines past the end of the text that it covers.
+ */
+static void region_range(const struct text *text, uint32_t start_line,
+                         uint32_t start_offset, uint32_t end_line,
+                         uint32_t end_offset, uint64_t *start, uint64_t *end,
+                         uint32_t *nvirtual) {
+  uint32_t nlines = text_num_lines(text);
+  uint32_t lastline = nlines > 0 ? nlines - 1 : 0;
+  *start = text_line_offset(text, start_line) +
+           (start_line <= lastline ? start_offset : 0);
+  *end = text_line_offset(text, end_line) +
+         (end_line <= lastline ? end_offset : 0);
+  *nvirtual = end_line > lastline
+                  ? end_line - (start_line > lastline ? start_line : lastline)
+                  : 0;
+
+  if (*end < *start) {
+    *end = *start;
+  }
+}
+
+static const uint8_t newline = '\n';
+
+void text_for_each_span(struct text *text, uint32_t start_line,
+                        uint32_t start_offset, uint32_t end_line,
+                        uint32_t end_offset, span_cb callback,
+                        void *userdata) {
+  if (!normalize_region(text, &start_line, &start_offset, &end_line,
+                        &end_offset)) {
+    return;
+  }
+
+  // only wait for the lines of a mapped text to be counted when the region
+  // reaches past the ones counted so far
+  if (text->mapping != NULL && end_line >= text_num_lines(text)) {
+    line_index_wait(text->mapping_index);
+  }
+
+  if (text->mapping != NULL || text->storage == TextStorage_PieceTable) {
+    uint64_t start, end;
+    uint32_t nvirtual;
+    region_range(text, start_line, start_offset, end_line, end_offset, &start,
+                 &end, &nvirtual);
+
+    if (text->mapping != NULL) {
+      for (uint64_t offset = start; offset < end;) {
+        uint32_t nbytes =
+            end - offset > UINT32_MAX ? UINT32_MAX : end - offset;
+        callback(text->mapping + offset, nbytes, userdata);
+        offset += nbytes;
+      }
+    } else {
+      piece_tree_for_each_span(text->pieces, start, end - start, callback,
+                               userdata);
+    }
+
+    for (uint32_t i = 0; i < nvirtual; ++i) {
+      callback(&newline, 1, userdata);
+    }
+    return;
+  }
+
+  // lines past the end are empty, but still separated by newlines
+  for (uint32_t li = start_line; li <= end_line; ++li) {
+    if (li < text->nlines) {
+      struct line *line = line_at(text, li);
+      uint32_t from = li == start_line ? start_offset : 0;
+      uint32_t to = li == end_line ? end_offset : line->nbytes;
+      if (to > from) {
+        line_spans(line, from, to, callback, userdata);
+      }
+    }
+
+    if (li < end_line) {
+      callback(&newline, 1, userdata);
+    }
+  }
+}
+
+uint64_t text_region_size(struct text *text, uint32_t start_line,
+                          uint32_t start_offset, uint32_t end_line,
+                          uint32_t end_offset) {
+  if (text->mapping != NULL) {
+    line_index_wait(text->mapping_index);
+  }
+
+  if (!normalize_region(text, &start_line, &start_offset, &end_line,
+                        &end_offset)) {
+    return 0;
+  }
+
+  uint64_t start, end;
+  uint32_t nvirtual;
+  region_range(text, start_line, start_offset, end_line, end_offset, &start,
+               &end, &nvirtual);
+  return (end - start) + nvirtual;
+}
+
+struct copy_span_state {
+  uint8_t *dst;
+  uint64_t offset;
+};
+
+static void copy_span(const uint8_t *bytes, uint32_t nbytes, void *userdata) {
+  struct copy_span_state *state = (struct copy_span_state *)userdata;
+  memcpy(state->dst + state->offset, bytes, nbytes);
+  state->offset += nbytes;
+}
+
+struct text_chunk text_get_region(struct text *text, uint32_t start_line,
+                                  uint32_t start_offset, uint32_t end_line,
+                                  uint32_t end_offset) {
+  uint64_t nbytes =
+      text_region_size(text, start_line, start_offset, end_line, end_offset);
+  if (nbytes == 0) {
+    return (struct text_chunk){0};
+  }
+
+  struct copy_span_state state = {.dst = (uint8_t *)malloc(nbytes)};
+  text_for_each_span(text, start_line, start_offset, end_line, end_offset,
+                     copy_span, &state);
+
+  return (struct text_chunk){
+      .text = state.dst,
+      .line = 0,
+      .nbytes = nbytes,
       .allocated = true,
   };
 }
 
-void text_add_property(struct text *text, uint32_t start_line,
-                       uint32_t start_offset, uint32_t end_line,
-                       uint32_t end_offset, struct text_property property) {
+/* Snapshots
+ *
+ * A snapshot of line based storage shares the line blocks and the slab of the
+ * text it was taken from. Edits to the text copy a block before changing it if
+ * it is shared, see own_block. Piece table storage is copied into a slab.
+ */
+static void share_blocks(struct text *text, struct text *copy) {
+  for (uint32_t bi = 0; bi < text->nblocks; ++bi) {
+    struct line_block *block = text->blocks[bi];
+
+    // close all gaps so that reading from the block never writes to it
+    if (block->edited) {
+      for (uint32_t li = 0; li < block->nlines; ++li) {
+        if (line_owned(&block->lines[li])) {
+          line_bytes(&block->lines[li]);
+        }
+      }
+      block->edited = false;
+    }
+
+    __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+  }
+
+  if (text->nblocks > copy->blocks_capacity) {
+    copy->blocks_capacity = text->nblocks;
+    copy->blocks = realloc(copy->blocks, sizeof(struct line_block *) *
+                                             copy->blocks_capacity);
+    copy->block_lines =
+        realloc(copy->block_lines, sizeof(uint64_t) * copy->blocks_capacity);
+    copy->block_bytes =
+        realloc(copy->block_bytes, sizeof(uint64_t) * copy->blocks_capacity);
+  }
+
+  memcpy(copy->blocks, text->blocks,
+         sizeof(struct line_block *) * text->nblocks);
+  memcpy(copy->block_lines, text->block_lines,
+         sizeof(uint64_t) * text->nblocks);
+  memcpy(copy->block_bytes, text->block_bytes,
+         sizeof(uint64_t) * text->nblocks);
+  copy->nblocks = text->nblocks;
+  copy->nlines = text->nlines;
+
+  if (text->slab != NULL) {
+    __atomic_add_fetch(&text->slab->refs, 1, __ATOMIC_RELAXED);
+    copy->slab = text->slab;
+  }
+}
+
+static void copy_pieces(struct text *text, struct text *copy) {
+  uint32_t nlines = text_num_lines(text);
+  if (nlines == 0) {
+    return;
+  }
+
+  struct text_chunk all = text_get_region(
+      text, 0, 0, nlines - 1, text_line_size(text, nlines - 1));
+  load_slab(copy, all.text, all.nbytes, all.nbytes, false);
+
+  // a text with a single empty line has no bytes to load
+  if (text_num_lines(copy) < nlines) {
+    append_empty_lines(copy, nlines - text_num_lines(copy));
+  }
+}
+
+struct text_snapshot *text_snapshot(struct text *text) {
+  // mapped text is converted first, to have blocks to share
+  unmap_text(text);
+
+  struct text *copy = text_create(0, TextStorage_Lines);
+  if (text->storage == TextStorage_PieceTable) {
+    copy_pieces(text, copy);
+  } else {
+    share_blocks(text, copy);
+  }
+
+  copy->generation = text->generation;
+  memcpy(copy->changes, text->changes, sizeof(text->changes));
+  copy->changes_first = text->changes_first;
+  copy->nchanges = text->nchanges;
+  copy->dropped_changes = text->dropped_changes;
+
+  struct text_snapshot *snapshot = malloc(sizeof(struct text_snapshot));
+  snapshot->refs = 1;
+  snapshot->text = copy;
+  return snapshot;
+}
+
+struct text_snapshot *text_snapshot_retain(struct text_snapshot *snapshot) {
+  __atomic_add_fetch(&snapshot->refs, 1, __ATOMIC_RELAXED);
+  return snapshot;
+}
+
+void text_snapshot_release(struct text_snapshot *snapshot) {
+  if (__atomic_sub_fetch(&snapshot->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+
+  text_destroy(snapshot->text);
+  free(snapshot);
+}
+
+struct text *text_snapshot_text(struct text_snapshot *snapshot) {
+  return snapshot->text;
+}
+
+#define MAX_PROPERTY_LAYERS 32
+
+static const char *g_property_layers[MAX_PROPERTY_LAYERS] = {"default"};
+static uint32_t g_nproperty_layers = 1;
+
+// unnamed layers get ids after the named ones, so the two never collide
+static uint32_t g_next_unnamed_layer = MAX_PROPERTY_LAYERS;
+
+uint32_t text_property_layer(const char *name) {
+  for (uint32_t layeri = 0; layeri < g_nproperty_layers; ++layeri) {
+    if (strcmp(g_property_layers[layeri], name) == 0) {
+      return layeri;
+    }
+  }
+
+  assert(g_nproperty_layers < MAX_PROPERTY_LAYERS);
+  g_property_layers[g_nproperty_layers] = name;
+  return g_nproperty_layers++;
+}
+
+uint32_t text_property_layer_new(void) { return g_next_unnamed_layer++; }
+
+void text_add_layer_property(struct text *text, uint32_t layer,
+                             uint32_t start_line, uint32_t start_offset,
+                             uint32_t end_line, uint32_t end_offset,
+                             struct text_property property) {
   struct text_property_entry entry = {
       .start = (struct location){.line = start_line, .col = start_offset},
       .end = (struct location){.line = end_line, .col = end_offset},
+      .layer = layer,
       .property = property,
   };
   VEC_PUSH(&text->properties, entry);
+  text->property_index_valid = false;
+  ++text->properties_generation;
+}
+
+void text_add_property(struct text *text, uint32_t start_line,
+                       uint32_t start_offset, uint32_t end_line,
+                       uint32_t end_offset, struct text_property property) {
+  text_add_layer_property(text, 0, start_line, start_offset, end_line,
+                          end_offset, property);
+}
+
+/* Move a location after `at` to account for bytes inserted there, ending at
+ * `end`.
+ */
+static void shift_location_insert(struct location *location,
+                                  struct location at, struct location end) {
+  if (location_compare(*location, at) < 0) {
+    return;
+  }
+
+  if (location->line == at.line) {
+    location->col = end.col + (location->col - at.col);
+  }
+  location->line += end.line - at.line;
+}
+
+static struct location index_max_end(struct property_node *nodes, uint32_t lo,
+                                     uint32_t hi);
+
+/* Update the property index after an edit moved the properties, instead of
+ * sorting it again. Edits move locations without changing their order, so the
+ * index stays sorted. `moved` has the new entry of each old one, UINT32_MAX for
+ * the ones that were removed, and is NULL if none were.
+ */
+static void update_property_index(struct text *text, const uint32_t *moved) {
+  if (!text->property_index_valid) {
+    return;
+  }
+
+  struct property_node *nodes = VEC_ENTRIES(&text->property_index);
+  uint32_t nnodes = 0;
+  VEC_FOR_EACH(&text->property_index, struct property_node * node) {
+    uint32_t entryi = moved != NULL ? moved[node->entry] : node->entry;
+    if (entryi == UINT32_MAX) {
+      continue;
+    }
+
+    struct text_property_entry *entry =
+        &VEC_ENTRIES(&text->properties)[entryi];
+    nodes[nnodes++] = (struct property_node){
+        .start = entry->start,
+        .max_end = entry->end,
+        .entry = entryi,
+    };
+  }
+
+  VEC_SIZE(&text->property_index) = nnodes;
+  if (nnodes > 0) {
+    index_max_end(nodes, 0, nnodes);
+  }
+}
+
+static void shift_properties_insert(struct text *text, struct location at,
+                                    const uint8_t *bytes, uint32_t nbytes,
+                                    uint32_t lines_added) {
+  if (VEC_EMPTY(&text->properties) || nbytes == 0) {
+    return;
+  }
+
+  // where the inserted bytes end
+  struct location end = {.line = at.line, .col = at.col + nbytes};
+  if (lines_added > 0) {
+    uint32_t tail = 0;
+    while (tail < nbytes && bytes[nbytes - tail - 1] != '\n') {
+      ++tail;
+    }
+    end = (struct location){.line = at.line + lines_added, .col = tail};
+  }
+
+  VEC_FOR_EACH(&text->properties, struct text_property_entry * entry) {
+    shift_location_insert(&entry->start, at, end);
+    shift_location_insert(&entry->end, at, end);
+  }
+  update_property_index(text, NULL);
+  ++text->properties_generation;
+}
+
+/* Move a location to account for the bytes in [start, end) being deleted.
+ * Returns false if the location itself was deleted.
+ */
+static bool shift_location_delete(struct location *location,
+                                  struct location start, struct location end) {
+  if (location_compare(*location, start) < 0) {
+    return true;
+  }
+
+  if (location_compare(*location, end) < 0) {
+    *location = start;
+    return false;
+  }
+
+  if (location->line == end.line) {
+    location->col = start.col + (location->col - end.col);
+  }
+  location->line -= end.line - start.line;
+  return true;
+}
+
+static void shift_properties_delete(struct text *text, struct location start,
+                                    struct location end) {
+  if (VEC_EMPTY(&text->properties) ||
+      location_compare(start, end) >= 0) {
+    return;
+  }
+
+  // where each entry is moved when others are removed, for the index
+  uint32_t *moved = NULL;
+  uint32_t nkept = 0;
+  for (uint32_t i = 0; i < VEC_SIZE(&text->properties); ++i) {
+    struct text_property_entry *entry = &VEC_ENTRIES(&text->properties)[i];
+    bool start_kept = shift_location_delete(&entry->start, start, end);
+    if (!shift_location_delete(&entry->end, start, end)) {
+      // everything the property covered is gone
+      if (!start_kept) {
+        if (moved == NULL && text->property_index_valid) {
+          moved = malloc(sizeof(uint32_t) * VEC_SIZE(&text->properties));
+          for (uint32_t j = 0; j < i; ++j) {
+            moved[j] = j;
+          }
+        }
+        if (moved != NULL) {
+          moved[i] = UINT32_MAX;
+        }
+        continue;
+      }
+
+      // the end was deleted, end at the byte before the deleted ones instead
+      if (start.col > 0) {
+        entry->end.col = start.col - 1;
+      } else if (start.line > 0) {
+        entry->end = (struct location){
+            .line = start.line - 1,
+            .col = text_line_size(text, start.line - 1),
+        };
+      }
+    }
+
+    if (moved != NULL) {
+      moved[i] = nkept;
+    }
+    VEC_ENTRIES(&text->properties)[nkept++] = *entry;
+  }
+
+  VEC_SIZE(&text->properties) = nkept;
+  update_property_index(text, moved);
+  free(moved);
+  ++text->properties_generation;
+}
+
+static int compare_property_nodes(const void *a, const void *b) {
+  const struct property_node *na = (const struct property_node *)a;
+  const struct property_node *nb = (const struct property_node *)b;
+  int res = location_compare(na->start, nb->start);
+  if (res != 0) {
+    return res;
+  }
+
+  return na->entry < nb->entry ? -1 : (na->entry > nb->entry ? 1 : 0);
+}
+
+static struct location index_max_end(struct property_node *nodes, uint32_t lo,
+                                     uint32_t hi) {
+  uint32_t mid = lo + (hi - lo) / 2;
+  struct location max_end = nodes[mid].max_end;
+  if (lo < mid) {
+    struct location left = index_max_end(nodes, lo, mid);
+    if (location_compare(left, max_end) > 0) {
+      max_end = left;
+    }
+  }
+  if (mid + 1 < hi) {
+    struct location right = index_max_end(nodes, mid + 1, hi);
+    if (location_compare(right, max_end) > 0) {
+      max_end = right;
+    }
+  }
+
+  nodes[mid].max_end = max_end;
+  return max_end;
+}
+
+static void build_property_index(struct text *text) {
+  uint32_t nentries = VEC_SIZE(&text->properties);
+  VEC_CLEAR(&text->property_index);
+  VEC_GROW(&text->property_index, nentries + 1);
+
+  struct property_node *nodes = VEC_ENTRIES(&text->property_index);
+  for (uint32_t i = 0; i < nentries; ++i) {
+    struct text_property_entry *entry = &VEC_ENTRIES(&text->properties)[i];
+    nodes[i] = (struct property_node){
+        .start = entry->start,
+        .max_end = entry->end,
+        .entry = i,
+    };
+  }
+  VEC_SIZE(&text->property_index) = nentries;
+
+  qsort(nodes, nentries, sizeof(struct property_node), compare_property_nodes);
+  if (nentries > 0) {
+    index_max_end(nodes, 0, nentries);
+  }
+
+  text->property_index_valid = true;
+}
+
+struct property_query {
+  struct location from;
+  struct location to;
+  uint32_t *entries;
+  uint32_t max_nentries;
+  uint32_t nentries;
+
+  // all overlapping properties, including the ones not fitting in entries
+  uint32_t nfound;
+};
+
+/* Find the properties in nodes [lo, hi) that overlap [from, to]. */
+static void query_property_index(const struct text *text, uint32_t lo,
+                                 uint32_t hi, struct property_query *query) {
+  if (lo >= hi) {
+    return;
+  }
+
+  const struct property_node *nodes = VEC_ENTRIES(&text->property_index);
+  uint32_t mid = lo + (hi - lo) / 2;
+  const struct property_node *node = &nodes[mid];
+
+  // everything in this subtree ends before the range
+  if (location_compare(node->max_end, query->from) < 0) {
+    return;
+  }
+
+  query_property_index(text, lo, mid, query);
+
+  // this node and everything to the right starts after the range
+  if (location_compare(node->start, query->to) > 0) {
+    return;
+  }
+
+  const struct text_property_entry *entry =
+      &VEC_ENTRIES(&text->properties)[node->entry];
+  if (location_compare(entry->end, query->from) >= 0) {
+    if (query->nentries < query->max_nentries) {
+      query->entries[query->nentries++] = node->entry;
+    }
+    ++query->nfound;
+  }
+
+  query_property_index(text, mid + 1, hi, query);
+}
+
+static int compare_entries(const void *a, const void *b) {
+  uint32_t ea = *(const uint32_t *)a, eb = *(const uint32_t *)b;
+  return ea < eb ? -1 : ea > eb;
+}
+
+/* Find properties overlapping [from, to], in the order they were added. Only
+ * the first `max_nentries` in start order are stored if there are more, the
+ * number of all of them is returned in `nfound`.
+ */
+static uint32_t find_properties(struct text *text, struct location from,
+                                struct location to, uint32_t *entries,
+                                uint32_t max_nentries, uint32_t *nfound) {
+  if (!text->property_index_valid) {
+    build_property_index(text);
+  }
+
+  struct property_query query = {
+      .from = from,
+      .to = to,
+      .entries = entries,
+      .max_nentries = max_nentries,
+      .nentries = 0,
+      .nfound = 0,
+  };
+  query_property_index(text, 0, VEC_SIZE(&text->property_index), &query);
+
+  // later properties override earlier ones, keep them last
+  qsort(entries, query.nentries, sizeof(uint32_t), compare_entries);
+
+  *nfound = query.nfound;
+  return query.nentries;
 }
 
+#define MAX_PROPERTY_QUERY 128
+
 void text_get_properties(struct text *text, uint32_t line, uint32_t offset,
                          struct text_property **properties,
                          uint32_t max_nproperties, uint32_t *nproperties) {
   struct location location = {.line = line, .col = offset};
-  uint32_t nres = 0;
-  VEC_FOR_EACH(&text->properties, struct text_property_entry * prop) {
-    if (location_is_between(location, prop->start, prop->end)) {
-      properties[nres] = &prop->property;
-      ++nres;
+  uint32_t entries[MAX_PROPERTY_QUERY];
+  uint32_t max_nentries = max_nproperties < MAX_PROPERTY_QUERY
+                              ? max_nproperties
+                              : MAX_PROPERTY_QUERY;
+  uint32_t nfound;
+  uint32_t nentries = find_properties(text, location, location, entries,
+                                      max_nentries, &nfound);
+
+  for (uint32_t i = 0; i < nentries; ++i) {
+    properties[i] = &VEC_ENTRIES(&text->properties)[entries[i]].property;
+  }
+  *nproperties = nentries;
+}
 
-      if (nres == max_nproperties) {
-        break;
-      }
+uint32_t text_get_line_properties(struct text *text, uint32_t line,
+                                  struct text_line_property *properties,
+                                  uint32_t max_nproperties,
+                                  uint32_t *nproperties) {
+  uint32_t stack_entries[MAX_PROPERTY_QUERY];
+  uint32_t *entries = max_nproperties <= MAX_PROPERTY_QUERY
+                          ? stack_entries
+                          : malloc(sizeof(uint32_t) * max_nproperties);
+  uint32_t nfound;
+  uint32_t nentries = find_properties(
+      text, (struct location){.line = line, .col = 0},
+      (struct location){.line = line, .col = UINT32_MAX}, entries,
+      max_nproperties, &nfound);
+
+  for (uint32_t i = 0; i < nentries; ++i) {
+    struct text_property_entry *entry =
+        &VEC_ENTRIES(&text->properties)[entries[i]];
+    properties[i] = (struct text_line_property){
+        .start = entry->start.line == line ? entry->start.col : 0,
+        .end = entry->end.line == line ? entry->end.col : UINT32_MAX,
+        .property = &entry->property,
+    };
+  }
+  *nproperties = nentries;
+
+  if (entries != stack_entries) {
+    free(entries);
+  }
+
+  return nfound;
+}
+
+void text_clear_layer(struct text *text, uint32_t layer) {
+  uint32_t nkept = 0;
+  VEC_FOR_EACH(&text->properties, struct text_property_entry * entry) {
+    if (entry->layer != layer) {
+      VEC_ENTRIES(&text->properties)[nkept++] = *entry;
     }
   }
-  *nproperties = nres;
+
+  if (nkept != VEC_SIZE(&text->properties)) {
+    VEC_SIZE(&text->properties) = nkept;
+    text->property_index_valid = false;
+    ++text->properties_generation;
+  }
+}
+
+void text_clear_properties(struct text *text) {
+  if (VEC_EMPTY(&text->properties)) {
+    return;
+  }
+
+  VEC_CLEAR(&text->properties);
+  text->property_index_valid = false;
+  ++text->properties_generation;
+}
+
+struct marker *text_add_marker(struct text *text, uint32_t line,
+                               uint32_t offset, enum marker_gravity gravity) {
+  return marker_tree_add(text->markers, text_line_offset(text, line) + offset,
+                         gravity);
+}
+
+void text_remove_marker(struct text *text, struct marker *marker) {
+  marker_tree_remove(text->markers, marker);
 }
 
-void text_clear_properties(struct text *text) { VEC_CLEAR(&text->properties); }
+struct location text_marker_location(const struct text *text,
+                                     struct marker *marker) {
+  return text_offset_location(text, marker_tree_offset(marker));
+}
@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 #include "location.h"
+#include "marker-tree.h"
 #include "utf8.h"
 
 struct text;
@@ -17,7 +18,21 @@ struct text_chunk {
   bool allocated;
 };
 
-struct text *text_create(uint32_t initial_capacity);
+/**
+ * Storage engine used for the contents of a text.
+ */
+enum text_storage {
+  /** One heap allocated byte array per line. */
+  TextStorage_Lines,
+
+  /**
+   * A piece table where inserts and deletes are O(log n) regardless of the
+   * number of lines in the text.
+   */
+  TextStorage_PieceTable,
+};
+
+struct text *text_create(uint32_t initial_capacity, enum text_storage storage);
 void text_destroy(struct text *text);
 
 /**
@@ -31,11 +46,137 @@ void text_insert_at(struct text *text, uint32_t line, uint32_t offset,
 void text_append(struct text *text, uint8_t *bytes, uint32_t nbytes,
                  uint32_t *lines_added);
 
+/**
+ * Replace the contents of a text with a block of bytes.
+ *
+ * This is a lot faster than @ref text_append for loading large amounts of
+ * text, for example a file. Lines refer directly into @p bytes and are only
+ * copied when they are modified.
+ *
+ * @param text The text to load into.
+ * @param bytes The bytes to load. Must be allocated with malloc, ownership is
+ * transferred to @p text.
+ * @param nbytes The number of bytes in @p bytes.
+ */
+void text_load(struct text *text, uint8_t *bytes, uint64_t nbytes);
+
+/**
+ * Replace the contents of a text with a read-only memory mapping.
+ *
+ * Lines are served directly from the mapping while the line index is built in
+ * a background thread. The text is converted to its normal storage the first
+ * time it is modified, with lines still pointing into the mapping until they
+ * are changed.
+ *
+ * @param text The text to load into.
+ * @param mapping The mapping. Ownership is transferred to @p text and it is
+ * unmapped with munmap when no longer needed.
+ * @param size Size of the mapping.
+ * @param nbytes The number of bytes in @p mapping to use as text.
+ */
+void text_load_mapped(struct text *text, uint8_t *mapping, uint64_t size,
+                      uint64_t nbytes);
+
+/**
+ * Check if a text is served from a file mapping.
+ *
+ * @param text The text.
+ * @returns True if the text was loaded with @ref text_load_mapped and has not
+ * been modified since.
+ */
+bool text_is_mapped(const struct text *text);
+
 void text_delete(struct text *text, uint32_t start_line, uint32_t start_offset,
                  uint32_t end_line, uint32_t end_offset);
 
+/**
+ * A range of lines that has been changed.
+ */
+struct text_change {
+  /** First changed line. */
+  uint32_t start_line;
+
+  /**
+   * Line after the last changed line. UINT32_MAX if everything from
+   * @ref start_line to the end of the text has changed.
+   */
+  uint32_t end_line;
+};
+
+/**
+ * Get the current generation of a text.
+ *
+ * The generation is increased every time the text is modified and can be
+ * passed to @ref text_get_changes later to find out what has changed since.
+ *
+ * @param text The text.
+ * @returns The current generation.
+ */
+uint64_t text_generation(const struct text *text);
+
+/**
+ * Get the ranges of lines that have changed since a generation.
+ *
+ * Changes are in the order they were made. The line numbers of a change are
+ * the ones at the time it was made, but any change that adds or removes lines
+ * covers everything after it, so together the changes always cover all lines
+ * that have changed. Changes too old to be kept separately are merged into
+ * one, and if there are more than @p max_nchanges changes, the last one covers
+ * the rest.
+ *
+ * @param text The text.
+ * @param generation Generation from @ref text_generation.
+ * @param [out] changes Array to store the changes in.
+ * @param max_nchanges Size of @p changes.
+ * @param [out] nchanges The number of changes stored in @p changes.
+ */
+void text_get_changes(const struct text *text, uint64_t generation,
+                      struct text_change *changes, uint32_t max_nchanges,
+                      uint32_t *nchanges);
+
 uint32_t text_num_lines(const struct text *text);
+
+/**
+ * Check if the number of lines of a text is known.
+ *
+ * The lines of a mapped text are counted in the background. Until all of them
+ * are, @ref text_num_lines returns the number of lines counted so far.
+ *
+ * @param text The text.
+ * @returns True if @ref text_num_lines is the number of lines in the whole
+ * text.
+ */
+bool text_num_lines_known(const struct text *text);
+
+/**
+ * Wait until the number of lines of a text is known.
+ *
+ * @param text The text.
+ * @returns The number of lines in the whole text.
+ */
+uint32_t text_wait_num_lines(struct text *text);
 uint32_t text_line_size(const struct text *text, uint32_t lineidx);
+
+/**
+ * Get the byte offset of the start of a line.
+ *
+ * Every line except the last is counted as being followed by a newline.
+ *
+ * @param text The text.
+ * @param lineidx The line to get the offset of.
+ * @returns The offset of the first byte on @p lineidx, or the size of the text
+ * if @p lineidx is past the last line.
+ */
+uint64_t text_line_offset(const struct text *text, uint32_t lineidx);
+
+/**
+ * Get the line and byte column of a byte offset.
+ *
+ * @param text The text.
+ * @param offset The byte offset, counted as for @ref text_line_offset.
+ * @returns The location of @p offset, clamped to the end of the text.
+ */
+struct location text_offset_location(const struct text *text, uint64_t offset);
 struct utf8_codepoint_iterator
 text_line_codepoint_iterator(const struct text *text, uint32_t lineidx);
 struct utf8_codepoint_iterator
@@ -52,6 +193,100 @@ struct text_chunk text_get_region(struct text *text, uint32_t start_line,
                                   uint32_t start_offset, uint32_t end_line,
                                   uint32_t end_offset);
 
+/**
+ * Callback for a span of bytes in a text.
+ *
+ * @param bytes Pointer to the bytes of the span. Only valid until the text is
+ * modified.
+ * @param nbytes Number of bytes in the span.
+ * @param userdata Userdata passed to @ref text_for_each_span.
+ */
+typedef void (*span_cb)(const uint8_t *bytes, uint32_t nbytes, void *userdata);
+
+/**
+ * Call @p callback for each span of bytes in a region of a text, without
+ * copying them.
+ *
+ * Together, the spans are the same bytes as returned by @ref text_get_region
+ * for the same region. Newlines between lines are reported as spans of their
+ * own or as part of other spans, depending on how the text is stored, so
+ * callbacks should not assume that a span is a line.
+ *
+ * @param text The text.
+ * @param start_line The line where the region starts.
+ * @param start_offset The byte offset in @p start_line where the region
+ * starts.
+ * @param end_line The line where the region ends.
+ * @param end_offset The byte offset in @p end_line where the region ends, a
+ * value past the end of the line includes the newline.
+ * @param callback Callback to call for each span.
+ * @param userdata Data passed unmodified to @p callback.
+ */
+void text_for_each_span(struct text *text, uint32_t start_line,
+                        uint32_t start_offset, uint32_t end_line,
+                        uint32_t end_offset, span_cb callback, void *userdata);
+
+/**
+ * Get the number of bytes in a region of a text.
+ *
+ * @returns The number of bytes that @ref text_get_region would return for the
+ * same region.
+ */
+uint64_t text_region_size(struct text *text, uint32_t start_line,
+                          uint32_t start_offset, uint32_t end_line,
+                          uint32_t end_offset);
+
+/**
+ * An immutable view of a text at one point in time.
+ *
+ * Snapshots are reference counted and can be read from any thread while the
+ * text they were taken from keeps changing. Unmodified lines are shared with
+ * the text, so taking a snapshot is cheap and does not copy the contents of
+ * line based storage.
+ */
+struct text_snapshot;
+
+/**
+ * Take a snapshot of a text.
+ *
+ * Text that is served from a file mapping is converted to regular storage
+ * first, see @ref text_load_mapped.
+ *
+ * @param text The text to take a snapshot of.
+ * @returns A new snapshot with a reference count of one. Release it with @ref
+ * text_snapshot_release.
+ */
+struct text_snapshot *text_snapshot(struct text *text);
+
+/**
+ * Add a reference to a snapshot.
+ *
+ * @param snapshot The snapshot.
+ * @returns @p snapshot, for convenience.
+ */
+struct text_snapshot *text_snapshot_retain(struct text_snapshot *snapshot);
+
+/**
+ * Remove a reference to a snapshot, freeing it when it was the last one.
+ *
+ * This can be called from any thread.
+ *
+ * @param snapshot The snapshot.
+ */
+void text_snapshot_release(struct text_snapshot *snapshot);
+
+/**
+ * Get the text of a snapshot.
+ *
+ * The returned text must only be read from, never modified, and is valid as
+ * long as the snapshot is. It has the same lines and generation as the text
+ * the snapshot was taken from, but no properties.
+ *
+ * @param snapshot The snapshot.
+ * @returns The text of the snapshot.
+ */
+struct text *text_snapshot_text(struct text_snapshot *snapshot);
+
 enum text_property_type {
   TextProperty_Colors,
   TextProperty_Data,
@@ -76,10 +311,138 @@ void text_add_property(struct text *text, uint32_t start_line,
                        uint32_t start_offset, uint32_t end_line,
                        uint32_t end_offset, struct text_property property);
 
+/**
+ * Get the id of a named property layer, creating the layer if needed.
+ *
+ * Properties are kept in layers so that each producer of properties can
+ * replace its own without touching the others. Properties stay on a text until
+ * their layer is cleared, and move with the text when it is edited. Layer ids
+ * are the same for all texts. Properties added with @ref text_add_property are
+ * in layer 0.
+ *
+ * @param name The name of the layer. Must stay valid for the lifetime of the
+ * program, typically a string literal.
+ * @returns The id of the layer.
+ */
+uint32_t text_property_layer(const char *name);
+
+/**
+ * Create a new unnamed property layer.
+ *
+ * For producers that can have several instances, like one per buffer view,
+ * where each instance needs to clear its own properties only.
+ *
+ * @returns The id of the new layer.
+ */
+uint32_t text_property_layer_new(void);
+
+/**
+ * Add a property to a layer.
+ *
+ * @param text The text.
+ * @param layer The layer id, from @ref text_property_layer.
+ * @param start_line The line where the property starts.
+ * @param start_offset The byte offset in @p start_line where the property
+ * starts.
+ * @param end_line The line where the property ends.
+ * @param end_offset The byte offset in @p end_line of the last byte covered by
+ * the property.
+ * @param property The property.
+ */
+void text_add_layer_property(struct text *text, uint32_t layer,
+                             uint32_t start_line, uint32_t start_offset,
+                             uint32_t end_line, uint32_t end_offset,
+                             struct text_property property);
+
+/**
+ * Remove all properties in a layer.
+ *
+ * @param text The text.
+ * @param layer The layer id, from @ref text_property_layer.
+ */
+void text_clear_layer(struct text *text, uint32_t layer);
+
+/**
+ * Get the current generation of the properties of a text.
+ *
+ * The generation is increased every time properties are added or removed, and
+ * when editing the text moves them.
+ *
+ * @param text The text.
+ * @returns The current generation of the properties.
+ */
+uint64_t text_properties_generation(const struct text *text);
+
 void text_get_properties(struct text *text, uint32_t line, uint32_t offset,
                          struct text_property **properties,
                          uint32_t max_nproperties, uint32_t *nproperties);
 
+/**
+ * A text property and the part of a line that it covers.
+ */
+struct text_line_property {
+  /** Byte offset of the first byte covered on the line. */
+  uint32_t start;
+
+  /** Byte offset of the last byte covered on the line, UINT32_MAX if the
+   * property continues on the next line. */
+  uint32_t end;
+
+  /** The property. */
+  struct text_property *property;
+};
+
+/**
+ * Get all properties covering any part of a line.
+ *
+ * @param text The text.
+ * @param line The line to get properties for.
+ * @param [out] properties Properties covering the line, in the order they were
+ * added.
+ * @param max_nproperties The size of @p properties.
+ * @param [out] nproperties The number of properties returned.
+ * @returns The number of properties covering the line. If this is more than
+ * @p max_nproperties, the ones that start first are returned.
+ */
+uint32_t text_get_line_properties(struct text *text, uint32_t line,
+                                  struct text_line_property *properties,
+                                  uint32_t max_nproperties,
+                                  uint32_t *nproperties);
+
 void text_clear_properties(struct text *text);
 
+/**
+ * Add a marker to a text.
+ *
+ * A marker is a position that follows the text around it when the text is
+ * edited. Markers inside deleted text end up where the deletion started.
+ *
+ * @param text The text to add the marker to.
+ * @param line The line of the marker.
+ * @param offset The byte offset of the marker in @p line.
+ * @param gravity How the marker moves when text is inserted at it.
+ * @returns The new marker, valid until it is removed with
+ * @ref text_remove_marker or the text is destroyed.
+ */
+struct marker *text_add_marker(struct text *text, uint32_t line,
+                               uint32_t offset, enum marker_gravity gravity);
+
+/**
+ * Remove a marker from a text.
+ *
+ * @param text The text that the marker was added to.
+ * @param marker The marker to remove.
+ */
+void text_remove_marker(struct text *text, struct marker *marker);
+
+/**
+ * Get the current location of a marker.
+ *
+ * @param text The text that the marker was added to.
+ * @param marker The marker.
+ * @returns The location of @p marker, in byte coordinates.
+ */
+struct location text_marker_location(const struct text *text,
+                                     struct marker *marker);
+
 #endif
@@ -14,6 +14,7 @@ struct timer {
   uint64_t min;
   uint64_t samples[NUM_FRAME_SAMPLES];
   struct timespec started_at;
+  bool counter;
 };
 
 HASHMAP_ENTRY_TYPE(timer_entry, struct timer);
@@ -41,7 +42,7 @@ void timers_end_frame(void) {
   g_timers.frame_index = (g_timers.frame_index + 1) % NUM_FRAME_SAMPLES;
 }
 
-struct timer *timer_start(const char *name) {
+static struct timer *get_or_add(const char *name) {
   HASHMAP_GET(&g_timers.timers, struct timer_entry, name, struct timer * t);
   if (t == NULL) {
     HASHMAP_APPEND(&g_timers.timers, struct timer_entry, name,
@@ -55,10 +56,28 @@ struct timer *timer_start(const char *name) {
     new_timer->max = 0;
     new_timer->min = (uint64_t)-1;
     memset(new_timer->samples, 0, sizeof(uint64_t) * NUM_FRAME_SAMPLES);
+    new_timer->counter = false;
 
     t = new_timer;
   }
 
+  return t;
+}
+
+static void add_sample(struct timer *timer, uint64_t value) {
+  if (value > timer->max) {
+    timer->max = value;
+  }
+
+  if (value < timer->min) {
+    timer->min = value;
+  }
+
+  timer->samples[g_timers.frame_index] += value;
+}
+
+struct timer *timer_start(const char *name) {
+  struct timer *t = get_or_add(name);
   clock_gettime(CLOCK_MONOTONIC, &t->started_at);
   return t;
 }
@@ -70,18 +89,18 @@ uint64_t timer_stop(struct timer *timer) {
                      ((uint64_t)timer->started_at.tv_sec * 1e9 +
                       (uint64_t)timer->started_at.tv_nsec);
 
-  if (elapsed > timer->max) {
-    timer->max = elapsed;
-  }
-
-  if (elapsed < timer->min) {
-    timer->min = elapsed;
-  }
-
-  timer->samples[g_timers.frame_index] += elapsed;
+  add_sample(timer, elapsed);
   return elapsed;
 }
 
+void timer_count(const char *name, uint64_t value) {
+  struct timer *t = get_or_add(name);
+  t->counter = true;
+  add_sample(t, value);
+}
+
+bool timer_is_counter(const struct timer *timer) { return timer->counter; }
+
 struct timer *timer_get(const char *name) {
   HASHMAP_GET(&g_timers.timers, struct timer_entry, name, struct timer * t);
   return t;
@@ -1,6 +1,7 @@
 #ifndef _TIMERS_H
 #define _TIMERS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 struct timer;
@@ -11,6 +12,11 @@ void timers_start_frame(void);
 struct timer *timer_start(const char *name);
 uint64_t timer_stop(struct timer *timer);
 struct timer *timer_get(const char *name);
+
+/* Counters are timers that count something other than nanoseconds, like
+ * bytes. */
+void timer_count(const char *name, uint64_t value);
+bool timer_is_counter(const struct timer *timer);
 float timer_average(const struct timer *timer);
 uint64_t timer_min(const struct timer *timer);
 uint64_t timer_max(const struct timer *timer);
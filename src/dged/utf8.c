@@ -71,6 +71,14 @@ static struct codepoint next_utf8_codepoint(uint8_t *bytes, uint64_t nbytes) {
 }
 
 struct codepoint *utf8_next_codepoint(struct utf8_codepoint_iterator *iter) {
+  if (iter->offset >= iter->nbytes && iter->nrest > 0) {
+    iter->offset -= iter->nbytes;
+    iter->data = iter->rest;
+    iter->nbytes = iter->nrest;
+    iter->rest = NULL;
+    iter->nrest = 0;
+  }
+
   if (iter->offset >= iter->nbytes) {
     return NULL;
   }
@@ -91,6 +99,17 @@ create_utf8_codepoint_iterator(uint8_t *data, uint64_t len,
   };
 }
 
+struct utf8_codepoint_iterator
+create_utf8_split_codepoint_iterator(uint8_t *first, uint64_t nfirst,
+                                     uint8_t *second, uint64_t nsecond) {
+  return (struct utf8_codepoint_iterator){
+      .data = first,
+      .nbytes = nfirst,
+      .rest = second,
+      .nrest = nsecond,
+  };
+}
+
 /* TODO: grapheme clusters and other classification, this
  * returns the number of unicode code points
  */
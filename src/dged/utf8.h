@@ -13,12 +13,25 @@ struct utf8_codepoint_iterator {
   uint8_t *data;
   uint64_t nbytes;
   uint64_t offset;
+
+  // bytes that follow `data` when the sequence is stored in two parts
+  uint8_t *rest;
+  uint64_t nrest;
+
   struct codepoint current;
 };
 
 struct utf8_codepoint_iterator
 create_utf8_codepoint_iterator(uint8_t *data, uint64_t len,
                                uint64_t initial_offset);
+
+/*!
+ * \brief Create an iterator over a utf-8 sequence that is stored in two parts,
+ * `first` followed by `second`
+ */
+struct utf8_codepoint_iterator
+create_utf8_split_codepoint_iterator(uint8_t *first, uint64_t nfirst,
+                                     uint8_t *second, uint64_t nsecond);
 struct codepoint *utf8_next_codepoint(struct utf8_codepoint_iterator *iter);
 
 /*!
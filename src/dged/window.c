@@ -6,6 +6,7 @@
 #include "command.h"
 #include "display.h"
 #include "minibuffer.h"
+#include "timers.h"
 
 #include <math.h>
 
@@ -35,6 +36,12 @@ static struct windows {
   BINTREE(window_node) windows;
   struct window *active;
   struct keymap keymap;
+
+  // counts calls to windows_update, for buffer views to know if what they
+  // drew in the previous frame is still on the display
+  uint64_t frame;
+  bool resized;
+  bool popup_was_visible;
 } g_windows;
 
 static struct window g_minibuffer_window;
@@ -194,13 +201,127 @@ void windows_resize(uint32_t height, uint32_t width) {
   g_minibuffer_window.y = height - 1;
 
   window_tree_resize(BINTREE_ROOT(&g_windows.windows), height - 1, width);
+
+  // the display is cleared when resized
+  g_windows.resized = true;
+}
+
+struct view_update {
+  struct buffer_view *view;
+  struct buffer_view_update_params params;
+};
+
+/* Is the buffer of update i also shown by an update before it? */
+static bool shown_before(struct view_update *updates, uint32_t i) {
+  for (uint32_t j = 0; j < i; ++j) {
+    if (updates[j].view->buffer == updates[i].view->buffer) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Update all buffer views that are shown. A buffer can be shown in several of
+ * them, but its update and render hooks are only run once, with the render
+ * hooks getting each separate part of it that is shown.
+ */
+static void update_views(struct view_update *updates, uint32_t nupdates,
+                         void *(*frame_alloc)(size_t)) {
+  struct timer *buffer_update_timer =
+      timer_start("update-windows.buffer-update");
+  for (uint32_t i = 0; i < nupdates; ++i) {
+    if (!shown_before(updates, i)) {
+      buffer_update(updates[i].view->buffer);
+    }
+  }
+  timer_stop(buffer_update_timer);
+
+  struct region *visible = frame_alloc(sizeof(struct region) * nupdates);
+  for (uint32_t i = 0; i < nupdates; ++i) {
+    visible[i] = buffer_view_visible_region(
+        updates[i].view, updates[i].params.width, updates[i].params.height);
+    buffer_view_highlight_region(updates[i].view);
+  }
+
+  struct region *ranges = frame_alloc(sizeof(struct region) * nupdates);
+  for (uint32_t i = 0; i < nupdates; ++i) {
+    if (shown_before(updates, i)) {
+      continue;
+    }
+
+    // collect the parts of the buffer shown by its views, sorted on the first
+    // line
+    struct buffer *buffer = updates[i].view->buffer;
+    uint32_t nranges = 0;
+    for (uint32_t j = i; j < nupdates; ++j) {
+      struct region r = visible[j];
+      if (updates[j].view->buffer != buffer || r.end.line <= r.begin.line ||
+          r.end.col <= r.begin.col) {
+        continue;
+      }
+
+      uint32_t k = nranges++;
+      for (; k > 0 && ranges[k - 1].begin.line > r.begin.line; --k) {
+        ranges[k] = ranges[k - 1];
+      }
+      ranges[k] = r;
+    }
+
+    // merge the ones that overlap or touch, the hooks get the separate parts
+    uint32_t nmerged = 0;
+    for (uint32_t ri = 0; ri < nranges; ++ri) {
+      struct region r = ranges[ri];
+      struct region *last = nmerged > 0 ? &ranges[nmerged - 1] : NULL;
+      if (last == NULL || r.begin.line > last->end.line) {
+        ranges[nmerged++] = r;
+        continue;
+      }
+
+      last->begin.col =
+          r.begin.col < last->begin.col ? r.begin.col : last->begin.col;
+      last->end.line =
+          r.end.line > last->end.line ? r.end.line : last->end.line;
+      last->end.col = r.end.col > last->end.col ? r.end.col : last->end.col;
+    }
+
+    if (nmerged > 0) {
+      buffer_run_render_hooks(buffer, ranges, nmerged);
+    }
+  }
+
+  for (uint32_t i = 0; i < nupdates; ++i) {
+    updates[i].params.hooks_run = true;
+    buffer_view_update(updates[i].view, &updates[i].params);
+  }
 }
 
 void windows_update(void *(*frame_alloc)(size_t), float frame_time) {
+  ++g_windows.frame;
+  uint64_t frame = g_windows.resized ? 0 : g_windows.frame;
+  g_windows.resized = false;
+
+  // the popup is drawn on top of the other windows, which can not keep what
+  // they drew while it is open or just after it was closed
+  uint64_t below_popup_frame =
+      g_popup_visible || g_windows.popup_was_visible ? 0 : frame;
+  g_windows.popup_was_visible = g_popup_visible;
+
+  // the minibuffer, the popup and the windows in the tree
+  uint32_t nupdates = 2;
+  struct window_node *n = BINTREE_ROOT(&g_windows.windows);
+  BINTREE_FIRST(n);
+  while (n != NULL) {
+    nupdates += BINTREE_VALUE(n).type == Window_Buffer;
+    BINTREE_NEXT(n);
+  }
+  struct view_update *updates =
+      frame_alloc(sizeof(struct view_update) * nupdates);
+  nupdates = 0;
 
   struct window *w = &g_minibuffer_window;
   w->x = 0;
-  w->commands = command_list_create(10, frame_alloc, w->x, w->y, "mb-prompt");
+  w->commands = command_list_create(64, frame_alloc, w->x, w->y, "mb-prompt");
 
   // draw the prompt here to make it off-limits for the buffer/buffer view
   uint32_t prompt_len = minibuffer_draw_prompt(w->commands);
@@ -208,22 +329,24 @@ void windows_update(void *(*frame_alloc)(size_t), float frame_time) {
   uint32_t width = prompt_len < w->width ? w->width - prompt_len : 1;
 
   struct command_list *inner_commands = command_list_create(
-      w->height * width, frame_alloc, w->x, w->y, "bufview-mb");
-
-  struct buffer_view_update_params p = {
-      .commands = inner_commands,
-      .window_id = -1,
-      .frame_time = frame_time,
-      .width = width,
-      .height = w->height,
-      .window_x = w->x,
-      .window_y = w->y,
-      .frame_alloc = frame_alloc,
+      w->height * 128, frame_alloc, w->x, w->y, "bufview-mb");
+
+  updates[nupdates++] = (struct view_update){
+      .view = &w->buffer_view,
+      .params =
+          {
+              .commands = inner_commands,
+              .window_id = -1,
+              .frame_time = frame_time,
+              .width = width,
+              .height = w->height,
+              .window_x = w->x,
+              .window_y = w->y,
+              .frame_alloc = frame_alloc,
+              .frame = frame,
+          },
   };
-
-  buffer_view_update(&w->buffer_view, &p);
   command_list_draw_command_list(w->commands, inner_commands);
-
   if (g_popup_visible) {
     w = &g_popup_window;
 
@@ -260,7 +383,7 @@ void windows_update(void *(*frame_alloc)(size_t), float frame_time) {
       width += border_width * 2;
     }
 
-    w->commands = command_list_create(height * width, frame_alloc, w_x, w_y,
+    w->commands = command_list_create(height * 64, frame_alloc, w_x, w_y,
                                       "popup-decor");
     uint32_t x = 0, y = 0;
     if (draw_borders) {
@@ -300,24 +423,27 @@ void windows_update(void *(*frame_alloc)(size_t), float frame_time) {
     }
 
     struct command_list *inner = command_list_create(
-        w->height * w->width, frame_alloc, w_x + x, w_y + y, "bufview-popup");
-
-    struct buffer_view_update_params p = {
-        .commands = inner,
-        .window_id = -1,
-        .frame_time = frame_time,
-        .width = w->width,
-        .height = w->height,
-        .window_x = w_x + x,
-        .window_y = w_y + y,
-        .frame_alloc = frame_alloc,
+        w->height * 128, frame_alloc, w_x + x, w_y + y, "bufview-popup");
+
+    updates[nupdates++] = (struct view_update){
+        .view = &w->buffer_view,
+        .params =
+            {
+                .commands = inner,
+                .window_id = -1,
+                .frame_time = frame_time,
+                .width = w->width,
+                .height = w->height,
+                .window_x = w_x + x,
+                .window_y = w_y + y,
+                .frame_alloc = frame_alloc,
+                .frame = frame,
+            },
     };
-
-    buffer_view_update(&w->buffer_view, &p);
     command_list_draw_command_list(w->commands, inner);
   }
 
-  struct window_node *n = BINTREE_ROOT(&g_windows.windows);
+  n = BINTREE_ROOT(&g_windows.windows);
   BINTREE_FIRST(n);
   uint32_t window_id = 0;
   while (n != NULL) {
@@ -325,26 +451,31 @@ void windows_update(void *(*frame_alloc)(size_t), float frame_time) {
     if (w->type == Window_Buffer) {
       char name[16] = {0};
       snprintf(name, 15, "bufview-%s", w->buffer_view.buffer->name);
-      w->commands = command_list_create(w->height * w->width, frame_alloc, w->x,
+      w->commands = command_list_create(w->height * 128, frame_alloc, w->x,
                                         w->y, name);
 
-      struct buffer_view_update_params p = {
-          .commands = w->commands,
-          .window_id = window_id,
-          .frame_time = frame_time,
-          .width = w->width,
-          .height = w->height,
-          .window_x = w->x,
-          .window_y = w->y,
-          .frame_alloc = frame_alloc,
+      updates[nupdates++] = (struct view_update){
+          .view = &w->buffer_view,
+          .params =
+              {
+                  .commands = w->commands,
+                  .window_id = window_id,
+                  .frame_time = frame_time,
+                  .width = w->width,
+                  .height = w->height,
+                  .window_x = w->x,
+                  .window_y = w->y,
+                  .frame_alloc = frame_alloc,
+                  .frame = below_popup_frame,
+              },
       };
-
-      buffer_view_update(&w->buffer_view, &p);
       ++window_id;
     }
 
     BINTREE_NEXT(n);
   }
+
+  update_views(updates, nupdates, frame_alloc);
 }
 
 void windows_render(struct display *display) {
@@ -364,6 +495,35 @@ void windows_render(struct display *display) {
   }
 }
 
+/* A value that changes when a window shows another buffer, when the popup is
+ * opened or closed, or when the text of any shown buffer is modified.
+ */
+static uint64_t mix_window(uint64_t h, const struct window *w) {
+  const struct buffer *b = w->buffer_view.buffer;
+  h = (h ^ (uint64_t)(uintptr_t)b) * 1099511628211ull;
+  return (h ^ (b != NULL ? text_generation(b->text) : 0)) * 1099511628211ull;
+}
+
+uint64_t windows_content_generation(void) {
+  uint64_t h = 14695981039346656037ull;
+  struct window_node *n = BINTREE_ROOT(&g_windows.windows);
+  BINTREE_FIRST(n);
+  while (n != NULL) {
+    struct window *w = &BINTREE_VALUE(n);
+    if (w->type == Window_Buffer) {
+      h = mix_window(h, w);
+    }
+    BINTREE_NEXT(n);
+  }
+
+  h = mix_window(h, &g_minibuffer_window);
+  if (g_popup_visible) {
+    h = mix_window(h, &g_popup_window);
+  }
+
+  return h;
+}
+
 struct window_node *find_window(struct window *window) {
   struct window_node *n = BINTREE_ROOT(&g_windows.windows);
   BINTREE_FIRST(n);
@@ -421,6 +581,7 @@ void window_set_buffer_e(struct window *window, struct buffer *buffer,
 
       if (window->prev_buffer_view.buffer == buffer) {
 
+        buffer_view_hide(&window->buffer_view);
         struct buffer_view tmp = window->prev_buffer_view;
         window->prev_buffer_view = window->buffer_view;
         window->has_prev_buffer_view = true;
@@ -432,6 +593,7 @@ void window_set_buffer_e(struct window *window, struct buffer *buffer,
       }
     }
 
+    buffer_view_hide(&window->buffer_view);
     window->prev_buffer_view = window->buffer_view;
     window->has_prev_buffer_view = true;
     window->buffer_view = buffer_view_create(buffer, modeline, line_numbers);
@@ -687,4 +849,7 @@ void windows_show_popup(uint32_t row, uint32_t col, uint32_t width,
   g_popup_visible = true;
 }
 
-void windows_close_popup(void) { g_popup_visible = false; }
+void windows_close_popup(void) {
+  buffer_view_hide(&g_popup_window.buffer_view);
+  g_popup_visible = false;
+}
@@ -29,6 +29,7 @@ void windows_destroy(void);
 void windows_resize(uint32_t height, uint32_t width);
 void windows_update(void *(*frame_alloc)(size_t), float frame_time);
 void windows_render(struct display *display);
+uint64_t windows_content_generation(void);
 
 struct window *root_window(void);
 struct window *minibuffer_window(void);
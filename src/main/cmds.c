@@ -204,10 +204,16 @@ void timer_to_list_line(const struct timer *timer, void *userdata) {
 
   static char buf[128];
   const char *name = timer_name(timer);
-  size_t len =
-      snprintf(buf, 128, "%s - %.2f ms (min: %.2f, max: %.2f)", name,
-               (timer_average(timer) / 1e6), timer_min(timer) / (float)1e6,
-               timer_max(timer) / (float)1e6);
+  size_t len = 0;
+  if (timer_is_counter(timer)) {
+    len = snprintf(buf, 128, "%s - %.0f (min: %.0f, max: %.0f)", name,
+                   timer_average(timer), (double)timer_min(timer),
+                   (double)timer_max(timer));
+  } else {
+    len = snprintf(buf, 128, "%s - %.2f ms (min: %.2f, max: %.2f)", name,
+                   (timer_average(timer) / 1e6), timer_min(timer) / (float)1e6,
+                   timer_max(timer) / (float)1e6);
+  }
   buffer_add(target, buffer_end(target), (uint8_t *)buf, len);
 }
 
@@ -625,6 +631,24 @@ static int32_t goto_line(struct command_ctx ctx, int argc, const char *argv[]) {
   return 0;
 }
 
+static int32_t goto_byte(struct command_ctx ctx, int argc, const char *argv[]) {
+  // don't want to goto byte in minibuffer
+  if (ctx.active_window == minibuffer_window()) {
+    return 0;
+  }
+
+  if (argc == 0) {
+    return minibuffer_prompt(ctx, "byte: ");
+  }
+
+  struct buffer_view *v = window_buffer_view(ctx.active_window);
+
+  int64_t offset = atoll(argv[0]);
+  buffer_view_goto(v, buffer_goto_byte(v->buffer, offset > 0 ? offset : 0));
+
+  return 0;
+}
+
 void register_buffer_commands(struct commands *commands) {
   static struct command buffer_commands[] = {
       {.name = "kill-line", .fn = kill_line_cmd},
@@ -656,6 +680,7 @@ void register_buffer_commands(struct commands *commands) {
       {.name = "scroll-up", .fn = scroll_up_cmd},
       {.name = "reload", .fn = reload_cmd},
       {.name = "goto-line", .fn = goto_line},
+      {.name = "goto-byte", .fn = goto_byte},
       {.name = "sort-lines", .fn = sort_lines_cmd},
   };
 
@@ -34,9 +34,14 @@ struct completion_state {
   buffer_keymap_id keymap_id;
   bool keymap_active;
   struct active_completion_ctx *ctx;
+
+  // what the highlight in the completion buffer was made for
+  uint32_t highlighted_completion;
+  uint64_t highlighted_generation;
 } g_state = {0};
 
 static struct buffer *g_target_buffer = NULL;
+static uint32_t g_completion_layer = 0;
 
 static void hide_completion(void);
 
@@ -278,8 +283,17 @@ static void update_completion_buffer(struct buffer *buffer, void *userdata) {
   (void)buffer;
   (void)userdata;
 
-  buffer_add_text_property(
-      g_target_buffer,
+  uint64_t generation = text_generation(g_target_buffer->text);
+  if (g_state.highlighted_generation == generation &&
+      g_state.highlighted_completion == g_state.current_completion) {
+    return;
+  }
+
+  g_state.highlighted_generation = generation;
+  g_state.highlighted_completion = g_state.current_completion;
+  buffer_clear_text_layer(g_target_buffer, g_completion_layer);
+  buffer_add_layer_text_property(
+      g_target_buffer, g_completion_layer,
       (struct location){.line = g_state.current_completion, .col = 0},
       (struct location){.line = g_state.current_completion,
                         .col = buffer_line_length(g_target_buffer,
@@ -295,6 +309,7 @@ static void update_completion_buffer(struct buffer *buffer, void *userdata) {
 
 void init_completion(struct buffers *buffers, struct commands *commands) {
   if (g_target_buffer == NULL) {
+    g_completion_layer = text_property_layer("completion");
     g_target_buffer = buffers_add(buffers, buffer_create("*completions*"));
     buffer_add_update_hook(g_target_buffer, update_completion_buffer, NULL);
   }
@@ -91,7 +91,8 @@ void segfault(int sig) {
 static void clear_buffer_props(struct buffer *buffer, void *userdata) {
   (void)userdata;
 
-  buffer_clear_text_properties(buffer);
+  // properties in other layers are kept until their producers replace them
+  buffer_clear_text_layer(buffer, 0);
 }
 
 struct watched_file {
@@ -254,7 +255,7 @@ int main(int argc, char *argv[]) {
     return 8;
   }
 
-  display = display_create();
+  display = display_create(reactor);
   if (display == NULL) {
     fprintf(stderr, "Failed to set up display: %s\n", strerror(errno));
     return 9;
@@ -370,37 +371,66 @@ int main(int argc, char *argv[]) {
   static char keyname[64] = {0};
   static uint32_t nkeychars = 0;
 
+  /* A frame is only built when something on screen may have changed since the
+   * last one: keys were handled, the terminal was resized, the text of a shown
+   * buffer changed, the minibuffer message timed out or the clock in the
+   * modelines moved to the next minute.
+   */
+  bool redraw = true;
+  uint64_t content_generation = 0;
+  time_t clock_minute = 0;
+
   while (running) {
     timers_start_frame();
     if (display_resized) {
       windows_resize(display_height(display), display_width(display));
       display_resized = false;
+      redraw = true;
     }
 
-    // TODO: maybe this should be hidden behind something
-    // The placement is correct though.
-    buffers_for_each(&buflist, clear_buffer_props, NULL);
+    time_t minute = time(NULL) / 60;
+    if (minute != clock_minute || minibuffer_message_expired() ||
+        windows_content_generation() != content_generation ||
+        display_pending(display)) {
+      redraw = true;
+    }
 
-    /* Update all windows together with the buffers in them. */
-    struct timer *update_windows = timer_start("update-windows");
-    windows_update(frame_alloc, frame_time);
-    timer_stop(update_windows);
+    if (redraw) {
+      // TODO: maybe this should be hidden behind something
+      // The placement is correct though.
+      buffers_for_each(&buflist, clear_buffer_props, NULL);
+
+      /* Update all windows together with the buffers in them. */
+      struct timer *update_windows = timer_start("update-windows");
+      windows_update(frame_alloc, frame_time);
+      timer_stop(update_windows);
+
+      struct window *active_window = windows_get_active();
+
+      /* Update the screen by flushing command lists collected
+       * from updating the buffers.
+       */
+      struct timer *update_display = timer_start("display");
+      display_begin_render(display);
+      windows_render(display);
+      struct buffer_view *view = window_buffer_view(active_window);
+      struct location cursor = buffer_view_dot_to_visual(view);
+      struct window_position winpos = window_position(active_window);
+      display_move_cursor(display, winpos.y + cursor.line,
+                          winpos.x + cursor.col);
+      display_end_render(display);
+      timer_stop(update_display);
+
+      // updating can change buffers too, that is part of this frame
+      content_generation = windows_content_generation();
+      clock_minute = minute;
+      redraw = false;
+    } else {
+      timer_count("frames.skipped-unchanged", 1);
+    }
 
     struct window *active_window = windows_get_active();
 
-    /* Update the screen by flushing command lists collected
-     * from updating the buffers.
-     */
-    struct timer *update_display = timer_start("display");
-    display_begin_render(display);
-    windows_render(display);
-    struct buffer_view *view = window_buffer_view(active_window);
-    struct location cursor = buffer_view_dot_to_visual(view);
-    struct window_position winpos = window_position(active_window);
-    display_move_cursor(display, winpos.y + cursor.line, winpos.x + cursor.col);
-    display_end_render(display);
-    timer_stop(update_display);
-
     /* This blocks for events, so if nothing has happened we block here and let
      * the CPU do something more useful than updating this editor for no reason.
      * This is also the reason that there is no timed scope around this, it
@@ -412,6 +442,11 @@ int main(int argc, char *argv[]) {
     struct keyboard_update kbd_upd =
         keyboard_update(&kbd, reactor, frame_alloc);
 
+    // commands can change anything, always build a frame after them
+    if (kbd_upd.nkeys > 0) {
+      redraw = true;
+    }
+
     for (uint32_t ki = 0; ki < kbd_upd.nkeys; ++ki) {
       struct key *k = &kbd_upd.keys[ki];
 
@@ -491,9 +526,11 @@ int main(int argc, char *argv[]) {
 #endif
 
     // calculate frame time
-    frame_time = timer_average(update_windows) +
-                 timer_average(update_keyboard) + timer_average(update_display);
+    frame_time = timer_average(timer_get("update-windows")) +
+                 timer_average(update_keyboard) +
+                 timer_average(timer_get("display"));
 
+    timer_count("frame-allocator.bytes", frame_allocator.offset);
     timers_end_frame();
     frame_allocator_clear(&frame_allocator);
   }
@@ -19,8 +19,12 @@ enum replace_state {
   Skipped,
 };
 
+/* Matches are kept as markers so that they follow along when the buffer is
+ * edited, for example by replacing an earlier match.
+ */
 struct match {
-  struct region region;
+  struct marker *begin;
+  struct marker *end;
   enum replace_state state;
 };
 
@@ -31,25 +35,63 @@ static struct replace {
   uint32_t current_match;
   buffer_keymap_id keymap_id;
   uint32_t highlight_hook;
+  bool highlighted;
   struct window *window;
+  struct buffer *buffer;
 } g_current_replace = {0};
 
 static struct search {
   bool active;
   char *pattern;
-  struct region *matches;
+  struct match *matches;
   struct buffer *buffer;
   uint32_t nmatches;
   uint32_t current_match;
   uint32_t highlight_hook;
+  bool highlighted;
   buffer_keymap_id keymap_id;
 } g_current_search = {0};
 
-static void highlight_match(struct buffer *buffer, struct region match,
-                            bool current) {
+static uint32_t g_search_layer = 0;
+static uint32_t g_replace_layer = 0;
+
+static struct match *mark_matches(struct buffer *buffer, struct region *regions,
+                                  uint32_t nregions) {
+  struct match *matches = calloc(nregions, sizeof(struct match));
+  for (uint32_t matchi = 0; matchi < nregions; ++matchi) {
+    // text inserted right at a match goes before it
+    matches[matchi] = (struct match){
+        .begin = buffer_marker_create(buffer, regions[matchi].begin,
+                                      MarkerGravity_Right),
+        .end = buffer_marker_create(buffer, regions[matchi].end,
+                                    MarkerGravity_Right),
+        .state = Todo,
+    };
+  }
+
+  return matches;
+}
+
+static void free_matches(struct buffer *buffer, struct match *matches,
+                         uint32_t nmatches) {
+  for (uint32_t matchi = 0; matchi < nmatches; ++matchi) {
+    buffer_marker_destroy(buffer, matches[matchi].begin);
+    buffer_marker_destroy(buffer, matches[matchi].end);
+  }
+
+  free(matches);
+}
+
+static struct region match_region(struct buffer *buffer, struct match *match) {
+  return region_new(buffer_marker_location(buffer, match->begin),
+                    buffer_marker_location(buffer, match->end));
+}
+
+static void highlight_match(struct buffer *buffer, uint32_t layer,
+                            struct region match, bool current) {
   if (current) {
-    buffer_add_text_property(
-        buffer, match.begin, match.end,
+    buffer_add_layer_text_property(
+        buffer, layer, match.begin, match.end,
         (struct text_property){.type = TextProperty_Colors,
                                .data.colors = (struct text_property_colors){
                                    .set_bg = true,
@@ -59,8 +101,8 @@ static void highlight_match(struct buffer *buffer, struct region match,
                                }});
 
   } else {
-    buffer_add_text_property(
-        buffer, match.begin, match.end,
+    buffer_add_layer_text_property(
+        buffer, layer, match.begin, match.end,
         (struct text_property){.type = TextProperty_Colors,
                                .data.colors = (struct text_property_colors){
                                    .set_bg = true,
@@ -74,29 +116,46 @@ static void highlight_match(struct buffer *buffer, struct region match,
 static void search_highlight_hook(struct buffer *buffer, void *userdata) {
   (void)userdata;
 
+  // highlights stay until the matches change
+  if (g_current_search.highlighted) {
+    return;
+  }
+
+  buffer_clear_text_layer(buffer, g_search_layer);
   for (uint32_t matchi = 0; matchi < g_current_search.nmatches; ++matchi) {
-    highlight_match(buffer, g_current_search.matches[matchi],
+    highlight_match(buffer, g_search_layer,
+                    match_region(buffer, &g_current_search.matches[matchi]),
                     matchi == g_current_search.current_match);
   }
+  g_current_search.highlighted = true;
 }
 
 static void replace_highlight_hook(struct buffer *buffer, void *userdata) {
   (void)userdata;
 
+  if (g_current_replace.highlighted) {
+    return;
+  }
+
+  buffer_clear_text_layer(buffer, g_replace_layer);
   for (uint32_t matchi = 0; matchi < g_current_replace.nmatches; ++matchi) {
     struct match *m = &g_current_replace.matches[matchi];
     if (m->state != Todo) {
       continue;
     }
 
-    highlight_match(buffer, m->region,
+    highlight_match(buffer, g_replace_layer, match_region(buffer, m),
                     matchi == g_current_replace.current_match);
   }
+  g_current_replace.highlighted = true;
 }
 
 static void clear_replace(void) {
   buffer_remove_keymap(g_current_replace.keymap_id);
-  free(g_current_replace.matches);
+  if (g_current_replace.buffer != NULL) {
+    free_matches(g_current_replace.buffer, g_current_replace.matches,
+                 g_current_replace.nmatches);
+  }
   free(g_current_replace.replace);
   g_current_replace.matches = NULL;
   g_current_replace.replace = NULL;
@@ -105,9 +164,12 @@ static void clear_replace(void) {
   if (g_current_replace.window != NULL) {
     buffer_remove_update_hook(window_buffer(g_current_replace.window),
                               g_current_replace.highlight_hook, NULL);
+    buffer_clear_text_layer(window_buffer(g_current_replace.window),
+                            g_replace_layer);
   }
   g_current_replace.highlight_hook = 0;
   g_current_replace.window = NULL;
+  g_current_replace.buffer = NULL;
 }
 
 void abort_replace(void) {
@@ -118,7 +180,10 @@ void abort_replace(void) {
 static void clear_search(void) {
   // n.b. leak the pattern on purpose so
   // it can be used to recall previous searches.
-  free(g_current_search.matches);
+  if (g_current_search.buffer != NULL) {
+    free_matches(g_current_search.buffer, g_current_search.matches,
+                 g_current_search.nmatches);
+  }
   g_current_search.matches = NULL;
   g_current_search.nmatches = 0;
 
@@ -126,6 +191,7 @@ static void clear_search(void) {
       g_current_search.highlight_hook != (uint32_t)-1) {
     buffer_remove_update_hook(g_current_search.buffer,
                               g_current_search.highlight_hook, NULL);
+    buffer_clear_text_layer(g_current_search.buffer, g_search_layer);
   }
   g_current_search.highlight_hook = -1;
   g_current_search.active = false;
@@ -162,10 +228,11 @@ static void start_search(struct buffer *buffer, const char *pattern) {
 
   // clear out any old search results
   if (g_current_search.matches != NULL) {
-    free(g_current_search.matches);
+    free_matches(buffer, g_current_search.matches, g_current_search.nmatches);
     g_current_search.matches = NULL;
     g_current_search.nmatches = 0;
   }
+  g_current_search.highlighted = false;
 }
 
 uint64_t matchdist(struct region *match, struct location loc) {
@@ -199,44 +266,22 @@ static int32_t replace_next(struct command_ctx ctx, int argc,
   struct match *match = &state->matches[state->current_match];
 
   // buffer_delete is not inclusive
-  struct region to_delete = match->region;
+  struct region to_delete = match_region(buffer, match);
   ++to_delete.end.col;
 
+  // the markers of the following matches move with these edits
   struct location loc = buffer_delete(buffer, to_delete);
-  struct location after = buffer_add(buffer, loc, (uint8_t *)state->replace,
-                                     strlen(state->replace));
+  buffer_add(buffer, loc, (uint8_t *)state->replace, strlen(state->replace));
   match->state = Replaced;
 
-  // update all following matches
-  int64_t linedelta = (int64_t)after.line - (int64_t)to_delete.end.line;
-  int64_t coldelta = linedelta == 0
-                         ? (int64_t)after.col - (int64_t)to_delete.end.col
-                         : (int64_t)after.col;
-  for (uint32_t matchi = state->current_match; matchi < state->nmatches;
-       ++matchi) {
-    struct match *m = &state->matches[matchi];
-
-    m->region.begin.line += linedelta;
-    m->region.end.line += linedelta;
-
-    if (after.line == m->region.begin.line) {
-      m->region.begin.col += coldelta;
-    }
-
-    if (after.line == m->region.end.line) {
-      m->region.end.col += coldelta;
-    }
-  }
-
   // advance to the next match
   ++state->current_match;
+  state->highlighted = false;
   if (state->current_match == state->nmatches) {
     abort_replace();
   } else {
     struct match *m = &state->matches[state->current_match];
-    buffer_view_goto(buffer_view,
-                     (struct location){.line = m->region.begin.line,
-                                       .col = m->region.begin.col});
+    buffer_view_goto(buffer_view, buffer_marker_location(buffer, m->begin));
   }
 
   return 0;
@@ -250,21 +295,21 @@ static int32_t skip_next(struct command_ctx ctx, int argc, const char *argv[]) {
   struct replace *state = &g_current_replace;
 
   struct buffer_view *buffer_view = window_buffer_view(state->window);
+  struct buffer *buffer = buffer_view->buffer;
   struct match *m = &state->matches[state->current_match];
+  struct location end = buffer_marker_location(buffer, m->end);
   buffer_view_goto(buffer_view,
-                   (struct location){.line = m->region.end.line,
-                                     .col = m->region.end.col + 1});
+                   (struct location){.line = end.line, .col = end.col + 1});
   m->state = Skipped;
 
   ++state->current_match;
+  state->highlighted = false;
 
   if (state->current_match == state->nmatches) {
     abort_replace();
   } else {
     m = &state->matches[state->current_match];
-    buffer_view_goto(buffer_view,
-                     (struct location){.line = m->region.begin.line,
-                                       .col = m->region.begin.col});
+    buffer_view_goto(buffer_view, buffer_marker_location(buffer, m->begin));
   }
 
   return 0;
@@ -321,25 +366,18 @@ static int32_t replace(struct command_ctx ctx, int argc, const char *argv[]) {
   // sort matches
   qsort(matches, nmatches, sizeof(struct region), cmp_matches);
 
-  struct match *match_states = calloc(nmatches, sizeof(struct match));
-  for (uint32_t matchi = 0; matchi < nmatches; ++matchi) {
-    match_states[matchi].region = matches[matchi];
-    match_states[matchi].state = Todo;
-  }
-  free(matches);
-
   g_current_replace = (struct replace){
       .replace = strdup(argv[1]),
-      .matches = match_states,
+      .matches = mark_matches(buffer_view->buffer, matches, nmatches),
       .nmatches = nmatches,
       .current_match = 0,
       .window = ctx.active_window,
+      .buffer = buffer_view->buffer,
   };
 
   // goto first match
-  struct region *m = &g_current_replace.matches[0].region;
-  buffer_view_goto(buffer_view, (struct location){.line = m->begin.line,
-                                                  .col = m->begin.col});
+  buffer_view_goto(buffer_view, matches[0].begin);
+  free(matches);
 
   struct binding bindings[] = {
       ANONYMOUS_BINDING(None, 'y', &replace_next_command),
@@ -394,21 +432,25 @@ static bool do_search(struct buffer_view *view, const char *pattern,
                       bool reverse) {
   start_search(view->buffer, pattern);
 
-  buffer_find(view->buffer, g_current_search.pattern, &g_current_search.matches,
-              &g_current_search.nmatches);
+  struct region *matches = NULL;
+  uint32_t nmatches = 0;
+  buffer_find(view->buffer, g_current_search.pattern, &matches, &nmatches);
 
-  if (g_current_search.nmatches > 0) {
+  bool found = nmatches > 0;
+  if (found) {
     // find the "nearest" match
     uint32_t closest_idx = 0;
     struct region *closest =
-        find_closest(g_current_search.matches, g_current_search.nmatches,
-                     view->dot, reverse, &closest_idx);
+        find_closest(matches, nmatches, view->dot, reverse, &closest_idx);
     buffer_view_goto(view, closest->begin);
+    g_current_search.matches = mark_matches(view->buffer, matches, nmatches);
+    g_current_search.nmatches = nmatches;
     g_current_search.current_match = closest_idx;
-    return true;
+    g_current_search.highlighted = false;
   }
 
-  return false;
+  free(matches);
+  return found;
 }
 
 static const char *get_pattern() {
@@ -495,6 +537,9 @@ int32_t find(struct command_ctx ctx, int argc, const char *argv[]) {
 }
 
 void register_search_replace_commands(struct commands *commands) {
+  g_search_layer = text_property_layer("search");
+  g_replace_layer = text_property_layer("replace");
+
   struct command search_replace_commands[] = {
       {.name = "find-next", .fn = find, .userdata = &search_dir_forward},
       {.name = "find-prev", .fn = find, .userdata = &search_dir_backward},
@@ -1,6 +1,8 @@
 #include <string.h>
 
+#include "dged/allocator.h"
 #include "dged/buffer.h"
+#include "dged/display.h"
 #include "dged/settings.h"
 
 #include "assert.h"
@@ -191,8 +193,9 @@ void test_copy(void) {
   buffer_paste(&b, (struct location){.line = 0, .col = 4});
   ASSERT(buffer_line_length(&b, 0) == 8, "Expected text to be copied");
   struct text_chunk t = buffer_line(&b, 0);
-  ASSERT_STR_EQ((const char *)t.text, "copycopy",
-                "Expected copied text to match");
+  ASSERT(t.nbytes == 8 &&
+             strncmp((const char *)t.text, "copycopy", t.nbytes) == 0,
+         "Expected copied text to match");
   if (t.allocated) {
     free(t.text);
   }
@@ -202,8 +205,9 @@ void test_copy(void) {
   buffer_paste(&b, (struct location){.line = 0, .col = 0});
   ASSERT(buffer_line_length(&b, 0) == 8, "Expected line length to be the same");
   t = buffer_line(&b, 0);
-  ASSERT_STR_EQ((const char *)t.text, "pycocopy",
-                "Expected cut+pasted text to match");
+  ASSERT(t.nbytes == 8 &&
+             strncmp((const char *)t.text, "pycocopy", t.nbytes) == 0,
+         "Expected cut+pasted text to match");
   if (t.allocated) {
     free(t.text);
   }
@@ -213,8 +217,9 @@ void test_copy(void) {
   ASSERT(buffer_line_length(&b, 0) == 12,
          "Expected line length to have increased when pasting older");
   t = buffer_line(&b, 0);
-  ASSERT_STR_EQ((const char *)t.text, "copypycocopy",
-                "Expected pasted older text to match");
+  ASSERT(t.nbytes == 12 &&
+             strncmp((const char *)t.text, "copypycocopy", t.nbytes) == 0,
+         "Expected pasted older text to match");
   if (t.allocated) {
     free(t.text);
   }
@@ -222,6 +227,178 @@ void test_copy(void) {
   buffer_destroy(&b);
 }
 
+void test_goto_byte(void) {
+  struct buffer b = buffer_create("test-goto-byte-buffer");
+  const char *txt = "ab\tc\ndef\nx";
+  buffer_add(&b, (struct location){.line = 0, .col = 0}, (uint8_t *)txt,
+             strlen(txt));
+
+  struct location loc = buffer_goto_byte(&b, 3);
+  ASSERT(loc.line == 0 && loc.col == 6,
+         "Expected byte after tab to be at column 6");
+
+  loc = buffer_goto_byte(&b, 5);
+  ASSERT(loc.line == 1 && loc.col == 0,
+         "Expected byte after newline to be at start of next line");
+
+  loc = buffer_goto_byte(&b, 7);
+  ASSERT(loc.line == 1 && loc.col == 2, "Expected offset 7 to be at (1, 2)");
+
+  loc = buffer_goto_byte(&b, 100);
+  ASSERT(loc.line == 2 && loc.col == 1,
+         "Expected offset past the end to be clamped to buffer end");
+
+  buffer_destroy(&b);
+}
+
+void test_long_line_typing(void) {
+  struct buffer b = buffer_create("test-long-line-buffer");
+  char line[300];
+  for (uint32_t i = 0; i < sizeof(line); ++i) {
+    line[i] = 'a' + i % 26;
+  }
+  buffer_add(&b, (struct location){.line = 0, .col = 0}, (uint8_t *)line,
+             sizeof(line));
+
+  // type in the middle of the line, one character at a time
+  struct location at = {.line = 0, .col = 150};
+  for (uint32_t i = 0; i < 100; ++i) {
+    at = buffer_add(&b, at, (uint8_t *)"-", 1);
+  }
+  ASSERT(at.line == 0 && at.col == 250, "Expected to end up after typing");
+  ASSERT(buffer_line_length(&b, 0) == 400, "Expected line to grow");
+
+  struct text_chunk t = buffer_line(&b, 0);
+  ASSERT(t.nbytes == 400 && memcmp(t.text, line, 150) == 0 &&
+             t.text[150] == '-' && t.text[249] == '-' &&
+             memcmp(t.text + 250, line + 150, 150) == 0,
+         "Expected typed text to be in the middle of the line");
+
+  // backspace it all again
+  for (uint32_t i = 0; i < 100; ++i) {
+    struct location prev = {.line = 0, .col = at.col - 1};
+    at = buffer_delete(&b, region_new(prev, at));
+  }
+  ASSERT(at.line == 0 && at.col == 150, "Expected to end up where we started");
+  t = buffer_line(&b, 0);
+  ASSERT(t.nbytes == 300 && memcmp(t.text, line, 300) == 0,
+         "Expected line to be restored after deleting typed text");
+
+  // split the line at the edit point and join it again
+  buffer_add(&b, at, (uint8_t *)"\n", 1);
+  ASSERT(buffer_num_lines(&b) == 2 && buffer_line_length(&b, 0) == 150 &&
+             buffer_line_length(&b, 1) == 150,
+         "Expected line to be split in two");
+  buffer_delete(&b, region_new(at, (struct location){.line = 1, .col = 0}));
+  t = buffer_line(&b, 0);
+  ASSERT(buffer_num_lines(&b) == 1 && t.nbytes == 300 &&
+             memcmp(t.text, line, 300) == 0,
+         "Expected line to be joined again");
+
+  buffer_destroy(&b);
+}
+
+void test_markers(void) {
+  struct buffer b = buffer_create("test-markers-buffer");
+  const char *txt = "a\tb\xc3\xa5" "c\ndef";
+  buffer_add(&b, (struct location){.line = 0, .col = 0}, (uint8_t *)txt,
+             strlen(txt));
+
+  // at the two byte å, after a tab
+  struct marker *before =
+      buffer_marker_create(&b, (struct location){.line = 0, .col = 6},
+                           MarkerGravity_Left);
+  struct marker *after =
+      buffer_marker_create(&b, (struct location){.line = 0, .col = 6},
+                           MarkerGravity_Right);
+  struct location loc = buffer_marker_location(&b, before);
+  ASSERT(loc.line == 0 && loc.col == 6,
+         "Expected marker to be where it was created");
+
+  buffer_add(&b, (struct location){.line = 0, .col = 6}, (uint8_t *)"xy", 2);
+  loc = buffer_marker_location(&b, before);
+  ASSERT(loc.line == 0 && loc.col == 6,
+         "Expected left gravity marker to stay before inserted text");
+  loc = buffer_marker_location(&b, after);
+  ASSERT(loc.line == 0 && loc.col == 8,
+         "Expected right gravity marker to move after inserted text");
+
+  buffer_add(&b, (struct location){.line = 0, .col = 0}, (uint8_t *)"\n", 1);
+  loc = buffer_marker_location(&b, after);
+  ASSERT(loc.line == 1 && loc.col == 8,
+         "Expected marker to move down with its line");
+
+  buffer_delete(&b, region_new((struct location){.line = 1, .col = 0},
+                               (struct location){.line = 1, .col = 7}));
+  loc = buffer_marker_location(&b, before);
+  ASSERT(loc.line == 1 && loc.col == 0,
+         "Expected marker in deleted text to move to the start of it");
+  loc = buffer_marker_location(&b, after);
+  ASSERT(loc.line == 1 && loc.col == 1,
+         "Expected marker after deleted text to move back");
+
+  buffer_marker_destroy(&b, before);
+  buffer_marker_destroy(&b, after);
+  buffer_destroy(&b);
+}
+
+static struct frame_allocator *g_render_alloc = NULL;
+static void *render_alloc(size_t sz) {
+  return frame_allocator_alloc(g_render_alloc, sz);
+}
+
+static uint32_t render_callback_call_count = 0;
+static uint32_t render_callback_nshown = 0;
+static void render_callback(struct buffer *buffer, void *userdata,
+                            const struct region *shown, uint32_t nshown) {
+  (void)buffer;
+  (void)userdata;
+  (void)shown;
+  render_callback_nshown = nshown;
+  ++render_callback_call_count;
+}
+
+void test_render_hooks(void) {
+  struct frame_allocator alloc = frame_allocator_create(1024 * 1024);
+  g_render_alloc = &alloc;
+
+  struct buffer b = buffer_create("test-render-hooks-buffer");
+  buffer_add(&b, (struct location){.line = 0, .col = 0}, (uint8_t *)"hej", 3);
+  buffer_add_render_hook(&b, render_callback, NULL);
+
+  struct buffer_render_params params = {
+      .commands = command_list_create(10, render_alloc, 0, 0, "test"),
+      .origin = (struct location){.line = 0, .col = 0},
+      .width = 10,
+      .height = 2,
+      .frame_alloc = render_alloc,
+  };
+  buffer_render(&b, &params);
+  ASSERT(render_callback_call_count == 1,
+         "Expected render hook to be called when rendering");
+
+  ASSERT(render_callback_nshown == 1,
+         "Expected render hook to get the rendered part of the buffer");
+
+  // already run for all of the places the buffer is rendered in
+  struct region shown[] = {
+      {.begin = {.line = 0, .col = 0}, .end = {.line = 2, .col = 10}},
+      {.begin = {.line = 40, .col = 0}, .end = {.line = 42, .col = 10}},
+  };
+  buffer_run_render_hooks(&b, shown, 2);
+  params.skip_render_hooks = true;
+  buffer_render(&b, &params);
+  buffer_render(&b, &params);
+  ASSERT(render_callback_call_count == 2,
+         "Expected render hook to only be called once when skipped in render");
+  ASSERT(render_callback_nshown == 2,
+         "Expected render hook to get all parts of the buffer that are shown");
+
+  buffer_destroy(&b);
+  frame_allocator_destroy(&alloc);
+  g_render_alloc = NULL;
+}
+
 void run_buffer_tests(void) {
   settings_init(10);
   settings_set_default(
@@ -235,5 +412,9 @@ void run_buffer_tests(void) {
   run_test(test_char_movement);
   run_test(test_word_movement);
   run_test(test_copy);
+  run_test(test_goto_byte);
+  run_test(test_long_line_typing);
+  run_test(test_markers);
+  run_test(test_render_hooks);
   settings_destroy();
 }
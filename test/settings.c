@@ -45,9 +45,12 @@ void test_set(void) {
       (struct setting_value){.type = Setting_Bool, .data.bool_value = false});
 
   // test that wrong type is ignored;
+  uint64_t generation = settings_generation();
   settings_set("my.setting",
                (struct setting_value){.type = Setting_String,
                                       .data.string_value = "bonan"});
+  ASSERT(settings_generation() == generation,
+         "Expected ignored value to not change the settings generation");
 
   struct setting *s = settings_get("my.setting");
   ASSERT(s != NULL, "Expected setting to exist after being inserted");
@@ -66,6 +69,8 @@ void test_set(void) {
          "Expected inserted setting type to not have been changed");
   ASSERT(s->value.data.bool_value,
          "Expected inserted setting value to _have_ been changed");
+  ASSERT(settings_generation() != generation,
+         "Expected changed value to change the settings generation");
 
   settings_destroy();
 }
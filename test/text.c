@@ -1,5 +1,8 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <wchar.h>
 
 #include "dged/text.h"
@@ -13,11 +16,11 @@ static void assert_line_eq(struct text_chunk line, const char *txt,
   ASSERT(strncmp((const char *)line.text, txt, line.nbytes) == 0, msg);
 }
 
-void test_add_text(void) {
+static void add_text(enum text_storage storage) {
   uint32_t lines_added;
 
   /* use a silly small initial capacity to test re-alloc */
-  struct text *t = text_create(1);
+  struct text *t = text_create(1, storage);
 
   const char *txt = "This is line 1\n";
   text_insert_at(t, 0, 0, (uint8_t *)txt, strlen(txt), &lines_added);
@@ -65,9 +68,9 @@ void test_add_text(void) {
   text_destroy(t);
 }
 
-void test_delete_text(void) {
+static void delete_text(enum text_storage storage) {
   uint32_t lines_added;
-  struct text *t = text_create(10);
+  struct text *t = text_create(10, storage);
   const char *txt = "This is line 1";
   text_insert_at(t, 0, 0, (uint8_t *)txt, strlen(txt), &lines_added);
 
@@ -101,7 +104,7 @@ void test_delete_text(void) {
   ASSERT(strncmp((const char *)line2.text, "This is line 3", line2.nbytes) == 0,
          "Expected lines to have shifted upwards after deleting");
 
-  struct text *t3 = text_create(10);
+  struct text *t3 = text_create(10, storage);
   const char *delete_me = "This is line🎙\nQ";
   text_insert_at(t3, 0, 0, (uint8_t *)delete_me, strlen(delete_me),
                  &lines_added);
@@ -114,7 +117,7 @@ void test_delete_text(void) {
   ASSERT(text_num_lines(t3) == 1,
          "Expected text to have one line after deleting newline");
 
-  struct text *t4 = text_create(10);
+  struct text *t4 = text_create(10, storage);
   const char *deletable_text = "Only one line kinda";
   text_append(t4, (uint8_t *)deletable_text, strlen(deletable_text),
               &lines_added);
@@ -128,7 +131,969 @@ void test_delete_text(void) {
   text_destroy(t4);
 }
 
+void test_add_text_lines(void) { add_text(TextStorage_Lines); }
+void test_add_text_piece_table(void) { add_text(TextStorage_PieceTable); }
+
+void test_delete_text_lines(void) { delete_text(TextStorage_Lines); }
+void test_delete_text_piece_table(void) {
+  delete_text(TextStorage_PieceTable);
+}
+
+static uint8_t *copy_bytes(const char *txt) {
+  uint8_t *bytes = malloc(strlen(txt));
+  memcpy(bytes, txt, strlen(txt));
+  return bytes;
+}
+
+static void load_text(enum text_storage storage) {
+  uint32_t lines_added;
+  struct text *t = text_create(10, storage);
+  const char *txt = "first\nsecond line\n\nlast";
+  text_load(t, copy_bytes(txt), strlen(txt));
+
+  ASSERT(text_num_lines(t) == 4, "Expected four lines after loading");
+  assert_line_eq(text_get_line(t, 1), "second line",
+                 "Expected second line to be loaded");
+  ASSERT(text_line_size(t, 2) == 0, "Expected third line to be empty");
+
+  text_insert_at(t, 1, 6, (uint8_t *)" fine", 5, &lines_added);
+  assert_line_eq(text_get_line(t, 1), "second fine line",
+                 "Expected insert into loaded line to work");
+  assert_line_eq(text_get_line(t, 0), "first",
+                 "Expected other lines to be left alone");
+
+  text_insert_at(t, 0, 2, (uint8_t *)"\n", 1, &lines_added);
+  assert_line_eq(text_get_line(t, 0), "fi", "Expected loaded line to split");
+  assert_line_eq(text_get_line(t, 1), "rst", "Expected loaded line to split");
+
+  text_delete(t, 1, 1, 4, 2);
+  ASSERT(text_num_lines(t) == 2, "Expected lines to be deleted");
+  assert_line_eq(text_get_line(t, 1), "rst",
+                 "Expected lines to be joined after delete");
+
+  // loading again replaces the contents
+  const char *txt2 = "new";
+  text_load(t, copy_bytes(txt2), strlen(txt2));
+  ASSERT(text_num_lines(t) == 1, "Expected one line after loading again");
+  assert_line_eq(text_get_line(t, 0), "new",
+                 "Expected text to be replaced when loading");
+
+  text_destroy(t);
+}
+
+void test_load_lines(void) { load_text(TextStorage_Lines); }
+void test_load_piece_table(void) { load_text(TextStorage_PieceTable); }
+
+static void count_line(struct text_chunk *chunk, void *userdata) {
+  (void)chunk;
+  ++*(uint32_t *)userdata;
+}
+
+static void mapped_text(enum text_storage storage) {
+  uint32_t lines_added;
+  char path[] = "/tmp/dged-test-mapped-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(fd >= 0, "Expected to be able to create a temporary file");
+
+  // more lines than are indexed up front
+  const uint32_t nlines = 20000;
+  char buf[32];
+  for (uint32_t i = 0; i < nlines; ++i) {
+    int len = snprintf(buf, sizeof(buf), "line %u\n", i);
+    ASSERT(write(fd, buf, len) == len, "Expected to write test file");
+  }
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  unlink(path);
+  ASSERT(data != MAP_FAILED, "Expected to be able to map test file");
+
+  struct text *t = text_create(10, storage);
+  text_load_mapped(t, data, size, size - 1);
+  ASSERT(text_is_mapped(t), "Expected text to be mapped");
+  ASSERT(text_num_lines(t) <= nlines,
+         "Expected line count of a mapped text to not wait for the index");
+  uint32_t nvisited = 0;
+  text_for_each_line(t, 0, UINT32_MAX - 1, count_line, &nvisited);
+  ASSERT(nvisited == nlines, "Expected to visit all lines of a mapped text");
+  ASSERT(text_wait_num_lines(t) == nlines && text_num_lines_known(t),
+         "Expected waiting for the line count to include all of the file");
+  assert_line_eq(text_get_line(t, 0), "line 0", "Expected first line");
+  assert_line_eq(text_get_line(t, nlines - 1), "line 19999",
+                 "Expected to wait for the last line to be indexed");
+  ASSERT(text_num_lines(t) == nlines,
+         "Expected all lines to be indexed after waiting for the last one");
+
+  struct text_chunk region = text_get_region(t, 1, 0, 2, 0);
+  ASSERT(region.nbytes == 7 && memcmp(region.text, "line 1\n", 7) == 0,
+         "Expected to be able to get a region from a mapped text");
+  free(region.text);
+
+  struct location loc = text_offset_location(t, 9);
+  ASSERT(loc.line == 1 && loc.col == 2,
+         "Expected offset in mapped text to be on second line");
+
+  text_insert_at(t, 5, 0, (uint8_t *)"edited ", 7, &lines_added);
+  ASSERT(!text_is_mapped(t), "Expected text to not be mapped after edit");
+  ASSERT(text_num_lines(t) == nlines,
+         "Expected line count to be the same after edit");
+  assert_line_eq(text_get_line(t, 5), "edited line 5",
+                 "Expected edited line to be changed");
+  assert_line_eq(text_get_line(t, nlines - 1), "line 19999",
+                 "Expected other lines to be intact after edit");
+
+  text_destroy(t);
+}
+
+void test_mapped_lines(void) { mapped_text(TextStorage_Lines); }
+void test_mapped_piece_table(void) { mapped_text(TextStorage_PieceTable); }
+
+static void offsets(enum text_storage storage) {
+  uint32_t lines_added;
+  struct text *t = text_create(10, storage);
+  const char *txt = "abc\n\nde\nf";
+  text_insert_at(t, 0, 0, (uint8_t *)txt, strlen(txt), &lines_added);
+
+  ASSERT(text_line_offset(t, 0) == 0, "Expected first line to start at 0");
+  ASSERT(text_line_offset(t, 1) == 4, "Expected second line to start at 4");
+  ASSERT(text_line_offset(t, 2) == 5, "Expected third line to start at 5");
+  ASSERT(text_line_offset(t, 3) == 8, "Expected fourth line to start at 8");
+  ASSERT(text_line_offset(t, 4) == 9,
+         "Expected line past the end to be at the end");
+
+  struct location loc = text_offset_location(t, 6);
+  ASSERT(loc.line == 2 && loc.col == 1, "Expected offset 6 to be at (2, 1)");
+  loc = text_offset_location(t, 3);
+  ASSERT(loc.line == 0 && loc.col == 3,
+         "Expected newline to be at the end of its line");
+  loc = text_offset_location(t, 100);
+  ASSERT(loc.line == 3 && loc.col == 1,
+         "Expected offset past the end to be clamped");
+
+  text_delete(t, 0, 1, 2, 0);
+  ASSERT(text_line_offset(t, 1) == 4,
+         "Expected offsets to be updated after delete");
+
+  text_destroy(t);
+}
+
+void test_offsets_lines(void) { offsets(TextStorage_Lines); }
+void test_offsets_piece_table(void) { offsets(TextStorage_PieceTable); }
+
+static void many_lines(enum text_storage storage) {
+  uint32_t lines_added;
+  struct text *t = text_create(10, storage);
+  char buf[32];
+
+  // insert lines in the middle, enough to span several blocks of lines
+  for (uint32_t i = 0; i < 5000; ++i) {
+    uint32_t nlines = text_num_lines(t);
+    snprintf(buf, sizeof(buf), "%u\n", i);
+    text_insert_at(t, nlines / 2, 0, (uint8_t *)buf, strlen(buf),
+                   &lines_added);
+  }
+
+  ASSERT(text_num_lines(t) == 5001, "Expected 5000 lines plus an empty one");
+  assert_line_eq(text_get_line(t, 1), "2", "Expected third line second");
+  assert_line_eq(text_get_line(t, 2500), "4999",
+                 "Expected last line to be in the middle");
+  assert_line_eq(text_get_line(t, 4999), "1",
+                 "Expected second line to be pushed to the bottom");
+
+  // delete every other line
+  for (uint32_t i = 0; i < 2500; ++i) {
+    text_delete(t, i, 0, i + 1, 0);
+  }
+
+  ASSERT(text_num_lines(t) == 2501, "Expected half of the lines to be gone");
+
+  uint64_t offset = 0;
+  for (uint32_t line = 0; line < text_num_lines(t); ++line) {
+    ASSERT(text_line_offset(t, line) == offset,
+           "Expected line offset to be the sum of preceding lines");
+    struct location loc = text_offset_location(t, offset);
+    ASSERT(loc.line == line && loc.col == 0,
+           "Expected line offset to map back to the line");
+    offset += text_line_size(t, line) + 1;
+  }
+  assert_line_eq(text_get_line(t, 1), "6",
+                 "Expected lines to shift upwards after deletion");
+  assert_line_eq(text_get_line(t, 2499), "1",
+                 "Expected last line to be kept");
+
+  text_delete(t, 0, 0, text_num_lines(t), 0);
+  ASSERT(text_num_lines(t) == 0, "Expected text to be empty");
+
+  text_destroy(t);
+}
+
+void test_many_lines_lines(void) { many_lines(TextStorage_Lines); }
+void test_many_lines_piece_table(void) { many_lines(TextStorage_PieceTable); }
+
+static void short_lines(enum text_storage storage) {
+  uint32_t lines_added;
+  struct text *t = text_create(10, storage);
+
+  // grow a short line until it no longer fits in the line itself
+  const char *txt = "short\nline";
+  text_insert_at(t, 0, 0, (uint8_t *)txt, strlen(txt), &lines_added);
+  const char *more = " that keeps on growing";
+  text_insert_at(t, 0, 5, (uint8_t *)more, strlen(more), &lines_added);
+  ASSERT(text_line_size(t, 0) == 27, "Expected line to grow to 27 bytes");
+  assert_line_eq(text_get_line(t, 0), "short that keeps on growing",
+                 "Expected long line to keep its contents");
+
+  // and shrink it back again
+  text_delete(t, 0, 5, 0, 27);
+  ASSERT(text_line_size(t, 0) == 5, "Expected line to shrink to 5 bytes");
+  assert_line_eq(text_get_line(t, 0), "short",
+                 "Expected short line to keep its contents");
+
+  // split a long line into two short ones and a short line off a long one
+  const char *long_line = "\nabcdefghijklmnopqrstuvwxyz0123456789";
+  text_insert_at(t, 1, 4, (uint8_t *)long_line, strlen(long_line),
+                 &lines_added);
+  ASSERT(text_num_lines(t) == 3, "Expected a new line to be added");
+  assert_line_eq(text_get_line(t, 1), "line", "Expected line to be split");
+  assert_line_eq(text_get_line(t, 2), "abcdefghijklmnopqrstuvwxyz0123456789",
+                 "Expected long line to be added");
+
+  text_insert_at(t, 2, 30, (uint8_t *)"\n", 1, &lines_added);
+  assert_line_eq(text_get_line(t, 2), "abcdefghijklmnopqrstuvwxyz0123",
+                 "Expected long line to be split");
+  assert_line_eq(text_get_line(t, 3), "456789",
+                 "Expected short line to be split off");
+
+  text_insert_at(t, 2, 10, (uint8_t *)"\n", 1, &lines_added);
+  assert_line_eq(text_get_line(t, 2), "abcdefghij",
+                 "Expected long line to be split into short lines");
+  assert_line_eq(text_get_line(t, 3), "klmnopqrstuvwxyz0123",
+                 "Expected long line to be split into short lines");
+
+  // join them back together
+  text_delete(t, 2, 10, 3, 0);
+  text_delete(t, 2, 30, 3, 0);
+  ASSERT(text_num_lines(t) == 3, "Expected lines to be joined");
+  assert_line_eq(text_get_line(t, 2), "abcdefghijklmnopqrstuvwxyz0123456789",
+                 "Expected joined line to have the contents of both lines");
+
+  text_destroy(t);
+}
+
+void test_short_lines_lines(void) { short_lines(TextStorage_Lines); }
+void test_short_lines_piece_table(void) {
+  short_lines(TextStorage_PieceTable);
+}
+
+static void assert_line_matches(struct text *t, uint32_t line, const char *ref,
+                                uint32_t len, const char *msg) {
+  struct text_chunk chunk = text_get_line(t, line);
+  ASSERT(chunk.nbytes == len && text_line_size(t, line) == len, msg);
+  ASSERT(len == 0 || memcmp(chunk.text, ref, len) == 0, msg);
+}
+
+static void typing(enum text_storage storage) {
+  uint32_t lines_added;
+  struct text *t = text_create(10, storage);
+  char ref[2048];
+  uint32_t len = 0;
+
+  // type one character at a time in the middle of a long line
+  const char *start = "{\"key\": \"value\", \"other\": [1, 2, 3]}";
+  text_insert_at(t, 0, 0, (uint8_t *)start, strlen(start), &lines_added);
+  memcpy(ref, start, strlen(start));
+  len = strlen(start);
+
+  uint32_t at = 9;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    uint8_t c = 'a' + i % 26;
+    text_insert_at(t, 0, at, &c, 1, &lines_added);
+    memmove(ref + at + 1, ref + at, len - at);
+    ref[at++] = c;
+    ++len;
+  }
+  assert_line_matches(t, 0, ref, len, "Expected typed text to be inserted");
+
+  // move the edit point around, reading the line in between
+  uint32_t points[] = {0, len, len / 2, 3, len - 3, len / 2};
+  for (uint32_t i = 0; i < sizeof(points) / sizeof(points[0]); ++i) {
+    at = points[i] > len ? len : points[i];
+    text_insert_at(t, 0, at, (uint8_t *)"xy", 2, &lines_added);
+    memmove(ref + at + 2, ref + at, len - at);
+    memcpy(ref + at, "xy", 2);
+    len += 2;
+    assert_line_matches(t, 0, ref, len,
+                        "Expected text to be inserted at each edit point");
+  }
+
+  // delete before, after and across the last edit point
+  uint32_t deletes[][2] = {{at - 10, at}, {at, at + 10}, {at - 5, at + 5}};
+  for (uint32_t i = 0; i < sizeof(deletes) / sizeof(deletes[0]); ++i) {
+    uint32_t from = deletes[i][0], to = deletes[i][1];
+    text_delete(t, 0, from, 0, to);
+    memmove(ref + from, ref + to, len - to);
+    len -= to - from;
+    assert_line_matches(t, 0, ref, len, "Expected bytes to be deleted");
+    at = from;
+  }
+
+  // backspace a lot, then split and join at the edit point
+  for (uint32_t i = 0; i < 200; ++i) {
+    text_delete(t, 0, at - 1, 0, at);
+    memmove(ref + at - 1, ref + at, len - at);
+    --at;
+    --len;
+  }
+  assert_line_matches(t, 0, ref, len, "Expected bytes to be backspaced");
+
+  text_insert_at(t, 0, at, (uint8_t *)"\n", 1, &lines_added);
+  ASSERT(text_num_lines(t) == 2, "Expected line to be split");
+  assert_line_matches(t, 0, ref, at, "Expected first half to stay");
+  assert_line_matches(t, 1, ref + at, len - at,
+                      "Expected second half to move to the next line");
+
+  text_delete(t, 0, at, 1, 0);
+  ASSERT(text_num_lines(t) == 1, "Expected lines to be joined");
+  assert_line_matches(t, 0, ref, len, "Expected line to be joined");
+
+  // delete almost everything
+  text_delete(t, 0, 4, 0, len - 4);
+  memmove(ref + 4, ref + len - 4, 4);
+  len = 8;
+  assert_line_matches(t, 0, ref, len, "Expected line to be short again");
+
+  text_destroy(t);
+
+  // edit lines that were loaded in bulk
+  const char *loaded = "first loaded line\nsecond loaded line\nthird";
+  uint8_t *bytes = (uint8_t *)strdup(loaded);
+  t = text_create(10, storage);
+  text_load(t, bytes, strlen(loaded));
+
+  text_delete(t, 0, 0, 0, 6);
+  assert_line_matches(t, 0, "loaded line", 11,
+                      "Expected start of loaded line to be deleted");
+  text_delete(t, 1, 13, 1, 18);
+  assert_line_matches(t, 1, "second loaded", 13,
+                      "Expected end of loaded line to be deleted");
+  text_delete(t, 1, 6, 1, 7);
+  assert_line_matches(t, 1, "secondloaded", 12,
+                      "Expected middle of loaded line to be deleted");
+  text_insert_at(t, 2, 5, (uint8_t *)"!", 1, &lines_added);
+  assert_line_matches(t, 2, "third!", 6, "Expected loaded line to grow");
+
+  text_destroy(t);
+}
+
+void test_typing_lines(void) { typing(TextStorage_Lines); }
+void test_typing_piece_table(void) { typing(TextStorage_PieceTable); }
+
+struct collected_spans {
+  uint8_t bytes[256];
+  uint32_t nbytes;
+  uint32_t nspans;
+  const uint8_t *first;
+};
+
+static void collect_span(const uint8_t *bytes, uint32_t nbytes,
+                         void *userdata) {
+  struct collected_spans *spans = (struct collected_spans *)userdata;
+  if (spans->nspans == 0) {
+    spans->first = bytes;
+  }
+  memcpy(spans->bytes + spans->nbytes, bytes, nbytes);
+  spans->nbytes += nbytes;
+  ++spans->nspans;
+}
+
+static void spans(enum text_storage storage) {
+  uint32_t lines_added;
+  struct text *t = text_create(10, storage);
+  const char *txt = "first line\n\nthird line\nlast";
+  text_insert_at(t, 0, 0, (uint8_t *)txt, strlen(txt), &lines_added);
+
+  uint32_t regions[][4] = {
+      {0, 0, 0, 5}, {0, 6, 2, 5},   {0, 0, 3, 4}, {1, 0, 1, 1}, {2, 3, 5, 0},
+      {0, 10, 0, 11}, {3, 2, 3, 2}, {3, 4, 3, 5}, {4, 0, 6, 0},
+  };
+
+  for (uint32_t i = 0; i < sizeof(regions) / sizeof(regions[0]); ++i) {
+    uint32_t *r = regions[i];
+    struct text_chunk region = text_get_region(t, r[0], r[1], r[2], r[3]);
+    struct collected_spans collected = {0};
+    text_for_each_span(t, r[0], r[1], r[2], r[3], collect_span, &collected);
+
+    ASSERT(collected.nbytes == region.nbytes &&
+               text_region_size(t, r[0], r[1], r[2], r[3]) == region.nbytes,
+           "Expected spans to be as long as the region");
+    ASSERT(region.nbytes == 0 ||
+               memcmp(collected.bytes, region.text, region.nbytes) == 0,
+           "Expected spans to have the same bytes as the region");
+
+    if (region.allocated) {
+      free(region.text);
+    }
+  }
+
+  // spans are not copies
+  struct text_chunk line = text_get_line(t, 2);
+  struct collected_spans collected = {0};
+  text_for_each_span(t, 2, 3, 2, 8, collect_span, &collected);
+  ASSERT(collected.nspans == 1 && collected.first == line.text + 3,
+         "Expected a span pointing into the line");
+
+  // a line that is being edited is read on each side of the edit point
+  const char *edited = "third and a half line";
+  text_insert_at(t, 2, 5, (uint8_t *)" and a half", 11, &lines_added);
+  collected = (struct collected_spans){0};
+  text_for_each_span(t, 2, 0, 2, 21, collect_span, &collected);
+  ASSERT(collected.nbytes == 21 && memcmp(collected.bytes, edited, 21) == 0,
+         "Expected spans of an edited line to have its bytes");
+  ASSERT(storage != TextStorage_Lines || collected.nspans == 2,
+         "Expected an edited line to be read in two spans");
+
+  struct utf8_codepoint_iterator iter = text_line_codepoint_iterator(t, 2);
+  struct codepoint *codepoint;
+  uint32_t ncodepoints = 0;
+  bool same = true;
+  while ((codepoint = utf8_next_codepoint(&iter)) != NULL) {
+    same = same && ncodepoints < 21 &&
+           codepoint->codepoint == (uint8_t)edited[ncodepoints];
+    ++ncodepoints;
+  }
+  ASSERT(same && ncodepoints == 21,
+         "Expected to iterate the codepoints of an edited line");
+
+  text_destroy(t);
+}
+
+void test_spans_lines(void) { spans(TextStorage_Lines); }
+void test_spans_piece_table(void) { spans(TextStorage_PieceTable); }
+
+static void changes(enum text_storage storage) {
+  uint32_t lines_added, nchanges;
+  struct text_change changed[4];
+  struct text *t = text_create(10, storage);
+
+  ASSERT(text_generation(t) == 0, "Expected new text to be generation 0");
+  text_get_changes(t, 0, changed, 4, &nchanges);
+  ASSERT(nchanges == 0, "Expected no changes in a new text");
+
+  const char *txt = "one\ntwo\nthree\nfour";
+  text_insert_at(t, 0, 0, (uint8_t *)txt, strlen(txt), &lines_added);
+  uint64_t loaded = text_generation(t);
+  ASSERT(loaded > 0, "Expected generation to increase");
+
+  // typing on one line is one change
+  text_insert_at(t, 1, 3, (uint8_t *)"s", 1, &lines_added);
+  text_insert_at(t, 1, 4, (uint8_t *)"!", 1, &lines_added);
+  text_get_changes(t, loaded, changed, 4, &nchanges);
+  ASSERT(nchanges == 1 && changed[0].start_line == 1 &&
+             changed[0].end_line == 2,
+         "Expected typing to change one line");
+
+  text_delete(t, 3, 0, 3, 2);
+  text_get_changes(t, loaded, changed, 4, &nchanges);
+  ASSERT(nchanges == 2 && changed[1].start_line == 3 &&
+             changed[1].end_line == 4,
+         "Expected deleting to change one line");
+
+  // only what changed since the generation
+  uint64_t deleted = text_generation(t);
+  text_get_changes(t, deleted, changed, 4, &nchanges);
+  ASSERT(nchanges == 0, "Expected no changes since the last generation");
+
+  // nothing changes, no new generation
+  text_delete(t, 0, 1, 0, 1);
+  text_insert_at(t, 0, 1, (uint8_t *)"", 0, &lines_added);
+  ASSERT(text_generation(t) == deleted,
+         "Expected edits that change nothing to keep the generation");
+
+  // new lines move everything after them
+  text_insert_at(t, 2, 0, (uint8_t *)"\n", 1, &lines_added);
+  text_get_changes(t, deleted, changed, 4, &nchanges);
+  ASSERT(nchanges == 1 && changed[0].start_line == 2 &&
+             changed[0].end_line == UINT32_MAX,
+         "Expected adding a line to change everything after it");
+
+  text_delete(t, 0, 3, 1, 0);
+  text_get_changes(t, deleted, changed, 4, &nchanges);
+  ASSERT(nchanges == 2 && changed[1].start_line == 0 &&
+             changed[1].end_line == UINT32_MAX,
+         "Expected joining lines to change everything after them");
+
+  // lots of changes end up merged, but still cover everything
+  uint64_t before_many = text_generation(t);
+  for (uint32_t i = 0; i < 200; ++i) {
+    text_insert_at(t, i % 4, 0, (uint8_t *)"x", 1, &lines_added);
+  }
+  text_get_changes(t, before_many, changed, 4, &nchanges);
+  ASSERT(nchanges == 4, "Expected changes to be merged to fit");
+  uint32_t start = UINT32_MAX, end = 0;
+  for (uint32_t i = 0; i < nchanges; ++i) {
+    start = changed[i].start_line < start ? changed[i].start_line : start;
+    end = changed[i].end_line > end ? changed[i].end_line : end;
+  }
+  ASSERT(start == 0 && end >= 4, "Expected merged changes to cover all lines");
+
+  text_get_changes(t, loaded, changed, 1, &nchanges);
+  ASSERT(nchanges == 1 && changed[0].start_line == 0 &&
+             changed[0].end_line == UINT32_MAX,
+         "Expected old changes to still be covered");
+
+  uint64_t before_clear = text_generation(t);
+  text_clear(t);
+  text_get_changes(t, before_clear, changed, 4, &nchanges);
+  ASSERT(nchanges == 1 && changed[0].start_line == 0 &&
+             changed[0].end_line == UINT32_MAX,
+         "Expected clearing to change everything");
+
+  text_destroy(t);
+}
+
+void test_changes_lines(void) { changes(TextStorage_Lines); }
+void test_changes_piece_table(void) { changes(TextStorage_PieceTable); }
+
+static void assert_texts_eq(struct text *a, struct text *b, const char *msg) {
+  ASSERT(text_num_lines(a) == text_num_lines(b), msg);
+  for (uint32_t line = 0; line < text_num_lines(a); ++line) {
+    struct text_chunk la = text_get_line(a, line);
+    struct text_chunk lb = text_get_line(b, line);
+    ASSERT(la.nbytes == lb.nbytes, msg);
+    ASSERT(la.nbytes == 0 || memcmp(la.text, lb.text, la.nbytes) == 0, msg);
+  }
+}
+
+static void edit_text(struct text *t) {
+  uint32_t lines_added;
+  text_insert_at(t, 1, 3, (uint8_t *)" more", 5, &lines_added);
+  text_insert_at(t, 1, 0, (uint8_t *)">", 1, &lines_added);
+  text_delete(t, 0, 1, 0, 2);
+  text_insert_at(t, 2, 2, (uint8_t *)"\n", 1, &lines_added);
+}
+
+static void snapshots(enum text_storage storage) {
+  const char *initial = "one\ntwo\nthree";
+  struct text *t = text_create(10, storage);
+  struct text *ref = text_create(10, storage);
+  text_load(t, copy_bytes(initial), strlen(initial));
+  text_load(ref, copy_bytes(initial), strlen(initial));
+  edit_text(t);
+  edit_text(ref);
+
+  struct text_snapshot *snapshot = text_snapshot(t);
+  struct text *st = text_snapshot_text(snapshot);
+  assert_texts_eq(st, ref, "Expected snapshot to have the same lines");
+  ASSERT(text_generation(st) == text_generation(t),
+         "Expected snapshot to have the same generation");
+
+  // edit the shared lines, and enough new ones to split blocks
+  uint32_t lines_added;
+  edit_text(t);
+  for (uint32_t i = 0; i < 2000; ++i) {
+    text_insert_at(t, i % 3, 0, (uint8_t *)"x\n", 2, &lines_added);
+  }
+  text_delete(t, 0, 0, 2, 0);
+  assert_texts_eq(st, ref, "Expected snapshot to not change with the text");
+
+  struct text_snapshot *second = text_snapshot(t);
+  text_snapshot_retain(second);
+  text_snapshot_release(snapshot);
+  text_clear(t);
+  ASSERT(text_num_lines(text_snapshot_text(second)) > 2000,
+         "Expected snapshot to outlive cleared text");
+  text_snapshot_release(second);
+  ASSERT(text_num_lines(text_snapshot_text(second)) > 2000,
+         "Expected retained snapshot to still be valid");
+  text_snapshot_release(second);
+
+  text_destroy(ref);
+  text_destroy(t);
+}
+
+void test_snapshots_lines(void) { snapshots(TextStorage_Lines); }
+void test_snapshots_piece_table(void) { snapshots(TextStorage_PieceTable); }
+
+struct snapshot_reader {
+  struct text_snapshot *snapshot;
+  uint64_t nbytes;
+};
+
+static void *read_snapshot(void *userdata) {
+  struct snapshot_reader *reader = (struct snapshot_reader *)userdata;
+  struct text *t = text_snapshot_text(reader->snapshot);
+  for (uint32_t pass = 0; pass < 20; ++pass) {
+    reader->nbytes = 0;
+    for (uint32_t line = 0; line < text_num_lines(t); ++line) {
+      reader->nbytes += text_get_line(t, line).nbytes;
+    }
+  }
+
+  text_snapshot_release(reader->snapshot);
+  return NULL;
+}
+
+void test_snapshot_thread(void) {
+  struct text *t = text_create(10, TextStorage_Lines);
+  uint32_t lines_added;
+  for (uint32_t i = 0; i < 3000; ++i) {
+    text_insert_at(t, i, 0, (uint8_t *)"some longer line\n", 17, &lines_added);
+  }
+
+  // leave gaps open in lines that are then moved to a new block by a split
+  for (uint32_t i = 0; i < 3000; ++i) {
+    text_insert_at(t, i, 4, (uint8_t *)"!?", 2, &lines_added);
+    text_delete(t, i, 4, i, 6);
+  }
+  text_insert_at(t, 100, 0, (uint8_t *)"\n", 1, &lines_added);
+  text_delete(t, 100, 0, 101, 0);
+
+  struct snapshot_reader reader = {.snapshot = text_snapshot(t)};
+  pthread_t thread;
+  ASSERT(pthread_create(&thread, NULL, read_snapshot, &reader) == 0,
+         "Expected reader thread to start");
+
+  for (uint32_t i = 0; i < 3000; ++i) {
+    text_insert_at(t, i, 4, (uint8_t *)"!", 1, &lines_added);
+    text_delete(t, i / 2, 0, i / 2, 1);
+  }
+  text_destroy(t);
+
+  pthread_join(thread, NULL);
+  ASSERT(reader.nbytes == 3000 * 16, "Expected reader to see the snapshot");
+}
+
+void test_storage_equivalence(void) {
+  struct text *lines = text_create(10, TextStorage_Lines);
+  struct text *pieces = text_create(10, TextStorage_PieceTable);
+  const char *initial = "some\ninitial\n\ntext";
+  text_load(lines, copy_bytes(initial), strlen(initial));
+  text_load(pieces, copy_bytes(initial), strlen(initial));
+
+  const char *fragments[] = {"a", "hello", "\n", "two\nlines", "\n\n", "åäö"};
+  const uint32_t nfragments = sizeof(fragments) / sizeof(fragments[0]);
+
+  // simple deterministic lcg so that failures are reproducible
+  uint32_t seed = 1234;
+#define NEXT() (seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7fff)
+
+  for (uint32_t i = 0; i < 2000; ++i) {
+    uint32_t nlines = text_num_lines(lines);
+    uint32_t line = NEXT() % (nlines + 2);
+    uint32_t col = NEXT() % (text_line_size(lines, line) + 1);
+
+    if (NEXT() % 3 != 0) {
+      const char *f = fragments[NEXT() % nfragments];
+      uint32_t added_lines, added_pieces;
+      text_insert_at(lines, line, col, (uint8_t *)f, strlen(f), &added_lines);
+      text_insert_at(pieces, line, col, (uint8_t *)f, strlen(f),
+                     &added_pieces);
+      ASSERT(added_lines == added_pieces,
+             "Expected both storages to report the same added lines");
+    } else {
+      uint32_t end_line = line + NEXT() % 3;
+      uint32_t end_col = NEXT() % (text_line_size(lines, end_line) + 2);
+      if (end_line == line && end_col < col) {
+        end_col = col;
+      }
+      text_delete(lines, line, col, end_line, end_col);
+      text_delete(pieces, line, col, end_line, end_col);
+    }
+
+    assert_texts_eq(lines, pieces,
+                    "Expected both storages to contain the same text");
+  }
+
+  uint32_t nlines = text_num_lines(lines);
+  struct text_chunk ra = text_get_region(lines, 0, 0, nlines, 0);
+  struct text_chunk rb = text_get_region(pieces, 0, 0, nlines, 0);
+  ASSERT(ra.nbytes == rb.nbytes && memcmp(ra.text, rb.text, ra.nbytes) == 0,
+         "Expected both storages to return the same region");
+  free(ra.text);
+  free(rb.text);
+
+#undef NEXT
+
+  text_destroy(lines);
+  text_destroy(pieces);
+}
+
+void test_properties(void) {
+  struct text *t = text_create(10, TextStorage_Lines);
+  uint32_t ranges[][4] = {
+      {0, 0, 0, 4}, {0, 2, 2, 1}, {1, 5, 1, 5}, {3, 0, 5, 9}, {0, 3, 0, 3},
+  };
+  const uint32_t nranges = sizeof(ranges) / sizeof(ranges[0]);
+  for (uint32_t i = 0; i < nranges; ++i) {
+    uint32_t *r = ranges[i];
+    text_add_property(t, r[0], r[1], r[2], r[3],
+                      (struct text_property){
+                          .type = TextProperty_Data,
+                          .data.userdata = (void *)(uintptr_t)i,
+                      });
+  }
+
+  for (uint32_t line = 0; line < 7; ++line) {
+    for (uint32_t col = 0; col < 12; ++col) {
+      struct text_property *props[8];
+      uint32_t nprops = 0, expected = 0;
+      text_get_properties(t, line, col, props, 8, &nprops);
+
+      for (uint32_t i = 0; i < nranges; ++i) {
+        struct location start = {.line = ranges[i][0], .col = ranges[i][1]};
+        struct location end = {.line = ranges[i][2], .col = ranges[i][3]};
+        if (location_is_between((struct location){.line = line, .col = col},
+                                start, end)) {
+          ASSERT(expected < nprops && props[expected]->data.userdata ==
+                                          (void *)(uintptr_t)i,
+                 "Expected properties in the order they were added");
+          ++expected;
+        }
+      }
+      ASSERT(nprops == expected, "Expected only covering properties");
+    }
+  }
+
+  struct text_line_property line_props[8];
+  uint32_t nprops = 0;
+  text_get_line_properties(t, 1, line_props, 8, &nprops);
+  ASSERT(nprops == 2, "Expected two properties on the second line");
+  ASSERT(line_props[0].start == 0 && line_props[0].end == UINT32_MAX,
+         "Expected a property covering the whole line");
+  ASSERT(line_props[1].start == 5 && line_props[1].end == 5,
+         "Expected a property covering a single byte");
+
+  text_get_line_properties(t, 6, line_props, 8, &nprops);
+  ASSERT(nprops == 0, "Expected no properties after the last one");
+
+  // more properties than fit are still counted, next to the one from line 3
+  for (uint32_t i = 0; i < 20; ++i) {
+    text_add_property(t, 3, i, 3, i,
+                      (struct text_property){.type = TextProperty_Data});
+  }
+  uint32_t nfound = text_get_line_properties(t, 3, line_props, 8, &nprops);
+  ASSERT(nprops == 8 && nfound == 21,
+         "Expected all properties on a line to be counted");
+
+  text_clear_properties(t);
+  text_get_line_properties(t, 0, line_props, 8, &nprops);
+  ASSERT(nprops == 0, "Expected no properties after clearing");
+
+  text_destroy(t);
+}
+
+static void assert_property_at(struct text *t, uint32_t line, uint32_t offset,
+                               bool expected, const char *msg) {
+  struct text_property *props[4];
+  uint32_t nprops = 0;
+  text_get_properties(t, line, offset, props, 4, &nprops);
+  ASSERT((nprops > 0) == expected, msg);
+}
+
+void test_property_layers(void) {
+  struct text *t = text_create(10, TextStorage_Lines);
+  const char *txt = "first line\nsecond line\nthird line";
+  text_load(t, copy_bytes(txt), strlen(txt));
+
+  uint32_t layer = text_property_layer("test");
+  ASSERT(layer != 0 && text_property_layer("test") == layer,
+         "Expected named layers to have stable ids");
+  struct text_property prop = {.type = TextProperty_Data};
+  text_add_layer_property(t, layer, 1, 0, 1, 5, prop);
+  text_add_property(t, 0, 0, 0, 4, prop);
+
+  // typing before a property moves it
+  uint32_t lines_added;
+  text_insert_at(t, 1, 0, (uint8_t *)">> ", 3, &lines_added);
+  assert_property_at(t, 1, 0, false, "Expected property to move right");
+  assert_property_at(t, 1, 3, true, "Expected property to start later");
+  assert_property_at(t, 1, 8, true, "Expected property to end later");
+  assert_property_at(t, 1, 9, false, "Expected property end to move");
+
+  // so do new lines
+  text_insert_at(t, 0, 6, (uint8_t *)"\n\n", 2, &lines_added);
+  assert_property_at(t, 3, 3, true, "Expected property to move down");
+  assert_property_at(t, 1, 3, false, "Expected property to not stay");
+
+  // deleting text before and inside it shrinks it
+  text_delete(t, 3, 0, 3, 5);
+  assert_property_at(t, 3, 0, true, "Expected property to move left");
+  assert_property_at(t, 3, 3, true, "Expected property to be shorter");
+  assert_property_at(t, 3, 4, false, "Expected property end to move left");
+
+  // joining lines moves it up
+  text_delete(t, 2, 4, 3, 0);
+  assert_property_at(t, 2, 4, true, "Expected property to move up");
+  assert_property_at(t, 2, 7, true, "Expected property to keep its length");
+
+  // clearing a layer leaves the others
+  text_clear_layer(t, layer);
+  assert_property_at(t, 2, 4, false, "Expected layer to be cleared");
+  assert_property_at(t, 0, 0, true, "Expected other layers to be kept");
+
+  // unnamed layers are separate from each other and from the named ones
+  uint32_t unnamed = text_property_layer_new();
+  ASSERT(unnamed != layer && text_property_layer_new() != unnamed,
+         "Expected unnamed layers to get ids of their own");
+  text_add_layer_property(t, unnamed, 2, 4, 2, 5, prop);
+  text_clear_layer(t, layer);
+  assert_property_at(t, 2, 4, true, "Expected unnamed layer to be kept");
+  text_clear_layer(t, unnamed);
+  assert_property_at(t, 2, 4, false, "Expected unnamed layer to be cleared");
+
+  // properties that are deleted entirely are removed
+  text_add_layer_property(t, layer, 2, 1, 2, 2, prop);
+  text_delete(t, 2, 0, 2, 4);
+  assert_property_at(t, 2, 0, false, "Expected deleted property to be gone");
+
+  // the generation only changes when the properties do
+  uint64_t generation = text_properties_generation(t);
+  text_clear_layer(t, layer);
+  ASSERT(text_properties_generation(t) == generation,
+         "Expected clearing an empty layer to keep the generation");
+  text_add_layer_property(t, layer, 0, 0, 0, 1, prop);
+  ASSERT(text_properties_generation(t) != generation,
+         "Expected adding a property to change the generation");
+  generation = text_properties_generation(t);
+  text_clear_layer(t, layer);
+  ASSERT(text_properties_generation(t) != generation,
+         "Expected clearing a layer to change the generation");
+
+  text_destroy(t);
+
+  // the properties around one that is deleted entirely keep being found
+  t = text_create(10, TextStorage_Lines);
+  text_load(t, copy_bytes("one two three"), 13);
+  text_add_property(t, 0, 0, 0, 2, prop);
+  text_add_property(t, 0, 4, 0, 6, prop);
+  text_add_property(t, 0, 8, 0, 12, prop);
+  assert_property_at(t, 0, 8, true, "Expected last property to be found");
+
+  text_delete(t, 0, 3, 0, 7);
+  assert_property_at(t, 0, 0, true, "Expected first property to stay");
+  assert_property_at(t, 0, 3, false, "Expected middle property to be gone");
+  assert_property_at(t, 0, 4, true, "Expected last property to move left");
+  assert_property_at(t, 0, 8, true, "Expected last property to keep its end");
+  assert_property_at(t, 0, 9, false, "Expected nothing after the last one");
+
+  text_destroy(t);
+}
+
+static uint64_t text_bytes(struct text *t) {
+  // offset of the line past the end is the size of the text
+  return text_line_offset(t, text_num_lines(t));
+}
+
+static void markers(enum text_storage storage) {
+  struct text *t = text_create(10, storage);
+  const char *txt = "first line\nsecond line\nthird line";
+  text_load(t, copy_bytes(txt), strlen(txt));
+
+  struct marker *markers[64];
+  uint64_t expected[64];
+  enum marker_gravity gravity[64];
+  for (uint32_t mi = 0; mi < 64; ++mi) {
+    gravity[mi] = mi % 2 == 0 ? MarkerGravity_Left : MarkerGravity_Right;
+    expected[mi] = mi % text_bytes(t);
+    struct location loc = text_offset_location(t, expected[mi]);
+    markers[mi] = text_add_marker(t, loc.line, loc.col, gravity[mi]);
+  }
+
+  uint32_t seed = 1234, lines_added;
+  for (uint32_t editi = 0; editi < 500; ++editi) {
+    seed = seed * 1103515245 + 12345;
+    uint64_t size = text_bytes(t);
+    uint64_t at = (seed >> 8) % size;
+
+    if (seed % 3 != 0) {
+      const char *ins = editi % 5 == 0 ? "x\ny" : "abc";
+      uint32_t nbytes = editi % 5 == 0 ? 3 : 1 + (editi % 3);
+      struct location loc = text_offset_location(t, at);
+      text_insert_at(t, loc.line, loc.col, (uint8_t *)ins, nbytes,
+                     &lines_added);
+      for (uint32_t mi = 0; mi < 64; ++mi) {
+        if (expected[mi] > at ||
+            (expected[mi] == at && gravity[mi] == MarkerGravity_Right)) {
+          expected[mi] += nbytes;
+        }
+      }
+    } else {
+      // never delete the last byte, that could remove an empty last line
+      uint64_t end = at + 1 + (seed >> 4) % 4;
+      end = end < size ? end : size - 1;
+      if (end <= at) {
+        continue;
+      }
+
+      struct location from = text_offset_location(t, at);
+      struct location to = text_offset_location(t, end);
+      text_delete(t, from.line, from.col, to.line, to.col);
+      for (uint32_t mi = 0; mi < 64; ++mi) {
+        if (expected[mi] >= end) {
+          expected[mi] -= end - at;
+        } else if (expected[mi] >= at) {
+          expected[mi] = at;
+        }
+      }
+    }
+
+    for (uint32_t mi = 0; mi < 64; ++mi) {
+      if (markers[mi] == NULL) {
+        continue;
+      }
+
+      struct location loc = text_marker_location(t, markers[mi]);
+      ASSERT(text_line_offset(t, loc.line) + loc.col == expected[mi],
+             "Expected marker to follow the edits");
+    }
+
+    // markers can be removed at any time
+    if (editi % 50 == 0) {
+      text_remove_marker(t, markers[editi / 50]);
+      markers[editi / 50] = NULL;
+    }
+  }
+
+  text_clear(t);
+  struct location loc = text_marker_location(t, markers[63]);
+  ASSERT(loc.line == 0 && loc.col == 0,
+         "Expected markers to be at the start after clearing the text");
+
+  text_destroy(t);
+}
+
+void test_markers_lines(void) { markers(TextStorage_Lines); }
+
+void test_markers_piece_table(void) { markers(TextStorage_PieceTable); }
+
 void run_text_tests(void) {
-  run_test(test_add_text);
-  run_test(test_delete_text);
+  run_test(test_add_text_lines);
+  run_test(test_add_text_piece_table);
+  run_test(test_delete_text_lines);
+  run_test(test_delete_text_piece_table);
+  run_test(test_load_lines);
+  run_test(test_load_piece_table);
+  run_test(test_mapped_lines);
+  run_test(test_mapped_piece_table);
+  run_test(test_offsets_lines);
+  run_test(test_offsets_piece_table);
+  run_test(test_many_lines_lines);
+  run_test(test_many_lines_piece_table);
+  run_test(test_short_lines_lines);
+  run_test(test_short_lines_piece_table);
+  run_test(test_typing_lines);
+  run_test(test_typing_piece_table);
+  run_test(test_spans_lines);
+  run_test(test_spans_piece_table);
+  run_test(test_changes_lines);
+  run_test(test_changes_piece_table);
+  run_test(test_snapshots_lines);
+  run_test(test_snapshots_piece_table);
+  run_test(test_snapshot_thread);
+  run_test(test_storage_equivalence);
+  run_test(test_properties);
+  run_test(test_property_layers);
+  run_test(test_markers_lines);
+  run_test(test_markers_piece_table);
 }